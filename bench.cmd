@@ -0,0 +1,11 @@
+ver
+bench
+prof start 1000
+bench kmalloc
+user sysbench
+exec scan.elf pages.elf
+ipcbench
+wm bench
+prof stop
+prof report
+shutdown
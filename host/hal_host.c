@@ -0,0 +1,101 @@
+/*
+ * chocola host harness — HAL backed by a disk image file and memory
+ *
+ * Sectors live in an image file (a temporary one unless -d is given);
+ * the framebuffer is HOST_FB_SIZE bytes and hal_fb_bank() slides the
+ * 64KB window over it like the VBE bank register does.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "host/host.h"
+
+volatile unsigned int ticks;
+
+unsigned char host_fb[HOST_FB_SIZE];
+unsigned char *hal_fb_win = host_fb;
+unsigned host_bank_switches, host_sector_reads, host_sector_writes, host_flushes;
+int host_writes_left = -1;
+unsigned long host_mirrored;
+int host_echo;
+
+static FILE *host_disk;
+
+int hal_task(void) { return 0; }
+
+unsigned long long hal_cycles(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000u + (unsigned long long)ts.tv_nsec;   /* ns */
+}
+
+void hal_fb_bank(int bank)
+{
+	hal_fb_win = host_fb + (unsigned)bank * VGA_BANK_SIZE;
+	host_bank_switches++;
+}
+
+/* A fresh image of the given size; all zero is an empty Chocola FS */
+int host_disk_open(const char *path, unsigned sectors)
+{
+	static const unsigned char zero[512];
+	unsigned i;
+	host_disk = path ? fopen(path, "w+b") : tmpfile();
+	if (!host_disk) return -1;
+	for (i = 0; i < sectors; i++)
+		if (fwrite(zero, 1, 512, host_disk) != 512) return -1;
+	return 0;
+}
+
+void host_disk_close(void)
+{
+	if (host_disk) fclose(host_disk);
+	host_disk = 0;
+}
+
+/* Past the end of the image reads as zeros, like a blank disk */
+void hal_read_sector(unsigned lba, void *buf)
+{
+	size_t n = 0;
+	host_sector_reads++;
+	if (fseek(host_disk, (long)lba * 512, SEEK_SET) == 0)
+		n = fread(buf, 1, 512, host_disk);
+	memset((unsigned char *)buf + n, 0, 512 - n);
+}
+
+void hal_write_sector(unsigned lba, const void *buf)
+{
+	if (host_writes_left == 0) return;      /* the power is off */
+	if (host_writes_left > 0) host_writes_left--;
+	host_sector_writes++;
+	if (fseek(host_disk, (long)lba * 512, SEEK_SET) != 0 || fwrite(buf, 1, 512, host_disk) != 512)
+		fprintf(stderr, "hal_write_sector: lba %u failed\n", lba);
+}
+
+void hal_read_sectors(unsigned lba, unsigned n, void *buf)
+{
+	for (; n--; lba++, buf = (unsigned char *)buf + 512) hal_read_sector(lba, buf);
+}
+
+void hal_write_sectors(unsigned lba, unsigned n, const void *buf)
+{
+	for (; n--; lba++, buf = (const unsigned char *)buf + 512) hal_write_sector(lba, buf);
+}
+
+void hal_flush(void)
+{
+	host_flushes++;
+	fflush(host_disk);
+}
+
+int hal_console_sink(char c) { (void)c; return 0; }
+
+void hal_console_mirror(char c)
+{
+	host_mirrored++;
+	if (host_echo) putchar(c);
+}
+
+void hal_scroll_enter(void) { }
+void hal_scroll_leave(void) { }
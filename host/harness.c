@@ -0,0 +1,537 @@
+/*
+ * chocola host harness — stress tests and benchmarks for the portable
+ * kernel units (heap.c, fs.c, console.c, wm.c), built natively by 'make host'.
+ *
+ * Usage: chocola-host [test|bench|all] [-n ops] [-s seed] [-d disk.img] [-v]
+ *
+ * 'test' runs randomised operation sequences against a reference model
+ * and checks the unit's invariants as it goes; it exits non-zero on the
+ * first mismatch and prints the seed to replay it. 'bench' prints one
+ * "BENCH name=... ns_op=... per_sec=..." line per result, like the
+ * kernel's bench command.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "host/host.h"
+#include "kernel/heap.h"
+#include "kernel/fs.h"
+#include "kernel/wm.h"
+
+#define HEAP_ARENA    0x200000          /* same as the kernel heap */
+#define DISK_SECTORS  32768             /* same as mikiros.img */
+#define FILE_MAX      4096
+
+static unsigned seed = 12345, nops = 200000;
+static const char *disk_path;
+static int failed;
+
+static unsigned rnd(void)
+{
+	seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+	return seed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define CHECK(cond, ...) do { if (!(cond)) { \
+	fprintf(stderr, "FAIL %s:%d: ", __func__, __LINE__); fprintf(stderr, __VA_ARGS__); \
+	fputc('\n', stderr); failed = 1; return; } } while (0)
+
+static void bench_line(const char *name, double secs, unsigned long ops)
+{
+	printf("BENCH name=%s ns_op=%.1f per_sec=%.0f\n", name, secs * 1e9 / ops, ops / secs);
+}
+
+/* ---- Heap ---- */
+
+static void *arena;
+
+static void heap_reset(void)
+{
+	if (!arena && !(arena = malloc(HEAP_ARENA))) { perror("malloc"); exit(2); }
+	memset(heap_task_bytes, 0, sizeof(heap_task_bytes));
+	memset(&heap_zstats, 0, sizeof(heap_zstats));
+	heap_init(arena, HEAP_ARENA);
+}
+
+/* Blocks tile the arena exactly; used bytes agree with every counter */
+static int heap_walk(unsigned *used, unsigned *nfree, unsigned *largest)
+{
+	struct heap_block *b;
+	unsigned char *p = arena;
+	*used = *nfree = *largest = 0;
+	for (b = heap_head; b; b = b->next) {
+		if ((unsigned char *)b != p) return -1;
+		p += sizeof(*b) + b->size;
+		if (b->used) *used += b->size;
+		else { (*nfree)++; if (b->size > *largest) *largest = b->size; }
+	}
+	return p == (unsigned char *)arena + HEAP_ARENA ? 0 : -1;
+}
+
+#define HEAP_SLOTS 512
+
+static void test_heap(void)
+{
+	static struct { unsigned char *p; unsigned n; unsigned char pat; } s[HEAP_SLOTS];
+	unsigned i, k, j, used, nfree, largest, u2, f2;
+
+	heap_reset();
+	heap_track_set(1);
+	for (i = 0; i < nops; i++) {
+		k = rnd() % HEAP_SLOTS;
+		if (s[k].p) {
+			for (j = 0; j < s[k].n; j++)
+				CHECK(s[k].p[j] == s[k].pat, "op %u: block %p byte %u overwritten", i, (void *)s[k].p, j);
+			kfree(s[k].p); s[k].p = 0;
+		} else {
+			unsigned n = rnd() % 8 ? 1 + rnd() % 512 : 1 + rnd() % 32768, z = rnd() % 4 == 0;
+			s[k].p = z ? kzalloc(n) : kmalloc(n);
+			if (!s[k].p) {
+				CHECK(heap_walk(&used, &nfree, &largest) == 0, "op %u: heap list corrupt", i);
+				CHECK(largest < n, "op %u: kmalloc(%u) failed with a %u byte block free", i, n, largest);
+				continue;
+			}
+			CHECK(((unsigned long)s[k].p & (sizeof(void *) - 1)) == 0, "op %u: misaligned %p", i, (void *)s[k].p);
+			for (j = 0; z && j < n; j++)
+				CHECK(!s[k].p[j], "op %u: kzalloc(%u) byte %u not zero", i, n, j);
+			s[k].n = n; s[k].pat = (unsigned char)rnd();
+			memset(s[k].p, s[k].pat, n);
+		}
+		if (rnd() % 8 == 0) heap_zero_idle();       /* the idle task got a turn */
+		if (i % 1024 == 0 || i == nops - 1) {
+			CHECK(heap_walk(&used, &nfree, &largest) == 0, "op %u: heap list corrupt", i);
+			heap_usage(&u2, &f2);
+			CHECK(u2 == used, "op %u: heap_usage %u, walk %u", i, u2, used);
+			CHECK(heap_live == used, "op %u: heapstat live %u, walk %u", i, heap_live, used);
+			CHECK(heap_task_bytes[0] == used, "op %u: task bytes %u, walk %u", i, heap_task_bytes[0], used);
+		}
+	}
+	for (k = 0; k < HEAP_SLOTS; k++) if (s[k].p) { kfree(s[k].p); s[k].p = 0; }
+	heap_zdrain();
+	CHECK(heap_walk(&used, &nfree, &largest) == 0 && used == 0, "heap not empty after draining");
+	heap_track_set(0);
+	printf("heap: %u ops ok, peak %u bytes, %u free blocks after draining (largest %u), kzalloc %u hits %u misses\n",
+	       nops, heap_peak, nfree, largest, heap_zstats.hits, heap_zstats.misses);
+}
+
+/* Same mix as the kernel's 'bench kmalloc': 64 slots, 16..2063 bytes */
+static void bench_heap(void)
+{
+	void *slot[64] = { 0 };
+	unsigned i, k, used, nfree, largest;
+	double t, th, tm;
+
+	heap_reset();
+	t = now();
+	for (i = 0; i < nops; i++) {
+		k = rnd() % 64;
+		if (slot[k]) { kfree(slot[k]); slot[k] = 0; }
+		else slot[k] = kmalloc(16 + rnd() % 2048);
+	}
+	t = now() - t;
+	heap_walk(&used, &nfree, &largest);
+	bench_line("host_kmalloc", t, nops);
+	printf("  live %u bytes in 64 slots, %u free blocks\n", used, nfree);
+	for (k = 0; k < 64; k++) if (slot[k]) kfree(slot[k]);
+
+	/* kzalloc of a task stack: a full pool's worth, then as many with the pool empty */
+	for (i = 0, th = tm = 0; i < nops / 64; i++) {
+		while (heap_zero_idle());
+		t = now();
+		for (k = 0; k < HEAP_ZPOOL; k++) slot[k] = kzalloc(HEAP_ZBLOCK);
+		th += now() - t;
+		for (k = 0; k < HEAP_ZPOOL; k++) kfree(slot[k]);
+		t = now();
+		for (k = 0; k < HEAP_ZPOOL; k++) slot[k] = kzalloc(HEAP_ZBLOCK);
+		tm += now() - t;
+		for (k = 0; k < HEAP_ZPOOL; k++) kfree(slot[k]);
+	}
+	bench_line("host_kzalloc_pool", th, (unsigned long)i * HEAP_ZPOOL);
+	bench_line("host_kzalloc_zero", tm, (unsigned long)i * HEAP_ZPOOL);
+}
+
+/* ---- Chocola FS ---- */
+
+/* data/len: the files now; kept/klen: as of the last commit */
+static struct { char name[8]; unsigned char *data, *kept; unsigned len, klen; } model[24];
+
+static void fs_reset(void)
+{
+	host_disk_close();
+	if (host_disk_open(disk_path, DISK_SECTORS) < 0) { perror("disk image"); exit(2); }
+	host_writes_left = -1;
+	fs_mount();
+}
+
+/* Move the model's committed state forward to now, or back to it */
+static unsigned fs_model_sync(int rollback)
+{
+	unsigned k, live = 0;
+	for (k = 0; k < 24; k++) {
+		unsigned char **from = rollback ? &model[k].kept : &model[k].data;
+		unsigned char **to = rollback ? &model[k].data : &model[k].kept;
+		unsigned len = rollback ? model[k].klen : model[k].len;
+		free(*to); *to = 0;
+		if (*from) { *to = malloc(len); memcpy(*to, *from, len); live++; }
+		model[k].len = model[k].klen = len;
+	}
+	return live;
+}
+
+static void test_fs(void)
+{
+	static unsigned char buf[FILE_MAX];
+	struct fs_entry e[FS_MAX_FILES], fe;
+	unsigned i, k, j, n, off, c, live = 0, ops = nops / 20, cuts = 0, replays = 0;
+	int r, stream, commit;
+
+	fs_reset();
+	/* Group commit: a hundred creates and deletes, then one record */
+	n = host_flushes;
+	for (i = 0; i < 100; i++) { fs_create("tmp", "x", 1); fs_delete("tmp"); }
+	fs_commit();
+	CHECK(host_flushes - n == 2 && fs_stats.commits == 1 && fs_stats.ops == 200,
+	      "100 creates and deletes: %u flushes, %u commits of %u ops", host_flushes - n, fs_stats.commits, fs_stats.ops);
+	/* A create in steps holds no lock while it writes its data: a create
+	 * in the meantime goes past its reserved sectors */
+	r = fs_create_begin("big", 4096, &fe);
+	CHECK(r == 0 && fs_create("mid", "y", 1) == 0 && fs_find("mid", &e[0]) == 0 && e[0].start >= fe.start + 8,
+	      "create during a create in steps: %d, sector %u inside %u+8", r, e[0].start, fe.start);
+	CHECK(fs_create_end(&fe, 1) == 0, "create in steps after another create");
+	fs_delete("big"); fs_delete("mid"); fs_commit();
+	for (k = 0; k < 24; k++) {
+		sprintf(model[k].name, "f%02u", k);
+		free(model[k].data); free(model[k].kept); model[k].data = model[k].kept = 0;
+	}
+	for (i = 0; i < ops; i++) {
+		k = rnd() % 24;
+		if (rnd() % 32 == 0) {
+			/* Commit with the power cut after 0 or 1 of the record's
+			 * 2 sectors, or after all of it, or not at all; remount,
+			 * and the files are as of the last complete record */
+			j = rnd() % 4;
+			host_writes_left = j < 3 ? (int)j : -1;
+			fs_commit();
+			host_writes_left = -1;
+			live = fs_model_sync(j < 2);
+			cuts += j < 3;
+			fs_mount();
+			replays += fs_stats.replayed;
+			for (k = 0; k < 24; k++) {
+				r = fs_find(model[k].name, &fe);
+				CHECK(r == (model[k].data ? 0 : FS_ENOENT), "op %u: after remount, find %s: %d", i, model[k].name, r);
+				if (r) continue;
+				n = fs_read(&fe, 0, buf, FILE_MAX);
+				CHECK(n == model[k].len && memcmp(buf, model[k].data, n) == 0, "op %u: after remount, %s differs", i, fe.name);
+			}
+			continue;
+		}
+		switch (rnd() % 4) {
+		case 0:                 /* create */
+			n = 1 + rnd() % FILE_MAX;
+			for (j = 0; j < n; j++) buf[j] = (unsigned char)rnd();
+			stream = rnd() % 2; commit = rnd() % 8 != 0;
+			if (!stream) r = fs_create(model[k].name, buf, n);
+			else if ((r = fs_create_begin(model[k].name, n, &fe)) == 0) {
+				/* in sector-multiple chunks, then commit or (1 in 8) drop it */
+				for (off = 0; off < n; off += c) {
+					c = 512 * (1 + rnd() % 4); if (c > n - off) c = n - off;
+					fs_write(&fe, off, buf + off, c);
+				}
+				fs_create_end(&fe, commit);
+				if (!commit) {
+					CHECK(fs_find(model[k].name, &fe) == FS_ENOENT, "op %u: dropped create of %s is visible", i, model[k].name);
+					break;
+				}
+			}
+			if (model[k].data) CHECK(r == FS_EEXIST, "op %u: create %s over a file: %d", i, model[k].name, r);
+			else if (live == FS_MAX_FILES) CHECK(r == FS_EFULL, "op %u: create in a full directory: %d", i, r);
+			else {
+				CHECK(r == 0, "op %u: create %s: %d", i, model[k].name, r);
+				model[k].data = malloc(n); memcpy(model[k].data, buf, n); model[k].len = n; live++;
+			}
+			break;
+		case 1:                 /* delete */
+			r = fs_delete(model[k].name);
+			CHECK(r == (model[k].data ? 0 : FS_ENOENT), "op %u: delete %s: %d", i, model[k].name, r);
+			if (model[k].data) { free(model[k].data); model[k].data = 0; live--; }
+			break;
+		default:                /* read all, then a random slice */
+			r = fs_find(model[k].name, &fe);
+			CHECK(r == (model[k].data ? 0 : FS_ENOENT), "op %u: find %s: %d", i, model[k].name, r);
+			if (r) break;
+			CHECK(fe.size == model[k].len, "op %u: %s size %u, want %u", i, fe.name, fe.size, model[k].len);
+			n = fs_read(&fe, 0, buf, FILE_MAX);
+			CHECK(n == model[k].len && memcmp(buf, model[k].data, n) == 0, "op %u: %s content differs", i, fe.name);
+			off = rnd() % (fe.size + 1); n = rnd() % 1100;
+			j = fs_read(&fe, off, buf, n);
+			CHECK(j == (n < fe.size - off ? n : fe.size - off) && memcmp(buf, model[k].data + off, j) == 0,
+			      "op %u: %s slice %u+%u differs", i, fe.name, off, n);
+			off = 512 * (rnd() % (fe.size / 512 + 1));
+			j = fs_read_sectors(&fe, off, buf, FILE_MAX - off);
+			CHECK(j == (off < fe.size ? fe.size - off : 0) && memcmp(buf, model[k].data + off, j) == 0,
+			      "op %u: %s sectors from %u differ", i, fe.name, off);
+			break;
+		}
+		if (i % 64 == 0) {
+			n = (unsigned)fs_list(e);
+			CHECK(n == live, "op %u: fs_list %u files, model %u", i, n, live);
+			for (j = 0; j < n; j++) {
+				k = (unsigned)atoi(e[j].name + 1);
+				CHECK(k < 24 && model[k].data && model[k].len == e[j].size, "op %u: stray entry %s", i, e[j].name);
+			}
+		}
+	}
+	printf("fs: %u ops ok, %u files live, %u sector reads, %u writes, %u power cuts, %u replays\n",
+	       ops, live, host_sector_reads, host_sector_writes, cuts, replays);
+}
+
+static void bench_fs(void)
+{
+	static unsigned char buf[FILE_MAX];
+	struct fs_entry fe;
+	unsigned i, ops = nops / 20;
+	double t;
+
+	fs_reset();
+	memset(buf, 'x', sizeof(buf));
+	t = now();
+	for (i = 0; i < ops; i++) {
+		fs_create("bench", buf, 1 + i % FILE_MAX);
+		fs_find("bench", &fe);
+		fs_read(&fe, 0, buf, FILE_MAX);
+		fs_delete("bench");
+	}
+	t = now() - t;
+	bench_line("host_fs_cycle", t, ops);
+	printf("  create+find+read+delete, 1..%u bytes, image %s\n", FILE_MAX, disk_path ? disk_path : "(tmpfile)");
+}
+
+/* ---- Console ---- */
+
+/* Row 0 of each glyph is its code and cell 0 is blank, so the expected
+ * framebuffer follows from the character grid alone */
+static unsigned char host_font[256 * CHAR_H];
+static unsigned char grid[CONSOLE_ROWS][CONSOLE_COLS];
+static int gx, gy;
+
+static void console_reset(void)
+{
+	unsigned c, r;
+	for (c = 1; c < 256; c++)
+		for (r = 0; r < CHAR_H; r++)
+			host_font[c * CHAR_H + r] = (unsigned char)(r ? c * 31 + r * 17 : c);
+	font = host_font;
+	memset(host_fb, 0, sizeof(host_fb));
+	vga_clear();
+	memset(grid, 0, sizeof(grid));
+	gx = gy = 0;
+}
+
+static void model_putchar(char c)
+{
+	if (c == '\n') { gx = 0; gy++; }
+	else if (c == '\b') { if (gx > 0) grid[gy][--gx] = ' '; }
+	else if (c == '\t') { gx = (gx + 4) & ~3; if (gx >= CONSOLE_COLS) { gx = 0; gy++; } }
+	else { grid[gy][gx++] = (unsigned char)c; if (gx >= CONSOLE_COLS) { gx = 0; gy++; } }
+	if (gy >= CONSOLE_ROWS) {
+		memmove(grid[0], grid[1], sizeof(grid) - sizeof(grid[0]));
+		memset(grid[CONSOLE_ROWS - 1], 0, sizeof(grid[0]));
+		gy = CONSOLE_ROWS - 1;
+	}
+}
+
+/* First pixel that differs from the grid, or -1 */
+static long console_diff(void)
+{
+	unsigned x, y;
+	for (y = 0; y < TASKBAR_Y; y++)
+		for (x = 0; x < GFX_WIDTH; x++) {
+			unsigned char ch = grid[y / CHAR_H][x / CHAR_W];
+			unsigned char bits = host_font[ch * CHAR_H + y % CHAR_H];
+			unsigned char want = (bits & (0x80 >> (x % CHAR_W))) ? COL_FG : COL_BG;
+			if (host_fb[y * GFX_WIDTH + x] != want) return (long)(y * GFX_WIDTH + x);
+		}
+	return -1;
+}
+
+static void test_console(void)
+{
+	static const char extra[] = "\n\n\t\b";
+	unsigned i, ops = nops * 4;
+	unsigned long expect = 0;
+	long d;
+
+	console_reset();
+	host_mirrored = 0;
+	for (i = 0; i < ops; i++) {
+		unsigned r = rnd() % 32;
+		char c = r < 4 ? extra[r] : (char)(' ' + rnd() % 95);
+		vga_putchar(c); model_putchar(c);
+		expect += c == '\b' ? 3 : 1;
+		if (i % 4096 == 0 || i == ops - 1) {
+			CHECK(cur_x == gx && cur_y == gy, "op %u: cursor %d,%d, model %d,%d", i, cur_x, cur_y, gx, gy);
+			d = console_diff();
+			CHECK(d < 0, "op %u: pixel %ld,%ld differs from the grid", i, d % GFX_WIDTH, d / GFX_WIDTH);
+		}
+	}
+	CHECK(host_mirrored == expect, "serial mirror got %lu bytes, want %lu", host_mirrored, expect);
+	printf("console: %u chars ok, %u bank switches\n", ops, host_bank_switches);
+}
+
+static void bench_console(void)
+{
+	unsigned i, ops = nops * 4, scrolls = nops / 200 + 1;
+	double t;
+
+	console_reset();
+	t = now();
+	for (i = 0; i < ops; i++) vga_putchar(i % 81 == 80 ? '\n' : (char)('!' + i % 94));
+	t = now() - t;
+	bench_line("host_putchar", t, ops);
+	t = now();
+	for (i = 0; i < scrolls; i++) vga_scroll();
+	t = now() - t;
+	bench_line("host_vga_scroll", t, scrolls);
+}
+
+/* ---- Window compositor ---- */
+
+#define WM_AREA  ((unsigned)GFX_WIDTH * WM_HEIGHT)
+
+static unsigned char wm_want[WM_AREA];
+static int wm_ids[WM_MAX], wm_n;
+
+static void wm_reset(void)
+{
+	heap_reset();
+	console_reset();
+	wm_init(0);
+	wm_n = 0;
+}
+
+static void wm_random_op(void)
+{
+	unsigned r = rnd() % 16;
+	int id = wm_n ? wm_ids[rnd() % wm_n] : -1, i;
+	char title[8];
+	if (wm_n < WM_MAX && (r < 2 || !wm_n)) {
+		for (i = 0; i < 7; i++) title[i] = (char)('A' + rnd() % 26);
+		title[7] = 0;
+		id = wm_create((int)(rnd() % 700) - 40, (int)(rnd() % 480) - 20, 40 + (int)(rnd() % 300), 20 + (int)(rnd() % 200), title);
+		if (id >= 0) wm_ids[wm_n++] = id;
+	} else if (r < 3) {
+		wm_destroy(id);
+		for (i = 0; wm_ids[i] != id; i++);
+		wm_ids[i] = wm_ids[--wm_n];
+	} else if (r < 9) {
+		struct wm_rect w;
+		wm_rect(id, &w);
+		wm_move(id, w.x + (int)(rnd() % 33) - 16, w.y + (int)(rnd() % 33) - 16);
+	} else if (r < 11) wm_raise(id);
+	else if (r < 14) wm_fill(id, (int)(rnd() % 200), (int)(rnd() % 100), (int)(rnd() % 60), (int)(rnd() % 40), (unsigned char)rnd());
+	else wm_text(id, (int)(rnd() % 200), (int)(rnd() % 100), "damage", (unsigned char)rnd(), (unsigned char)rnd());
+}
+
+/* Whatever the damage list held, the screen must match a composite of
+ * everything; and the window under a point must be the one on top */
+static void test_wm(void)
+{
+	unsigned i, ops = nops / 10, px = 0, full = 0;
+	struct wm_rect a;
+	int x, y, top, k;
+
+	wm_reset();
+	for (i = 0; i < ops; i++) {
+		wm_random_op();
+		if (rnd() % 4) continue;
+		px += wm_composite();
+		memcpy(wm_want, host_fb, WM_AREA);
+		wm_damage(0, 0, GFX_WIDTH, WM_HEIGHT);
+		full += wm_composite();
+		for (k = 0; k < (int)WM_AREA && host_fb[k] == wm_want[k]; k++);
+		CHECK(k == (int)WM_AREA, "op %u: pixel %d,%d stale after a damaged composite", i, k % GFX_WIDTH, k / GFX_WIDTH);
+		x = (int)(rnd() % GFX_WIDTH); y = (int)(rnd() % WM_HEIGHT);
+		top = wm_at(x, y);
+		if (top >= 0) {
+			wm_rect(top, &a);
+			CHECK(x >= a.x && x < a.x + a.w && y >= a.y && y < a.y + a.h, "op %u: wm_at(%d,%d) = %d, outside it", i, x, y, top);
+			/* the point shows top's pixel: raising it changes nothing there */
+			wm_raise(top);
+			wm_composite();
+			CHECK(host_fb[y * GFX_WIDTH + x] == wm_want[y * GFX_WIDTH + x] || wm_in_title(top, x, y),
+			      "op %u: window %d is not on top at %d,%d", i, top, x, y);
+		}
+	}
+	wm_exit();
+	wm_composite();
+	for (k = 0; k < (int)WM_AREA && host_fb[k] == COL_BG; k++);
+	CHECK(k == (int)WM_AREA, "pixel %d,%d left behind by wm_exit", k % GFX_WIDTH, k / GFX_WIDTH);
+	printf("wm: %u ops ok, %u%% of the pixels of full redraws\n", ops, full ? (unsigned)(px * 100ull / full) : 0);
+}
+
+/* A window dragged 4 pixels per frame, against redrawing everything */
+static void bench_wm(void)
+{
+	unsigned i, frames = nops / 100 + 10;
+	struct wm_rect r;
+	int id;
+	double t;
+
+	wm_reset();
+	wm_create(40, 40, 240, 160, "back");
+	id = wm_create(200, 120, 240, 160, "drag");
+	wm_composite();
+	t = now();
+	for (i = 0; i < frames; i++) {
+		wm_rect(id, &r);
+		wm_move(id, r.x + (i / 50 % 2 ? -4 : 4), r.y + (i / 25 % 2 ? -2 : 2));
+		wm_composite();
+	}
+	t = now() - t;
+	bench_line("host_wm_drag", t, frames);
+	t = now();
+	for (i = 0; i < frames; i++) {
+		wm_damage(0, 0, GFX_WIDTH, WM_HEIGHT);
+		wm_composite();
+	}
+	t = now() - t;
+	bench_line("host_wm_full", t, frames);
+	wm_exit();
+}
+
+/* ---- Main ---- */
+
+int main(int argc, char **argv)
+{
+	const char *mode = "test";
+	unsigned seed0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc) nops = (unsigned)strtoul(argv[++i], 0, 0);
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc) seed = (unsigned)strtoul(argv[++i], 0, 0);
+		else if (!strcmp(argv[i], "-d") && i + 1 < argc) disk_path = argv[++i];
+		else if (!strcmp(argv[i], "-v")) host_echo = 1;
+		else if (argv[i][0] != '-') mode = argv[i];
+		else { fprintf(stderr, "usage: %s [test|bench|all] [-n ops] [-s seed] [-d disk.img] [-v]\n", argv[0]); return 2; }
+	}
+	if (!seed || !nops) { fprintf(stderr, "seed and ops must be non-zero\n"); return 2; }
+	printf("seed %u, %u ops\n", seed0 = seed, nops);
+
+	if (strcmp(mode, "bench")) {
+		test_heap(); if (!failed) test_fs(); if (!failed) test_console(); if (!failed) test_wm();
+		if (failed) { fprintf(stderr, "replay with -s %u -n %u\n", seed0, nops); return 1; }
+	}
+	if (strcmp(mode, "test")) { bench_heap(); bench_fs(); bench_console(); bench_wm(); }
+	host_disk_close();
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * chocola host harness — shared between hal_host.c and harness.c
+ */
+#ifndef CHOCOLA_HOST_H
+#define CHOCOLA_HOST_H
+
+#include "kernel/console.h"
+
+#define HOST_FB_SIZE  (5 * VGA_BANK_SIZE)  /* 640x480 rounded up to whole banks */
+
+extern unsigned char host_fb[HOST_FB_SIZE];
+extern unsigned host_bank_switches, host_sector_reads, host_sector_writes, host_flushes;
+extern int host_writes_left;            /* sector writes until a simulated power cut, -1: none */
+extern unsigned long host_mirrored;     /* bytes passed to hal_console_mirror */
+extern int host_echo;                   /* -v: mirror to stdout like COM1 */
+
+int  host_disk_open(const char *path, unsigned sectors);
+void host_disk_close(void);
+
+#endif
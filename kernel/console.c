@@ -0,0 +1,207 @@
+/*
+ * chocola kernel — framebuffer and text console
+ *
+ * 640x480x256 through the Bochs VBE 64KB bank window. The console is
+ * a CONSOLE_COLS x CONSOLE_ROWS character grid above the taskbar;
+ * output is mirrored to hal_console_mirror (COM1 in the kernel), unless
+ * hal_console_sink keeps it for a background job.
+ */
+#include "kernel/console.h"
+#include "kernel/string.h"
+
+const unsigned char *font;
+volatile int cur_bank = -1;
+spinlock_t fb_lock;
+int cur_x, cur_y;
+
+static void vbe_set_bank(int bank)
+{
+	if (bank == cur_bank) return;
+	cur_bank = bank;
+	hal_fb_bank(bank);
+}
+
+void fb_write(unsigned offset, unsigned char val)
+{
+	unsigned flags = spin_lock_irqsave(&fb_lock);
+	vbe_set_bank((int)(offset / VGA_BANK_SIZE));
+	hal_fb_win[offset % VGA_BANK_SIZE] = val;
+	spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+unsigned char fb_read(unsigned offset)
+{
+	unsigned flags = spin_lock_irqsave(&fb_lock); unsigned char v;
+	vbe_set_bank((int)(offset / VGA_BANK_SIZE));
+	v = hal_fb_win[offset % VGA_BANK_SIZE];
+	spin_unlock_irqrestore(&fb_lock, flags);
+	return v;
+}
+
+/* n bytes from offset on, switching banks where the span crosses one */
+void fb_write_span(unsigned offset, const unsigned char *src, unsigned n)
+{
+	unsigned flags = spin_lock_irqsave(&fb_lock), k;
+	for (; n; offset += k, src += k, n -= k) {
+		k = VGA_BANK_SIZE - offset % VGA_BANK_SIZE;
+		if (k > n) k = n;
+		vbe_set_bank((int)(offset / VGA_BANK_SIZE));
+		memcpy(hal_fb_win + offset % VGA_BANK_SIZE, src, k);
+	}
+	spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+void fb_read_span(unsigned offset, unsigned char *dst, unsigned n)
+{
+	unsigned flags = spin_lock_irqsave(&fb_lock), k;
+	for (; n; offset += k, dst += k, n -= k) {
+		k = VGA_BANK_SIZE - offset % VGA_BANK_SIZE;
+		if (k > n) k = n;
+		vbe_set_bank((int)(offset / VGA_BANK_SIZE));
+		memcpy(dst, hal_fb_win + offset % VGA_BANK_SIZE, k);
+	}
+	spin_unlock_irqrestore(&fb_lock, flags);
+}
+
+/* ---- Graphics primitives ---- */
+
+void gfx_pixel(int x, int y, unsigned char c)
+{
+	if ((unsigned)x < GFX_WIDTH && (unsigned)y < GFX_HEIGHT)
+		fb_write((unsigned)y * GFX_WIDTH + (unsigned)x, c);
+}
+
+void gfx_rect(int x, int y, int w, int h, unsigned char c)
+{
+	int i, j, x2 = x + w, y2 = y + h;
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x2 > GFX_WIDTH) x2 = GFX_WIDTH;
+	if (y2 > GFX_HEIGHT) y2 = GFX_HEIGHT;
+	for (j = y; j < y2; j++)
+		for (i = x; i < x2; i++)
+			fb_write((unsigned)j * GFX_WIDTH + (unsigned)i, c);
+}
+
+void gfx_char(int x, int y, char ch, unsigned char fg, unsigned char bg)
+{
+	int row, col;
+	unsigned char bits;
+	unsigned base;
+	for (row = 0; row < CHAR_H; row++) {
+		bits = font[(unsigned char)ch * CHAR_H + row];
+		base = (unsigned)(y + row) * GFX_WIDTH + (unsigned)x;
+		for (col = 0; col < 8; col++)
+			fb_write(base + (unsigned)col, (bits & (0x80 >> col)) ? fg : bg);
+	}
+}
+
+void gfx_text(int x, int y, const char *s, unsigned char fg, unsigned char bg)
+{
+	while (*s) { gfx_char(x, y, *s++, fg, bg); x += 8; }
+}
+
+/* ---- Console (character grid on framebuffer) ---- */
+
+void vga_scroll(void)
+{
+	unsigned total = (unsigned)GFX_WIDTH * (unsigned)(CONSOLE_ROWS - 1) * (unsigned)CHAR_H;
+	unsigned src_off = (unsigned)GFX_WIDTH * (unsigned)CHAR_H;
+	unsigned flags, i;
+
+	TRACE(TR_SCROLL, cur_y);
+	hal_scroll_enter();
+
+	/* Disable interrupts — fast bulk copy with no per-pixel overhead */
+	flags = spin_lock_irqsave(&fb_lock);
+
+	i = 0;
+	while (i < total) {
+		unsigned src = i + src_off;
+		int db = (int)(i   / VGA_BANK_SIZE);
+		int sb = (int)(src / VGA_BANK_SIZE);
+		unsigned dr = VGA_BANK_SIZE - (i   % VGA_BANK_SIZE);
+		unsigned sr = VGA_BANK_SIZE - (src % VGA_BANK_SIZE);
+		unsigned chunk = dr < sr ? dr : sr;
+		if (i + chunk > total) chunk = total - i;
+
+		if (sb == db) {
+			/* Same bank — one overlapping move within the window */
+			vbe_set_bank(db);
+			memmove(hal_fb_win + i % VGA_BANK_SIZE, hal_fb_win + src % VGA_BANK_SIZE, chunk);
+		} else {
+			/* Cross-bank — batch via temp buffer */
+			unsigned char tmp[512];
+			unsigned s = src % VGA_BANK_SIZE, d = i % VGA_BANK_SIZE;
+			unsigned done = 0;
+			while (done < chunk) {
+				unsigned batch = chunk - done;
+				if (batch > 512) batch = 512;
+				vbe_set_bank(sb);
+				memcpy(tmp, hal_fb_win + s + done, batch);
+				vbe_set_bank(db);
+				memcpy(hal_fb_win + d + done, tmp, batch);
+				done += batch;
+			}
+		}
+		i += chunk;
+	}
+
+	/* Clear last row (fits in one bank) */
+	{
+		unsigned start = (unsigned)(CONSOLE_ROWS - 1) * CHAR_H * GFX_WIDTH;
+		unsigned count = (unsigned)GFX_WIDTH * CHAR_H;
+		vbe_set_bank((int)(start / VGA_BANK_SIZE));
+		memset(hal_fb_win + start % VGA_BANK_SIZE, COL_BG, count);
+	}
+	cur_y = CONSOLE_ROWS - 1;
+
+	spin_unlock_irqrestore(&fb_lock, flags);
+
+	hal_scroll_leave();
+	TRACE(TR_SCROLL_END, 0);
+}
+
+void vga_putchar(char c)
+{
+	if (hal_console_sink(c)) return;
+	if (c == '\b') { hal_console_mirror('\b'); hal_console_mirror(' '); }
+	hal_console_mirror(c);
+	if (c == '\n') {
+		cur_x = 0; cur_y++;
+	} else if (c == '\b') {
+		if (cur_x > 0) { cur_x--; gfx_char(cur_x*CHAR_W, cur_y*CHAR_H, ' ', COL_FG, COL_BG); }
+	} else if (c == '\t') {
+		cur_x = (cur_x + 4) & ~3;
+		if (cur_x >= CONSOLE_COLS) { cur_x = 0; cur_y++; }
+	} else {
+		gfx_char(cur_x*CHAR_W, cur_y*CHAR_H, c, COL_FG, COL_BG);
+		cur_x++;
+		if (cur_x >= CONSOLE_COLS) { cur_x = 0; cur_y++; }
+	}
+	if (cur_y >= CONSOLE_ROWS) vga_scroll();
+}
+
+void vga_puts(const char *s) { while (*s) vga_putchar(*s++); }
+
+void vga_putint(unsigned n)
+{
+	char buf[12]; int i = 0;
+	if (n == 0) { vga_putchar('0'); return; }
+	while (n) { buf[i++] = '0' + n % 10; n /= 10; }
+	while (--i >= 0) vga_putchar(buf[i]);
+}
+
+void vga_puthex(unsigned n)
+{
+	static const char h[] = "0123456789abcdef";
+	int i; vga_puts("0x");
+	for (i = 28; i >= 0; i -= 4) vga_putchar(h[(n >> i) & 0xF]);
+}
+
+void vga_clear(void)
+{
+	if (hal_console_sink('\f')) return;
+	gfx_rect(0, 0, GFX_WIDTH, TASKBAR_Y, COL_BG);
+	cur_x = cur_y = 0;
+}
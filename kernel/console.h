@@ -0,0 +1,46 @@
+/*
+ * chocola kernel — framebuffer and text console (kernel/console.c)
+ */
+#ifndef CHOCOLA_CONSOLE_H
+#define CHOCOLA_CONSOLE_H
+
+#include "kernel/hal.h"
+
+#define GFX_WIDTH     640
+#define GFX_HEIGHT    480
+#define CHAR_W        8
+#define CHAR_H        14
+#define CONSOLE_COLS  (GFX_WIDTH / CHAR_W)   /* 80 */
+#define CONSOLE_ROWS  32
+#define TASKBAR_Y     (CONSOLE_ROWS * CHAR_H) /* 448 */
+#define VGA_BANK_SIZE 65536                    /* 64KB per bank window */
+
+#define COL_BG        1    /* desktop blue */
+#define COL_FG        15   /* white */
+#define COL_TASKBAR   8    /* dark gray */
+#define COL_TBTEXT    14   /* yellow */
+#define COL_CURSOR    15   /* white */
+
+extern const unsigned char *font;   /* 8x14 glyphs, 256 characters */
+extern volatile int cur_bank;       /* bank last selected, -1: unknown */
+extern spinlock_t fb_lock;          /* bank register is shared by all CPUs */
+extern int cur_x, cur_y;
+
+void fb_write(unsigned offset, unsigned char val);
+unsigned char fb_read(unsigned offset);
+void fb_write_span(unsigned offset, const unsigned char *src, unsigned n);
+void fb_read_span(unsigned offset, unsigned char *dst, unsigned n);
+
+void gfx_pixel(int x, int y, unsigned char c);
+void gfx_rect(int x, int y, int w, int h, unsigned char c);
+void gfx_char(int x, int y, char ch, unsigned char fg, unsigned char bg);
+void gfx_text(int x, int y, const char *s, unsigned char fg, unsigned char bg);
+
+void vga_scroll(void);
+void vga_putchar(char c);
+void vga_puts(const char *s);
+void vga_putint(unsigned n);
+void vga_puthex(unsigned n);
+void vga_clear(void);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * chocola kernel — Chocola FS
+ *
+ * The directory lives in memory from fs_mount() on. Free slots may sit
+ * between used ones after a delete; all walks skip them.
+ *
+ * Each call works in its own sector buffer on the stack. Lookups and
+ * reads share fs_dir_lock. fs_create writes its data under
+ * fs_write_lock alone and takes fs_dir_lock exclusively only to update
+ * the directory, so readers keep going while a file is written. A
+ * create in steps reserves its sectors under fs_write_lock, writes them
+ * with no lock held and takes it again to add the entry, so a long copy
+ * holds off no other writer. Commits hold fs_write_lock too.
+ * fs_read_sectors and fs_write skip the bounce sector, so their callers
+ * pass kernel buffers (see fs.h).
+ *
+ * A commit is a flush, so the files' data is on the disk before entries
+ * that point at it, then the record in one 2-sector write and another
+ * flush. Records take the slots in turn by sequence number, so a torn
+ * one leaves the one before it intact. Sectors freed by a delete are not
+ * reused until the delete commits, or a crash could bring the file back
+ * over another's data.
+ */
+#include "kernel/fs.h"
+#include "kernel/hal.h"
+#include "kernel/string.h"
+
+#define FS_JOURNAL_MAGIC 0x4C4E524Au    /* "JRNL" */
+
+struct fs_jhead { unsigned magic, seq, ops, sum; };     /* sum: of seq and the directory */
+
+struct fs_stats fs_stats;
+
+static struct rwlock fs_dir_lock;       /* fs_dir */
+static struct mutex fs_write_lock;      /* creates, deletes and commits, one at a time */
+static struct fs_entry fs_dir[FS_MAX_FILES];
+static struct fs_entry fs_dir_done[FS_MAX_FILES];       /* as of the last commit */
+static unsigned char fs_rec[1024];      /* a journal record: header sector, directory */
+static unsigned fs_seq;                 /* of the next record */
+static unsigned fs_dir_seq;             /* the record the directory sector matches */
+static unsigned fs_txn_ops, fs_txn_ticks;   /* the open transaction */
+static unsigned fs_resv_end, fs_resv_n;     /* creates between begin and end, and past their sectors */
+
+static int fs_namecmp(const char *a, const char *b)
+{ while (*a && *a==*b){a++;b++;} return (unsigned char)*a-(unsigned char)*b; }
+
+static int fs_lookup(const struct fs_entry *e, const char *name)
+{
+	int i;
+	for (i = 0; i < FS_MAX_FILES; i++)
+		if (e[i].name[0] && fs_namecmp(e[i].name, name) == 0) return i;
+	return FS_ENOENT;
+}
+
+/* ---- Journal ---- */
+
+static unsigned fs_jsum(unsigned seq, const unsigned char *d)
+{
+	unsigned h = 2166136261u ^ seq, i;      /* FNV-1a */
+	for (i = 0; i < 512; i++) h = (h ^ d[i]) * 16777619u;
+	return h;
+}
+
+static void fs_flush(void) { hal_flush(); fs_stats.flushes++; }
+
+static void fs_checkpoint(void)
+{
+	hal_write_sector(FS_DIR_SECTOR, fs_dir_done);
+	fs_dir_seq = fs_seq - 1;
+	fs_stats.checkpoints++;
+}
+
+/* fs_write_lock held, so fs_dir is ours to read */
+static void fs_commit_locked(void)
+{
+	struct fs_jhead *h = (struct fs_jhead *)fs_rec;
+	if (!fs_txn_ops) return;
+	memcpy(fs_dir_done, fs_dir, sizeof(fs_dir));
+	memset(fs_rec, 0, 512);
+	memcpy(fs_rec + 512, fs_dir, sizeof(fs_dir));
+	h->magic = FS_JOURNAL_MAGIC; h->seq = fs_seq; h->ops = fs_txn_ops;
+	h->sum = fs_jsum(fs_seq, fs_rec + 512);
+	fs_flush();
+	hal_write_sectors(FS_JOURNAL_SECTOR + 2 * (fs_seq % FS_JOURNAL_SLOTS), 2, fs_rec);
+	fs_flush();
+	fs_stats.commits++; fs_stats.ops += fs_txn_ops;
+	fs_txn_ops = 0;
+	if (++fs_seq % FS_JOURNAL_SLOTS == 0) fs_checkpoint();
+}
+
+/* One more change in the open transaction (fs_write_lock held); one
+ * that has been open FS_COMMIT_TICKS commits with it */
+static void fs_txn_add(void)
+{
+	if (!fs_txn_ops++) fs_txn_ticks = ticks;
+	else if (ticks - fs_txn_ticks >= FS_COMMIT_TICKS) fs_commit_locked();
+}
+
+/* The directory sector, then the newest intact record over it */
+void fs_mount(void)
+{
+	const struct fs_jhead *h = (const struct fs_jhead *)fs_rec;
+	const unsigned char *a = (const unsigned char *)fs_dir, *b = (const unsigned char *)fs_dir_done;
+	unsigned best = 0, s, i;
+	hal_read_sector(FS_DIR_SECTOR, fs_dir_done);
+	memcpy(fs_dir, fs_dir_done, sizeof(fs_dir));
+	for (s = 0; s < FS_JOURNAL_SLOTS; s++) {
+		hal_read_sectors(FS_JOURNAL_SECTOR + 2 * s, 2, fs_rec);
+		if (h->magic != FS_JOURNAL_MAGIC || h->seq <= best || h->sum != fs_jsum(h->seq, fs_rec + 512)) continue;
+		best = h->seq;
+		memcpy(fs_dir, fs_rec + 512, sizeof(fs_dir));
+	}
+	for (i = 0; i < sizeof(fs_dir) && a[i] == b[i]; i++);
+	memcpy(fs_dir_done, fs_dir, sizeof(fs_dir));
+	fs_seq = best + 1; fs_dir_seq = best;
+	fs_txn_ops = 0; fs_resv_end = fs_resv_n = 0;
+	fs_stats.replayed = i < sizeof(fs_dir);
+	if (fs_stats.replayed) { fs_checkpoint(); fs_flush(); }
+}
+
+void fs_commit(void)
+{
+	mutex_lock(&fs_write_lock);
+	fs_commit_locked();
+	mutex_unlock(&fs_write_lock);
+}
+
+void fs_sync(void)
+{
+	mutex_lock(&fs_write_lock);
+	fs_commit_locked();
+	if (fs_dir_seq != fs_seq - 1) { fs_checkpoint(); fs_flush(); }
+	mutex_unlock(&fs_write_lock);
+}
+
+/* ---- Files ---- */
+
+int fs_list(struct fs_entry out[FS_MAX_FILES])
+{
+	int i, n = 0;
+	rw_read_lock(&fs_dir_lock);
+	for (i = 0; i < FS_MAX_FILES; i++)
+		if (fs_dir[i].name[0]) out[n++] = fs_dir[i];
+	rw_read_unlock(&fs_dir_lock);
+	return n;
+}
+
+int fs_find(const char *name, struct fs_entry *e)
+{
+	int i;
+	rw_read_lock(&fs_dir_lock);
+	if ((i = fs_lookup(fs_dir, name)) >= 0) *e = fs_dir[i];
+	rw_read_unlock(&fs_dir_lock);
+	return i < 0 ? i : 0;
+}
+
+/* Through a bounce sector: buf may be user memory the disk cannot reach */
+unsigned fs_read(const struct fs_entry *e, unsigned off, void *buf, unsigned n)
+{
+	unsigned char *p = buf, sec[512];
+	unsigned done = 0, o, tp;
+	if (off >= e->size) return 0;
+	if (n > e->size - off) n = e->size - off;
+	rw_read_lock(&fs_dir_lock);
+	while (done < n) {
+		o = (off + done) % 512;
+		hal_read_sector(e->start + (off + done) / 512, sec);
+		tp = 512 - o; if (tp > n - done) tp = n - done;
+		memcpy(p + done, sec + o, tp);
+		done += tp;
+	}
+	rw_read_unlock(&fs_dir_lock);
+	return n;
+}
+
+unsigned fs_read_sectors(const struct fs_entry *e, unsigned off, void *buf, unsigned n)
+{
+	if (off >= e->size) return 0;
+	if (n > e->size - off) n = e->size - off;
+	rw_read_lock(&fs_dir_lock);
+	hal_read_sectors(e->start + off / 512, (n + 511) / 512, buf);
+	rw_read_unlock(&fs_dir_lock);
+	return n;
+}
+
+/* Whole sectors in one run, a partial last one padded with zeros */
+void fs_write(const struct fs_entry *e, unsigned off, const void *buf, unsigned n)
+{
+	const unsigned char *p = buf;
+	unsigned char sec[512];
+	unsigned k = n / 512;
+	if (k) hal_write_sectors(e->start + off / 512, k, p);
+	if (n % 512) {
+		memcpy(sec, p + k * 512, n % 512);
+		memset(sec + n % 512, 0, 512 - n % 512);
+		hal_write_sector(e->start + off / 512 + k, sec);
+	}
+}
+
+/* Past the files in d */
+static unsigned fs_end(const struct fs_entry *d, unsigned start)
+{
+	unsigned end;
+	int j;
+	for (j = 0; j < FS_MAX_FILES; j++) {
+		if (!d[j].name[0]) continue;
+		end = d[j].start + (d[j].size + 511) / 512; if (end > start) start = end;
+	}
+	return start;
+}
+
+/* A free slot for name: its index, FS_EEXIST or FS_EFULL (fs_write_lock held;
+ * only writers change fs_dir, so no fs_dir_lock) */
+static int fs_slot(const char *name)
+{
+	int r = FS_EFULL, j;
+	for (j = 0; j < FS_MAX_FILES; j++) {
+		if (!fs_dir[j].name[0]) { if (r < 0) r = j; continue; }
+		if (fs_namecmp(fs_dir[j].name, name) == 0) return FS_EEXIST;
+	}
+	return r;
+}
+
+/* New files go after the highest used sector, committed, reserved or not
+ * (fs_write_lock held) */
+static int fs_reserve(const char *name, unsigned len, struct fs_entry *e)
+{
+	int r, j;
+	if ((r = fs_slot(name)) < 0) return r;
+	memset(e, 0, sizeof(*e));
+	for (j = 0; name[j] && j < FS_NAME_MAX; j++) e->name[j] = name[j];
+	e->start = fs_end(fs_dir_done, fs_end(fs_dir, FS_DATA_SECTOR)); e->size = len;
+	if (e->start < fs_resv_end) e->start = fs_resv_end;
+	fs_resv_end = e->start + (len + 511) / 512;
+	fs_resv_n++;
+	return 0;
+}
+
+/* The name or the last free slot may have gone while the data was written
+ * (fs_write_lock held) */
+static int fs_add(const struct fs_entry *e, int commit)
+{
+	int r = 0;
+	if (commit && (r = fs_slot(e->name)) >= 0) {
+		rw_write_lock(&fs_dir_lock);
+		fs_dir[r] = *e;
+		rw_write_unlock(&fs_dir_lock);
+		fs_txn_add();
+		r = 0;
+	}
+	if (!--fs_resv_n) fs_resv_end = 0;
+	return r;
+}
+
+int fs_create_begin(const char *name, unsigned len, struct fs_entry *e)
+{
+	int r;
+	mutex_lock(&fs_write_lock);
+	r = fs_reserve(name, len, e);
+	mutex_unlock(&fs_write_lock);
+	return r;
+}
+
+int fs_create_end(const struct fs_entry *e, int commit)
+{
+	int r;
+	mutex_lock(&fs_write_lock);
+	r = fs_add(e, commit);
+	mutex_unlock(&fs_write_lock);
+	return r;
+}
+
+/* data may be user memory: copied through a sector on the stack. Short
+ * enough to hold fs_write_lock throughout, so a kill never lands between
+ * the reserve and the add. */
+int fs_create(const char *name, const void *data, unsigned len)
+{
+	unsigned char buf[512];
+	const unsigned char *p = data;
+	struct fs_entry e;
+	unsigned i, tc;
+	int r;
+
+	mutex_lock(&fs_write_lock);
+	if ((r = fs_reserve(name, len, &e)) < 0) { mutex_unlock(&fs_write_lock); return r; }
+	for (i = 0; i * 512 < len; i++) {
+		tc = len - i * 512; if (tc > 512) tc = 512;
+		memcpy(buf, p + i * 512, tc); memset(buf + tc, 0, 512 - tc);
+		hal_write_sector(e.start + i, buf);
+	}
+	r = fs_add(&e, 1);
+	mutex_unlock(&fs_write_lock);
+	return r;
+}
+
+int fs_delete(const char *name)
+{
+	int i;
+	mutex_lock(&fs_write_lock);
+	rw_write_lock(&fs_dir_lock);
+	if ((i = fs_lookup(fs_dir, name)) >= 0) memset(&fs_dir[i], 0, sizeof(fs_dir[i]));
+	rw_write_unlock(&fs_dir_lock);
+	if (i >= 0) fs_txn_add();
+	mutex_unlock(&fs_write_lock);
+	return i < 0 ? i : 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * chocola kernel — Chocola FS (kernel/fs.c)
+ *
+ * One directory sector of FS_MAX_FILES 32-byte entries, a journal of
+ * FS_JOURNAL_SLOTS records, then file data in contiguous sectors from
+ * FS_DATA_SECTOR (mkfs.py writes the same, with an empty journal).
+ *
+ * Creates and deletes change the directory in memory and join the open
+ * transaction. fs_commit() writes it to the journal as one record: a
+ * header sector and the whole new directory sector. The newest intact
+ * record wins at mount; the directory sector itself only catches up
+ * every FS_JOURNAL_SLOTS commits, at fs_sync() and when mounting.
+ */
+#ifndef CHOCOLA_FS_H
+#define CHOCOLA_FS_H
+
+#define FS_DIR_SECTOR 256  /* past the largest image the IPL loads (1 + 254) */
+#define FS_JOURNAL_SECTOR (FS_DIR_SECTOR + 1)
+#define FS_JOURNAL_SLOTS  4            /* 2 sectors each: header, directory */
+#define FS_DATA_SECTOR (FS_DIR_SECTOR + 10)
+#define FS_COMMIT_TICKS   100          /* a transaction this old commits with its next change */
+#define FS_MAX_FILES  16
+#define FS_NAME_MAX   19
+
+#define FS_ENOENT     (-1)
+#define FS_EEXIST     (-2)
+#define FS_EFULL      (-3)  /* no free directory entry */
+
+struct fs_entry {
+	char         name[20];
+	unsigned int start, size, flags;
+} __attribute__((packed));
+
+struct fs_stats {
+	unsigned commits, ops;          /* transactions written, creates and deletes in them */
+	unsigned flushes, checkpoints;
+	unsigned replayed;              /* the journal was ahead of the directory at mount */
+};
+
+extern struct fs_stats fs_stats;
+
+void fs_mount(void);                    /* before anything else: load the directory, replay */
+void fs_commit(void);                   /* make the open transaction durable */
+void fs_sync(void);                     /* commit, then checkpoint the directory sector */
+
+int fs_list(struct fs_entry out[FS_MAX_FILES]);         /* number of files */
+int fs_find(const char *name, struct fs_entry *e);
+unsigned fs_read(const struct fs_entry *e, unsigned off, void *buf, unsigned n);
+int fs_create(const char *name, const void *data, unsigned len);
+int fs_delete(const char *name);
+
+/* Streamed I/O straight between the disk and buf, with no bounce
+ * sector, so buf must be kernel memory: virtio-blk would bounce a user
+ * mapping, but ATA PIO copies into buf under a spinlock, where it must
+ * not fault. off is a multiple of 512; fs_read_sectors fills whole
+ * sectors of buf. */
+unsigned fs_read_sectors(const struct fs_entry *e, unsigned off, void *buf, unsigned n);
+void fs_write(const struct fs_entry *e, unsigned off, const void *buf, unsigned n);
+
+/* A create in steps: fs_create_begin reserves len bytes for name (*e),
+ * the caller writes them with no FS lock held, and fs_create_end adds
+ * the entry (commit; FS_EEXIST or FS_EFULL if another create got there
+ * first) or forgets it. Every begin needs its end. */
+int fs_create_begin(const char *name, unsigned len, struct fs_entry *e);
+int fs_create_end(const struct fs_entry *e, int commit);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * chocola kernel — hardware abstraction for the portable units
+ *
+ * heap.c, fs.c and console.c reach the machine only through this header.
+ * In the kernel build port I/O, spinlocks and trace points are inline
+ * here; the sleeping locks and the hal_* functions live in kernel.c.
+ * With -DHOST ('make host') the same units compile natively against
+ * host/hal_host.c: a disk image file for sectors and plain memory for
+ * the framebuffer.
+ */
+#ifndef CHOCOLA_HAL_H
+#define CHOCOLA_HAL_H
+
+#define MAX_TASKS      16
+
+#ifndef HOST
+
+/* ---- Port I/O ---- */
+
+static inline unsigned char inb(unsigned short port)
+{ unsigned char v; __asm__ volatile("inb %1,%0":"=a"(v):"Nd"(port)); return v; }
+
+static inline unsigned short inw(unsigned short port)
+{ unsigned short v; __asm__ volatile("inw %1,%0":"=a"(v):"Nd"(port)); return v; }
+
+static inline void outb(unsigned short port, unsigned char v)
+{ __asm__ volatile("outb %0,%1"::"a"(v),"Nd"(port)); }
+
+static inline void outw(unsigned short port, unsigned short v)
+{ __asm__ volatile("outw %0,%1"::"a"(v),"Nd"(port)); }
+
+static inline unsigned inl(unsigned short port)
+{ unsigned v; __asm__ volatile("inl %1,%0":"=a"(v):"Nd"(port)); return v; }
+
+static inline void outl(unsigned short port, unsigned v)
+{ __asm__ volatile("outl %0,%1"::"a"(v),"Nd"(port)); }
+
+/* ---- Spinlocks ---- */
+
+typedef volatile int spinlock_t;
+
+static inline unsigned spin_lock_irqsave(spinlock_t *l)
+{
+	unsigned flags;
+	__asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+	while (__sync_lock_test_and_set(l, 1))
+		while (*l) __asm__ volatile("pause");
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, unsigned flags)
+{
+	__sync_lock_release(l);
+	__asm__ volatile("pushl %0; popfl" :: "r"(flags) : "memory");
+}
+
+/* ---- Sleeping locks (kernel.c) ----
+ * Waiters are a bitmask of task ids and sleep off the run queues; the
+ * idle task spins with interrupts on. Waiting with interrupts off or in a
+ * softirq is a kernel panic, since the holder could never run again on
+ * this CPU: such paths must use a spinlock.
+ */
+
+struct mutex { spinlock_t lock; int owner; unsigned waiters, contended; };   /* owner: task id + 1 */
+struct semaphore { spinlock_t lock; int count; unsigned waiters; };
+struct rwlock { spinlock_t lock; int readers, writer, wwait; unsigned waiters, contended; };
+
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+void sem_init(struct semaphore *s, int count);
+void sem_down(struct semaphore *s);
+void sem_up(struct semaphore *s);
+void rw_read_lock(struct rwlock *l);
+void rw_read_unlock(struct rwlock *l);
+void rw_write_lock(struct rwlock *l);   /* waiting writers hold off new readers */
+void rw_write_unlock(struct rwlock *l);
+
+/* ---- Trace points (ring and 'trace' command in kernel.c) ---- */
+
+enum {
+	TR_IRQ, TR_IRQ_EXIT, TR_SOFTIRQ, TR_SOFTIRQ_EXIT, TR_SWITCH,
+	TR_ATA_CMD, TR_ATA_DONE, TR_ALLOC, TR_FREE, TR_SCROLL, TR_SCROLL_END,
+	TR_NTYPES
+};
+
+extern volatile int trace_on;
+void trace_rec(unsigned type, unsigned arg);
+
+#define TRACE(type, arg) do { if (__builtin_expect(trace_on, 0)) trace_rec(type, (unsigned)(arg)); } while (0)
+
+#else   /* HOST: single-threaded, nothing to trace */
+
+typedef volatile int spinlock_t;
+static inline unsigned spin_lock_irqsave(spinlock_t *l) { *l = 1; return 0; }
+static inline void spin_unlock_irqrestore(spinlock_t *l, unsigned flags) { (void)flags; *l = 0; }
+
+struct mutex { int owner; };
+struct rwlock { int readers, writer; };
+static inline void mutex_lock(struct mutex *m) { m->owner = 1; }
+static inline void mutex_unlock(struct mutex *m) { m->owner = 0; }
+static inline void rw_read_lock(struct rwlock *l) { l->readers++; }
+static inline void rw_read_unlock(struct rwlock *l) { l->readers--; }
+static inline void rw_write_lock(struct rwlock *l) { l->writer = 1; }
+static inline void rw_write_unlock(struct rwlock *l) { l->writer = 0; }
+
+#define TRACE(type, arg) do { } while (0)
+
+#endif
+
+/* ---- Provided by kernel.c or host/hal_host.c ---- */
+
+extern volatile unsigned int ticks;     /* TIMER_HZ scheduler ticks since boot */
+int  hal_task(void);                    /* id of the running task, for heap accounting */
+unsigned long long hal_cycles(void);    /* TSC, for latency statistics */
+
+/* Framebuffer: a 64KB window onto bank hal_fb_bank() last selected */
+extern unsigned char *hal_fb_win;
+void hal_fb_bank(int bank);
+
+/* 512-byte sectors of the boot disk (ATA PIO or virtio-blk). A run of n
+ * sectors is one request where the driver allows it. Writes may sit in
+ * the disk's cache until hal_flush() returns. */
+void hal_read_sector(unsigned lba, void *buf);
+void hal_write_sector(unsigned lba, const void *buf);
+void hal_read_sectors(unsigned lba, unsigned n, void *buf);
+void hal_write_sectors(unsigned lba, unsigned n, const void *buf);
+void hal_flush(void);
+
+/* Console side effects: serial mirror, mouse cursor around a scroll
+ * (and around a composite in wm.c). hal_console_sink takes the running
+ * task's output instead of the screen (1) when it is a background job;
+ * '\f' stands for a clear. */
+void hal_console_mirror(char c);
+int  hal_console_sink(char c);
+void hal_scroll_enter(void);
+void hal_scroll_leave(void);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * chocola kernel — heap allocator
+ *
+ * First fit over one linked list of blocks, each preceded by its
+ * header; kfree merges with the following free blocks. Sizes are
+ * rounded to the pointer size so headers stay aligned.
+ *
+ * kzalloc's pool holds up to HEAP_ZPOOL ordinary HEAP_ZBLOCK-byte blocks
+ * that heap_zero_idle() zeroed ahead of time. A request that fits takes
+ * one and the unused tail goes back to the free list. A kmalloc that
+ * finds no room drains the pool and tries again.
+ */
+#include "kernel/heap.h"
+#include "kernel/string.h"
+
+#define HEAP_ALIGN      sizeof(void *)
+
+struct heap_block *heap_head;
+spinlock_t heap_lock;
+unsigned heap_task_bytes[MAX_TASKS + 1];
+
+volatile int heap_track;
+struct heap_site heap_sites[HEAP_SITES];
+unsigned heap_classes[HEAP_CLASSES];
+unsigned heap_live, heap_peak, heap_track_start, heap_lost;
+
+struct heap_zstats heap_zstats;
+unsigned heap_zn;
+static struct heap_block *heap_zpool[HEAP_ZPOOL];
+
+static void heap_track_alloc(struct heap_block *b, unsigned req, unsigned caller)
+{
+	unsigned h = (caller >> 2) % HEAP_SITES, i, c;
+	struct heap_site *s;
+	for (i = 0; i < HEAP_SITES; i++, h = (h + 1) % HEAP_SITES)
+		if (heap_sites[h].caller == caller || !heap_sites[h].caller) break;
+	if (i == HEAP_SITES) { heap_lost++; return; }
+	s = &heap_sites[h];
+	s->caller = caller; s->allocs++; s->live_n++; s->live_bytes += b->size;
+	b->site = (int)h; b->tick = ticks;
+	for (c = 0; c < HEAP_CLASSES - 1 && req > (16u << c); c++);
+	heap_classes[c]++;
+	if ((heap_live += b->size) > heap_peak) heap_peak = heap_live;
+}
+
+static void heap_track_free(struct heap_block *b)
+{
+	struct heap_site *s = &heap_sites[b->site];
+	s->frees++; s->live_n--; s->live_bytes -= b->size;
+	heap_live -= b->size;
+}
+
+void heap_init(void *base, unsigned size)
+{
+	heap_head = (struct heap_block *)base;
+	heap_head->size = size - sizeof(struct heap_block);
+	heap_head->used = 0; heap_head->next = 0;
+	heap_zn = 0;
+}
+
+/* Cut b down to sz bytes if the rest can hold a block (heap_lock held) */
+static struct heap_block *heap_split(struct heap_block *b, unsigned sz)
+{
+	struct heap_block *nb;
+	if (b->size <= sz + sizeof(struct heap_block) + HEAP_ALIGN) return 0;
+	nb = (struct heap_block *)((unsigned char *)b + sizeof(struct heap_block) + sz);
+	nb->size = b->size - sz - sizeof(struct heap_block);
+	nb->used = 0; nb->next = b->next;
+	b->size = sz; b->next = nb;
+	return nb;
+}
+
+static void heap_merge(struct heap_block *b)
+{
+	while (b->next && !b->next->used) {
+		b->size += sizeof(struct heap_block) + b->next->size;
+		b->next = b->next->next;
+	}
+}
+
+/* b now belongs to the running task (heap_lock held) */
+static void heap_claim(struct heap_block *b, unsigned req, unsigned caller)
+{
+	b->used = 1;
+	b->owner = hal_task();
+	heap_task_bytes[b->owner] += b->size;  /* what kfree gives back */
+	b->site = -1;
+	if (__builtin_expect(heap_track, 0)) heap_track_alloc(b, req, caller);
+}
+
+static void heap_release(struct heap_block *b)
+{
+	b->used = 0;
+	if (__builtin_expect(heap_track, 0) && b->site >= 0) heap_track_free(b);
+	heap_task_bytes[b->owner] -= b->size < heap_task_bytes[b->owner] ? b->size : heap_task_bytes[b->owner];
+	heap_merge(b);
+}
+
+static void *heap_alloc(unsigned req, unsigned caller)
+{
+	struct heap_block *b;
+	unsigned sz = (req + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+	for (b = heap_head; b; b = b->next)
+		if (!b->used && b->size >= sz) {
+			heap_split(b, sz);
+			heap_claim(b, req, caller);
+			return (void *)((unsigned char *)b + sizeof(struct heap_block));
+		}
+	return 0;
+}
+
+static void heap_zdrain_locked(void)
+{
+	while (heap_zn) { heap_release(heap_zpool[--heap_zn]); heap_zstats.drained++; }
+}
+
+/* noinline: __builtin_return_address(0) must be the real call site */
+__attribute__((noinline)) void *kmalloc(unsigned req)
+{
+	unsigned flags = spin_lock_irqsave(&heap_lock), caller = (unsigned)(unsigned long)__builtin_return_address(0);
+	void *p = heap_alloc(req, caller);
+	if (!p && heap_zn) { heap_zdrain_locked(); p = heap_alloc(req, caller); }
+	spin_unlock_irqrestore(&heap_lock, flags);
+	if (p) TRACE(TR_ALLOC, (req + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1));
+	return p;
+}
+
+/* A request that fits takes a pool block; the rest are zeroed here, after
+ * heap_lock is dropped. Both kinds count their cycles for 'mem'. */
+__attribute__((noinline)) void *kzalloc(unsigned req)
+{
+	unsigned long long t0 = hal_cycles();
+	unsigned flags = spin_lock_irqsave(&heap_lock), caller = (unsigned)(unsigned long)__builtin_return_address(0);
+	unsigned sz = (req + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+	struct heap_block *b = 0;
+	void *p;
+	if (sz <= HEAP_ZBLOCK && heap_zn) {
+		b = heap_zpool[--heap_zn];
+		heap_release(b);                /* hand it over: the idle task's bytes become ours */
+		heap_split(b, sz);
+		heap_claim(b, req, caller);
+		p = (unsigned char *)b + sizeof(struct heap_block);
+	} else if (!(p = heap_alloc(req, caller)) && heap_zn) {
+		heap_zdrain_locked();
+		p = heap_alloc(req, caller);
+	}
+	spin_unlock_irqrestore(&heap_lock, flags);
+	if (!p) return 0;
+	TRACE(TR_ALLOC, sz);
+	if (!b) memset(p, 0, req);
+	flags = spin_lock_irqsave(&heap_lock);
+	if (b) { heap_zstats.hits++; heap_zstats.hit_cycles += hal_cycles() - t0; }
+	else { heap_zstats.misses++; heap_zstats.miss_cycles += hal_cycles() - t0; }
+	spin_unlock_irqrestore(&heap_lock, flags);
+	return p;
+}
+
+void kfree(void *p)
+{
+	unsigned flags;
+	if (!p) return;
+	TRACE(TR_FREE, p);
+	flags = spin_lock_irqsave(&heap_lock);
+	heap_release((struct heap_block *)((unsigned char *)p - sizeof(struct heap_block)));
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+/* The zeroing runs outside heap_lock; two idle CPUs may race to fill the
+ * last slot, and the loser frees its block */
+int heap_zero_idle(void)
+{
+	unsigned flags;
+	void *p;
+	if (heap_zn >= HEAP_ZPOOL || !(p = kmalloc(HEAP_ZBLOCK))) return 0;
+	memzero_nt(p, HEAP_ZBLOCK);
+	flags = spin_lock_irqsave(&heap_lock);
+	if (heap_zn < HEAP_ZPOOL) {
+		heap_zpool[heap_zn++] = (struct heap_block *)((unsigned char *)p - sizeof(struct heap_block));
+		heap_zstats.filled++;
+		p = 0;
+	}
+	spin_unlock_irqrestore(&heap_lock, flags);
+	kfree(p);
+	return 1;
+}
+
+void heap_zdrain(void)
+{
+	unsigned flags = spin_lock_irqsave(&heap_lock);
+	heap_zdrain_locked();
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void heap_task_exit(int id)
+{
+	struct heap_block *b;
+	unsigned flags = spin_lock_irqsave(&heap_lock);
+	for (b = heap_head; b; b = b->next) if (b->used && b->owner == id) b->owner = HEAP_EXITED;
+	heap_task_bytes[HEAP_EXITED] += heap_task_bytes[id];
+	heap_task_bytes[id] = 0;
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void heap_usage(unsigned *used, unsigned *free)
+{
+	struct heap_block *b;
+	unsigned flags = spin_lock_irqsave(&heap_lock);
+	*used = *free = 0;
+	for (b = heap_head; b; b = b->next) { if (b->used) *used += b->size; else *free += b->size; }
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void heap_track_set(int on)
+{
+	struct heap_block *b;
+	unsigned flags = spin_lock_irqsave(&heap_lock), i;
+	if (on) {
+		for (i = 0; i < HEAP_SITES; i++) heap_sites[i].caller = 0;
+		for (i = 0; i < HEAP_CLASSES; i++) heap_classes[i] = 0;
+		for (b = heap_head; b; b = b->next) b->site = -1;
+		heap_live = heap_peak = heap_lost = 0;
+		heap_track_start = ticks;
+	}
+	heap_track = on;
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void heap_site_oldest(unsigned oldest[HEAP_SITES])
+{
+	struct heap_block *b;
+	unsigned flags = spin_lock_irqsave(&heap_lock), i;
+	for (i = 0; i < HEAP_SITES; i++) oldest[i] = ticks;
+	for (b = heap_head; b; b = b->next)
+		if (b->used && b->site >= 0 && b->tick < oldest[b->site]) oldest[b->site] = b->tick;
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
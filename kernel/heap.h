@@ -0,0 +1,58 @@
+/*
+ * chocola kernel — first-fit heap (kernel/heap.c)
+ */
+#ifndef CHOCOLA_HEAP_H
+#define CHOCOLA_HEAP_H
+
+#include "kernel/hal.h"
+
+struct heap_block {
+	unsigned int size, used; struct heap_block *next; int owner;
+	int site; unsigned tick;        /* heapstat: call-site slot (-1: untracked), alloc tick */
+};
+
+/* Allocation tracker ('heapstat'): per call site live bytes and counts,
+ * a log2 size histogram and the peak. Off by default; kmalloc/kfree
+ * then pay one branch on heap_track. Updated under heap_lock. */
+#define HEAP_SITES      64
+#define HEAP_CLASSES    16              /* <=16, <=32, ... bytes */
+
+struct heap_site { unsigned caller, live_bytes, live_n, allocs, frees; };
+
+extern struct heap_block *heap_head;
+extern spinlock_t heap_lock;
+#define HEAP_EXITED     MAX_TASKS       /* heap_task_bytes slot: blocks whose task has gone */
+
+extern unsigned heap_task_bytes[MAX_TASKS + 1];  /* live bytes by allocating task */
+
+extern volatile int heap_track;
+extern struct heap_site heap_sites[HEAP_SITES];
+extern unsigned heap_classes[HEAP_CLASSES];
+extern unsigned heap_live, heap_peak, heap_track_start, heap_lost;
+
+/* kzalloc's pool of pre-zeroed blocks, refilled by the idle tasks */
+#define HEAP_ZPOOL      8
+#define HEAP_ZBLOCK     4096
+
+struct heap_zstats {
+	unsigned hits, misses;          /* kzalloc served from the pool / zeroed on the spot */
+	unsigned filled, drained;       /* blocks zeroed ahead, given back to a failing kmalloc */
+	unsigned long long hit_cycles, miss_cycles;
+};
+
+extern struct heap_zstats heap_zstats;
+extern unsigned heap_zn;                /* blocks in the pool now */
+
+void  heap_init(void *base, unsigned size);
+void *kmalloc(unsigned req);
+void *kzalloc(unsigned req);
+void  kfree(void *p);
+int   heap_zero_idle(void);             /* zero one more block for the pool: 0 if full or no room */
+void  heap_zdrain(void);
+void  heap_task_exit(int id);           /* slot id is reused: charge its blocks to HEAP_EXITED */
+
+void heap_usage(unsigned *used, unsigned *free);
+void heap_track_set(int on);            /* on: clears the tracker first */
+void heap_site_oldest(unsigned oldest[HEAP_SITES]);     /* tick of each site's oldest live block */
+
+#endif
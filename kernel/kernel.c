@@ -3,23 +3,19 @@
  * 32-bit protected mode, flat memory model.
  */
 
-#define GFX_WIDTH     640
-#define GFX_HEIGHT    480
-#define CHAR_W        8
-#define CHAR_H        14
-#define CONSOLE_COLS  (GFX_WIDTH / CHAR_W)   /* 80 */
-#define CONSOLE_ROWS  32
-#define TASKBAR_Y     (CONSOLE_ROWS * CHAR_H) /* 448 */
-#define VGA_BANK_SIZE 65536                    /* 64KB per bank window */
-
-#define COL_BG        1    /* desktop blue */
-#define COL_FG        15   /* white */
-#define COL_TASKBAR   8    /* dark gray */
-#define COL_TBTEXT    14   /* yellow */
-#define COL_CURSOR    15   /* white */
+#include "kernel/hal.h"
+#include "kernel/string.h"
+#include "kernel/heap.h"
+#include "kernel/fs.h"
+#include "kernel/console.h"
+#include "kernel/syscall.h"
+#include "kernel/vm.h"
+#include "kernel/wm.h"
 
 #define CMD_BUF_SIZE  64
-#define KBD_BUF_SIZE  32
+#define KBD_RING_ORDER   6   /* 64 key events */
+#define MOUSE_RING_ORDER 7   /* 128 mouse packets */
+#define RAW_RING_ORDER   7   /* 128 device bytes per IRQ line */
 #define TIMER_HZ      100
 
 #define HIST_SIZE     16
@@ -29,62 +25,145 @@
 #define HEAP_START    0x200000
 #define HEAP_SIZE     0x200000
 
-#define MAX_TASKS      8
 #define TASK_STACK_SIZE 4096
+#define TASK_FILES     4
+#define MAX_CPUS       8
+#define IRQOFF_BUCKETS 16   /* bucket 0: <256 cycles, bucket n: <2^(n+8) */
 
-#define FS_DIR_SECTOR 100
-#define FS_MAX_FILES  16
 #define FILE_BUF_SIZE 2048
 
-static const unsigned char *font;   /* 8x14 BIOS font (pointer at 0x4F8) */
-
 /* ---- I/O port helpers ---- */
 
-static inline unsigned char inb(unsigned short port)
-{ unsigned char v; __asm__ volatile("inb %1,%0":"=a"(v):"Nd"(port)); return v; }
+static inline void io_wait(void) { outb(0x80, 0); }
+
+static inline void cpuid(unsigned leaf, unsigned *a, unsigned *b, unsigned *c, unsigned *d)
+{ __asm__ volatile("cpuid":"=a"(*a),"=b"(*b),"=c"(*c),"=d"(*d):"a"(leaf),"c"(0)); }
 
-static inline unsigned short inw(unsigned short port)
-{ unsigned short v; __asm__ volatile("inw %1,%0":"=a"(v):"Nd"(port)); return v; }
+static inline unsigned long long rdmsr(unsigned msr)
+{ unsigned lo, hi; __asm__ volatile("rdmsr":"=a"(lo),"=d"(hi):"c"(msr)); return ((unsigned long long)hi << 32) | lo; }
 
-static inline void outb(unsigned short port, unsigned char v)
-{ __asm__ volatile("outb %0,%1"::"a"(v),"Nd"(port)); }
+static inline void wrmsr(unsigned msr, unsigned long long v)
+{ __asm__ volatile("wrmsr"::"c"(msr),"a"((unsigned)v),"d"((unsigned)(v >> 32))); }
 
-static inline void outw(unsigned short port, unsigned short v)
-{ __asm__ volatile("outw %0,%1"::"a"(v),"Nd"(port)); }
+static inline unsigned long long rdtsc(void)
+{ unsigned lo, hi; __asm__ volatile("rdtsc":"=a"(lo),"=d"(hi)); return ((unsigned long long)hi << 32) | lo; }
 
-static inline void io_wait(void) { outb(0x80, 0); }
+/* ---- Per-CPU data ----
+ * Each CPU loads its own GDT whose SEL_PERCPU descriptor has its base at
+ * its struct cpu, so this_cpu() is a single %gs-relative load.
+ */
+
+#define SEL_KCODE   0x08
+#define SEL_KDATA   0x10
+#define SEL_UCODE   0x18                /* SYSEXIT wants user code/data at SYSENTER_CS + 16/24 */
+#define SEL_UDATA   0x20
+#define SEL_PERCPU  0x28
+#define SEL_TSS     0x30
+
+struct tss {
+	unsigned link, esp0, ss0, esp1, ss1, esp2, ss2, cr3, eip, eflags;
+	unsigned eax, ecx, edx, ebx, esp, ebp, esi, edi, es, cs, ss, ds, fs, gs, ldt;
+	unsigned short trap, iomap;
+} __attribute__((packed));
+
+struct cpu {
+	struct cpu *self;               /* %gs:0 */
+	int id, apic_id, online;
+	int cur, prev, idle;            /* task ids */
+	int in_softirq;
+	volatile int fpu_owner;         /* task whose FPU/SSE state is in the registers */
+	volatile int fpu_flush;         /* a peer wants to steal fpu_owner: save it at the next schedule() */
+	unsigned fpu_traps;
+	spinlock_t rq_lock;             /* run queue: ring of task ids */
+	int rq[MAX_TASKS], rq_head, rq_n;
+	unsigned steals;
+	unsigned timer_sub, timer_div;  /* timer interrupts per scheduler tick */
+	unsigned *prof_hist;            /* samples per 1 << PROF_SHIFT bytes of .text */
+	unsigned prof_samples, prof_other, prof_task[MAX_TASKS];
+	struct trace_ev *trace;         /* TRACE_EVENTS-entry ring, NULL until 'trace on' */
+	unsigned trace_head;
+	int trace_irq;                  /* IRQ being serviced + 1, for the exit event */
+	volatile int halted;            /* current task is in cpu_halt(): tick counts as idle */
+	unsigned softirq_pending;       /* raised by this CPU's IRQs, only touched with IF=0 */
+	unsigned long long irqoff_start;        /* TSC at irq_enter() */
+	unsigned irqoff_hist[IRQOFF_BUCKETS], irqoff_max;
+	unsigned long long gdt[7];
+	struct tss tss;
+};
+
+static struct cpu cpus[MAX_CPUS];
+static int ncpus_online = 1;
 
-/* ---- VBE banked framebuffer (640x480 at 0xA0000, 64KB window) ---- */
+static inline struct cpu *this_cpu(void)
+{ struct cpu *c; __asm__ volatile("movl %%gs:0,%0" : "=r"(c)); return c; }
 
-static unsigned char *const fb_win = (unsigned char *)0xA0000;
-static volatile int cur_bank = -1;
+#define current_task (this_cpu()->cur)
 
-static void vbe_set_bank(int bank)
+static unsigned long long gdt_entry(unsigned base, unsigned limit, unsigned access, unsigned flags)
 {
-	if (bank == cur_bank) return;
-	cur_bank = bank;
-	/* Bochs VBE dispi interface — register 0x05 = BANK */
-	outw(0x1CE, 0x05);
-	outw(0x1CF, (unsigned short)bank);
+	return (limit & 0xFFFFull) | ((unsigned long long)(base & 0xFFFFFF) << 16)
+	     | ((unsigned long long)access << 40) | ((unsigned long long)((limit >> 16) & 0xF) << 48)
+	     | ((unsigned long long)flags << 52) | ((unsigned long long)(base >> 24) << 56);
 }
 
-static void fb_write(unsigned offset, unsigned char val)
+/* ---- Event trace ----
+ * Per-CPU ring of TSC-stamped binary events. Writers only disable local
+ * interrupts, never take a lock; with tracing off a trace point costs
+ * one load and a not-taken branch. 'trace dump' prints the rings for
+ * trace2json.py.
+ */
+
+#define TRACE_ORDER     10
+#define TRACE_EVENTS    (1u << TRACE_ORDER)
+
+static const char *const trace_names[TR_NTYPES] = {
+	"irq", "irq_exit", "softirq", "softirq_exit", "switch",
+	"ata_cmd", "ata_done", "alloc", "free", "scroll", "scroll_end",
+};
+
+struct trace_ev {
+	unsigned long long tsc;
+	unsigned type, arg;
+};
+
+volatile int trace_on;
+
+void trace_rec(unsigned type, unsigned arg)
 {
+	struct cpu *c = this_cpu();
+	struct trace_ev *e;
 	unsigned flags;
 	__asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
-	vbe_set_bank((int)(offset / VGA_BANK_SIZE));
-	fb_win[offset % VGA_BANK_SIZE] = val;
+	if (c->trace) {
+		e = &c->trace[c->trace_head++ & (TRACE_EVENTS - 1)];
+		e->tsc = rdtsc(); e->type = type; e->arg = arg;
+	}
 	__asm__ volatile("pushl %0; popfl" :: "r"(flags) : "memory");
 }
 
-static unsigned char fb_read(unsigned offset)
+static void cpu_setup(struct cpu *c)
 {
-	unsigned flags; unsigned char v;
-	__asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
-	vbe_set_bank((int)(offset / VGA_BANK_SIZE));
-	v = fb_win[offset % VGA_BANK_SIZE];
-	__asm__ volatile("pushl %0; popfl" :: "r"(flags) : "memory");
-	return v;
+	struct { unsigned short limit; unsigned base; } __attribute__((packed)) gdtr;
+
+	c->self = c;
+	c->gdt[0] = 0;
+	c->gdt[1] = gdt_entry(0, 0xFFFFF, 0x9A, 0xC);                  /* flat code */
+	c->gdt[2] = gdt_entry(0, 0xFFFFF, 0x92, 0xC);                  /* flat data */
+	c->gdt[3] = gdt_entry(0, 0xFFFFF, 0xFA, 0xC);                  /* flat code, DPL 3 */
+	c->gdt[4] = gdt_entry(0, 0xFFFFF, 0xF2, 0xC);                  /* flat data, DPL 3 */
+	c->gdt[5] = gdt_entry((unsigned)c, sizeof(*c) - 1, 0x92, 0x4); /* per-CPU */
+	c->gdt[6] = gdt_entry((unsigned)&c->tss, sizeof(c->tss) - 1, 0x89, 0x0);
+	c->tss.ss0 = SEL_KDATA;
+	c->tss.iomap = sizeof(c->tss);
+	gdtr.limit = sizeof(c->gdt) - 1;
+	gdtr.base = (unsigned)c->gdt;
+	__asm__ volatile(
+		"lgdt %0\n\t"
+		"ljmp %1, $1f\n1:\n\t"
+		"movw %w2, %%ds\n\tmovw %w2, %%es\n\tmovw %w2, %%fs\n\tmovw %w2, %%ss\n\t"
+		"movw %w3, %%gs\n\t"
+		"ltr %w4"
+		:: "m"(gdtr), "i"(SEL_KCODE), "r"(SEL_KDATA), "r"(SEL_PERCPU), "r"(SEL_TSS) : "memory");
 }
 
 /* ---- Scan code table ---- */
@@ -97,199 +176,211 @@ static const char sc_to_ascii[128] = {
 	'*', 0, ' '
 };
 
-/* ---- Keyboard ring buffer ---- */
+/* ---- Lock-free SPSC rings ----
+ * One producer, one consumer, power-of-two capacity, free-running indices.
+ * The producer fills the slot before publishing head, the consumer reads
+ * the slot before releasing it through tail. x86 keeps stores ordered with
+ * stores and loads with loads, so the barriers only have to stop the
+ * compiler; a weakly ordered port would make them real fences.
+ */
 
-static volatile char kbd_buf[KBD_BUF_SIZE];
-static volatile int  kbd_head, kbd_tail;
+#define smp_wmb() __asm__ volatile("" ::: "memory")
+#define smp_rmb() __asm__ volatile("" ::: "memory")
 
-/* ---- Timer ---- */
+struct spsc {
+	volatile unsigned head, tail;
+	unsigned mask, esize;
+	unsigned dropped, hiwat;
+	unsigned char *buf;
+	const char *name;
+};
 
-static volatile unsigned int ticks;
+#define SPSC_DEFINE(var, type, order) \
+	static type var##_slots[1u << (order)]; \
+	static struct spsc var = { 0, 0, (1u << (order)) - 1, sizeof(type), 0, 0, \
+	                           (unsigned char *)var##_slots, #var }
 
-/* ---- Mouse state ---- */
+static int spsc_put(struct spsc *r, const void *e)
+{
+	unsigned h = r->head, used = h - r->tail;
+	if (used > r->mask) { r->dropped++; return 0; }
+	memcpy(r->buf + (h & r->mask) * r->esize, e, r->esize);
+	if (used + 1 > r->hiwat) r->hiwat = used + 1;
+	smp_wmb();
+	r->head = h + 1;
+	return 1;
+}
 
-static volatile int mouse_x = 160, mouse_y = 100;
-static volatile unsigned char mouse_btns;
+static int spsc_get(struct spsc *r, void *e)
+{
+	unsigned t = r->tail;
+	if (t == r->head) return 0;
+	smp_rmb();
+	memcpy(e, r->buf + (t & r->mask) * r->esize, r->esize);
+	smp_rmb();
+	r->tail = t + 1;
+	return 1;
+}
 
-/* ---- GUI state (shared between timer ISR and scroll) ---- */
+/* ---- Input events ---- */
 
-static int gui_old_mx = -1, gui_old_my = -1;
-static volatile int gui_no_cursor;   /* when set, timer skips cursor update */
+#define EV_KEYDOWN  1
+#define EV_KEYUP    2
+#define EV_MOUSE    3
 
-/* ---- Command history ---- */
+struct raw_input { unsigned long long tsc; unsigned byte; };
 
-static char history[HIST_SIZE][CMD_BUF_SIZE];
-static int  hist_count;
+struct input_event {
+	unsigned long long tsc;     /* TSC at the hard IRQ */
+	unsigned char type;
+	unsigned char code;         /* scancode, bit 7 = E0-prefixed */
+	char ch;                    /* translated character, 0 if none */
+	unsigned char btns;
+	short dx, dy;               /* EV_MOUSE, screen orientation */
+};
 
-/* ---- Disk / FS buffers ---- */
+SPSC_DEFINE(kbd_raw, struct raw_input, RAW_RING_ORDER);        /* IRQ1  -> softirq */
+SPSC_DEFINE(mouse_raw, struct raw_input, RAW_RING_ORDER);      /* IRQ12 -> softirq */
+SPSC_DEFINE(kbd_events, struct input_event, KBD_RING_ORDER);     /* softirq -> shell */
+SPSC_DEFINE(mouse_events, struct input_event, MOUSE_RING_ORDER); /* softirq -> GUI */
+SPSC_DEFINE(serial_rx, struct raw_input, RAW_RING_ORDER);      /* IRQ4  -> shell */
 
-static unsigned char disk_buf[512];
-static unsigned char file_buf[FILE_BUF_SIZE];
+static void input_wake(void);          /* kbd_getchar's sleepers, see Keyboard */
 
-struct fs_entry {
-	char         name[20];
-	unsigned int start, size, flags;
-} __attribute__((packed));
+static struct spsc *const input_rings[] = { &kbd_raw, &mouse_raw, &kbd_events, &mouse_events, &serial_rx };
 
-/* ---- Graphics primitives ---- */
+static unsigned mouse_coalesced;
+static unsigned kbd_lat_last, kbd_lat_max;   /* IRQ -> kbd_getchar, cycles */
 
-static void gfx_pixel(int x, int y, unsigned char c)
-{
-	if ((unsigned)x < GFX_WIDTH && (unsigned)y < GFX_HEIGHT)
-		fb_write((unsigned)y * GFX_WIDTH + (unsigned)x, c);
-}
+/* ---- Timer ---- */
 
-static void gfx_rect(int x, int y, int w, int h, unsigned char c)
-{
-	int i, j, x2 = x + w, y2 = y + h;
-	if (x < 0) x = 0;  if (y < 0) y = 0;
-	if (x2 > GFX_WIDTH) x2 = GFX_WIDTH;
-	if (y2 > GFX_HEIGHT) y2 = GFX_HEIGHT;
-	for (j = y; j < y2; j++)
-		for (i = x; i < x2; i++)
-			fb_write((unsigned)j * GFX_WIDTH + (unsigned)i, c);
-}
+volatile unsigned int ticks;
 
-static void gfx_char(int x, int y, char ch, unsigned char fg, unsigned char bg)
-{
-	int row, col;
-	unsigned char bits;
-	unsigned base;
-	for (row = 0; row < CHAR_H; row++) {
-		bits = font[(unsigned char)ch * CHAR_H + row];
-		base = (unsigned)(y + row) * GFX_WIDTH + (unsigned)x;
-		for (col = 0; col < 8; col++)
-			fb_write(base + (unsigned)col, (bits & (0x80 >> col)) ? fg : bg);
-	}
-}
+/* ---- Deferred interrupt work (softirq) ----
+ * Hard handlers only touch the device and raise a bit here; do_softirq()
+ * runs the rest with interrupts enabled, called by the ISR stubs after EOI.
+ */
 
-static void gfx_text(int x, int y, const char *s, unsigned char fg, unsigned char bg)
-{
-	while (*s) { gfx_char(x, y, *s++, fg, bg); x += 8; }
-}
+#define SOFTIRQ_TIMER  0
+#define SOFTIRQ_KBD    1
+#define SOFTIRQ_MOUSE  2
+#define NR_SOFTIRQS    3
 
-/* ---- Mouse cursor (forward declarations for scroll) ---- */
+static void (*softirq_vec[NR_SOFTIRQS])(void);
 
-static void cursor_hide(int cx, int cy);
-static void cursor_show(int cx, int cy);
+/* IRQ context, IF=0: the softirq runs on this CPU on the way out */
+static inline void raise_softirq(int n) { this_cpu()->softirq_pending |= 1u << n; }
 
-/* ---- Console (character grid on framebuffer) ---- */
+static inline void irq_enter(int irq)
+{
+	this_cpu()->irqoff_start = rdtsc();
+	if (__builtin_expect(trace_on, 0)) { this_cpu()->trace_irq = irq + 1; trace_rec(TR_IRQ, (unsigned)irq); }
+}
 
-static int cur_x, cur_y;
+/* ---- Mouse state (owned by the GUI, the mouse_events consumer) ---- */
 
-static void vga_scroll(void)
-{
-	unsigned total = (unsigned)GFX_WIDTH * (unsigned)(CONSOLE_ROWS - 1) * (unsigned)CHAR_H;
-	unsigned src_off = (unsigned)GFX_WIDTH * (unsigned)CHAR_H;
-	unsigned flags, i;
-	int mx, my;
+static volatile int mouse_x = 160, mouse_y = 100;
+static volatile unsigned char mouse_btns;
 
-	/* Prevent timer ISR from touching cursor during scroll */
-	gui_no_cursor = 1;
-	if (gui_old_mx >= 0)
-		cursor_hide(gui_old_mx, gui_old_my);
+/* ---- GUI state (shared between timer ISR and scroll) ---- */
 
-	/* Disable interrupts — fast bulk copy with no per-pixel overhead */
-	__asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+static int gui_old_mx = -1, gui_old_my = -1;
+static volatile int gui_no_cursor;   /* when set, timer skips cursor update */
 
-	i = 0;
-	while (i < total) {
-		unsigned src = i + src_off;
-		int db = (int)(i   / VGA_BANK_SIZE);
-		int sb = (int)(src / VGA_BANK_SIZE);
-		unsigned dr = VGA_BANK_SIZE - (i   % VGA_BANK_SIZE);
-		unsigned sr = VGA_BANK_SIZE - (src % VGA_BANK_SIZE);
-		unsigned chunk = dr < sr ? dr : sr;
-		if (i + chunk > total) chunk = total - i;
-
-		if (sb == db) {
-			/* Same bank — fast 4-byte copy within window */
-			unsigned s = src % VGA_BANK_SIZE, d = i % VGA_BANK_SIZE;
-			unsigned j, w = chunk >> 2;
-			vbe_set_bank(db);
-			for (j = 0; j < w; j++)
-				((unsigned *)(fb_win + d))[j] = ((unsigned *)(fb_win + s))[j];
-			for (j = w << 2; j < chunk; j++)
-				fb_win[d + j] = fb_win[s + j];
-		} else {
-			/* Cross-bank — batch via temp buffer */
-			unsigned char tmp[512];
-			unsigned s = src % VGA_BANK_SIZE, d = i % VGA_BANK_SIZE;
-			unsigned done = 0;
-			while (done < chunk) {
-				unsigned batch = chunk - done, j;
-				if (batch > 512) batch = 512;
-				vbe_set_bank(sb);
-				for (j = 0; j < batch; j++) tmp[j] = fb_win[s + done + j];
-				vbe_set_bank(db);
-				for (j = 0; j < batch; j++) fb_win[d + done + j] = tmp[j];
-				done += batch;
-			}
-		}
-		i += chunk;
-	}
+/* ---- Command history ---- */
 
-	/* Clear last row (fits in one bank) */
-	{
-		unsigned start = (unsigned)(CONSOLE_ROWS - 1) * CHAR_H * GFX_WIDTH;
-		unsigned count = (unsigned)GFX_WIDTH * CHAR_H;
-		unsigned base = start % VGA_BANK_SIZE;
-		unsigned j, w = count >> 2;
-		vbe_set_bank((int)(start / VGA_BANK_SIZE));
-		for (j = 0; j < w; j++)
-			((unsigned *)(fb_win + base))[j] = COL_BG * 0x01010101u;
-		for (j = w << 2; j < count; j++)
-			fb_win[base + j] = COL_BG;
-	}
-	cur_y = CONSOLE_ROWS - 1;
+static char history[HIST_SIZE][CMD_BUF_SIZE];
+static int  hist_count;
 
-	__asm__ volatile("pushl %0; popfl" :: "r"(flags) : "memory");
+/* ---- Serial console (COM1, 16550) ----
+ * Console output is mirrored into a TX ring; the THRE interrupt refills
+ * the 16-byte FIFO in bursts so printing never waits on the line unless
+ * the ring is full. Received bytes go to the shell via serial_rx.
+ */
 
-	/* Restore cursor at current mouse position */
-	mx = mouse_x; my = mouse_y;
-	cursor_show(mx, my);
-	gui_old_mx = mx; gui_old_my = my;
-	gui_no_cursor = 0;
-}
+#define COM1            0x3F8
+#define UART_FIFO       16
+#define SERIAL_TX_SIZE  4096            /* power of two */
+
+static int serial_ok;
+static spinlock_t serial_lock;
+static unsigned char serial_tx[SERIAL_TX_SIZE];
+static unsigned serial_head, serial_tail;   /* under serial_lock */
+static int serial_tx_busy;                  /* THRE interrupt armed */
+static unsigned serial_tx_stalls;
 
-static void vga_putchar(char c)
+/* Move up to one FIFO's worth from the ring to the UART; lock held */
+static void serial_fill(void)
 {
-	if (c == '\n') {
-		cur_x = 0; cur_y++;
-	} else if (c == '\b') {
-		if (cur_x > 0) { cur_x--; gfx_char(cur_x*CHAR_W, cur_y*CHAR_H, ' ', COL_FG, COL_BG); }
-	} else if (c == '\t') {
-		cur_x = (cur_x + 4) & ~3;
-		if (cur_x >= CONSOLE_COLS) { cur_x = 0; cur_y++; }
-	} else {
-		gfx_char(cur_x*CHAR_W, cur_y*CHAR_H, c, COL_FG, COL_BG);
-		cur_x++;
-		if (cur_x >= CONSOLE_COLS) { cur_x = 0; cur_y++; }
-	}
-	if (cur_y >= CONSOLE_ROWS) vga_scroll();
+	int n;
+	for (n = 0; n < UART_FIFO && serial_tail != serial_head; n++)
+		outb(COM1, serial_tx[serial_tail++ & (SERIAL_TX_SIZE - 1)]);
+	serial_tx_busy = serial_tail != serial_head;
+	outb(COM1 + 1, serial_tx_busy ? 0x03 : 0x01);   /* RX (+ THRE while busy) */
 }
 
-static void vga_puts(const char *s) { while (*s) vga_putchar(*s++); }
-
-static void vga_putint(unsigned n)
+static void serial_init(void)
 {
-	char buf[12]; int i = 0;
-	if (n == 0) { vga_putchar('0'); return; }
-	while (n) { buf[i++] = '0' + n % 10; n /= 10; }
-	while (--i >= 0) vga_putchar(buf[i]);
+	outb(COM1 + 1, 0x00);               /* IER off */
+	outb(COM1 + 3, 0x80);               /* DLAB */
+	outb(COM1 + 0, 0x01); outb(COM1 + 1, 0x00);  /* 115200 baud */
+	outb(COM1 + 3, 0x03);               /* 8N1 */
+	outb(COM1 + 2, 0xC7);               /* FIFO on, cleared, RX trigger 14 */
+	outb(COM1 + 4, 0x1E);               /* loopback self-test */
+	outb(COM1, 0xAE);
+	if (inb(COM1) != 0xAE) return;
+	outb(COM1 + 4, 0x0B);               /* DTR, RTS, OUT2 (IRQ enable) */
+	outb(COM1 + 1, 0x01);
+	serial_ok = 1;
 }
 
-static void vga_puthex(unsigned n)
+static void serial_putc(char c)
 {
-	static const char h[] = "0123456789abcdef";
-	int i; vga_puts("0x");
-	for (i = 28; i >= 0; i -= 4) vga_putchar(h[(n >> i) & 0xF]);
+	unsigned flags;
+	if (!serial_ok) return;
+	if (c == '\n') serial_putc('\r');
+	flags = spin_lock_irqsave(&serial_lock);
+	if (serial_head - serial_tail == SERIAL_TX_SIZE) {
+		/* Ring full: drain one FIFO synchronously */
+		serial_tx_stalls++;
+		while (!(inb(COM1 + 5) & 0x20));
+		serial_fill();
+	}
+	serial_tx[serial_head++ & (SERIAL_TX_SIZE - 1)] = (unsigned char)c;
+	if (!serial_tx_busy) {
+		if (inb(COM1 + 5) & 0x20) serial_fill();
+		else { serial_tx_busy = 1; outb(COM1 + 1, 0x03); }  /* THRE fires once the FIFO drains */
+	}
+	spin_unlock_irqrestore(&serial_lock, flags);
 }
 
-static void vga_clear(void)
+void serial_handler(void)
 {
-	gfx_rect(0, 0, GFX_WIDTH, TASKBAR_Y, COL_BG);
-	cur_x = cur_y = 0;
+	struct raw_input r;
+	unsigned char iir;
+	unsigned flags;
+
+	irq_enter(4);
+	flags = spin_lock_irqsave(&serial_lock);
+	while (!((iir = inb(COM1 + 2)) & 1)) {  /* bit 0 clear: interrupt pending */
+		switch (iir & 0x0E) {
+		case 0x04: case 0x0C:               /* RX data / timeout */
+			while (inb(COM1 + 5) & 0x01) {
+				r.tsc = this_cpu()->irqoff_start;
+				r.byte = inb(COM1);
+				spsc_put(&serial_rx, &r);
+			}
+			input_wake();
+			break;
+		case 0x02:                          /* THR empty */
+			serial_fill();
+			break;
+		default:                            /* line / modem status */
+			inb(COM1 + 5); inb(COM1 + 6);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&serial_lock, flags);
 }
 
 /* ---- Desktop (taskbar + palette) ---- */
@@ -315,8 +406,122 @@ static void pic_init(void)
 	outb(0x21,0x20); io_wait(); outb(0xA1,0x28); io_wait();
 	outb(0x21,0x04); io_wait(); outb(0xA1,0x02); io_wait();
 	outb(0x21,0x01); io_wait(); outb(0xA1,0x01); io_wait();
-	outb(0x21, 0xF8);   /* master: unmask IRQ0,1,2 */
-	outb(0xA1, 0xEF);   /* slave:  unmask IRQ12 (mouse) */
+	outb(0x21, 0xE8);   /* master: unmask IRQ0,1,2,4 (COM1) */
+	outb(0xA1, 0xAF);   /* slave:  unmask IRQ12 (mouse), IRQ14 (ATA) */
+}
+
+/* ---- Local APIC / I/O APIC ----
+ * Found through the ACPI MADT. When present, the 8259s are masked, IRQs are
+ * routed through the I/O APIC to the BSP and the ISR stubs EOI with a single
+ * MMIO store to the LAPIC (lapic_eoi); otherwise the PIC path stays.
+ */
+
+#define LAPIC_ID      0x020
+#define LAPIC_TPR     0x080
+#define LAPIC_EOI     0x0B0
+#define LAPIC_SVR     0x0F0
+#define LAPIC_ICRLO   0x300
+#define LAPIC_ICRHI   0x310
+#define LAPIC_LVT_TMR 0x320
+#define LAPIC_TICR    0x380
+#define LAPIC_TCCR    0x390
+#define LAPIC_TDCR    0x3E0
+
+struct acpi_sdt {
+	char sig[4]; unsigned len; unsigned char rev, csum;
+	char oem[6], oem_table[8]; unsigned oem_rev, creator, creator_rev;
+} __attribute__((packed));
+
+volatile unsigned *lapic_eoi;           /* read by ISR stubs; 0 = EOI the PIC */
+static volatile unsigned *lapic, *ioapic;
+static unsigned ioapic_gsi_base;
+static unsigned irq_gsi[16];
+static unsigned short irq_flags[16];    /* MPS INTI flags from MADT overrides */
+static unsigned char cpu_apic_id[MAX_CPUS];
+static int ncpus = 1;
+
+static int mem_eq(const void *a, const char *b, int n)
+{ const char *p = (const char *)a; while (n--) if (*p++ != *b++) return 0; return 1; }
+
+static unsigned char *acpi_scan_rsdp(unsigned char *p, unsigned len)
+{
+	unsigned char sum; int i;
+	for (; len >= 20; p += 16, len -= 16) {
+		if (!mem_eq(p, "RSD PTR ", 8)) continue;
+		for (sum = 0, i = 0; i < 20; i++) sum += p[i];
+		if (!sum) return p;
+	}
+	return 0;
+}
+
+static struct acpi_sdt *acpi_find(const char *sig)
+{
+	unsigned char *rsdp = acpi_scan_rsdp((unsigned char *)(*(volatile unsigned short *)0x40E << 4), 1024);
+	struct acpi_sdt *rsdt, *t; unsigned *ent; unsigned i, n;
+	if (!rsdp) rsdp = acpi_scan_rsdp((unsigned char *)0xE0000, 0x20000);
+	if (!rsdp) return 0;
+	rsdt = (struct acpi_sdt *)*(unsigned *)(rsdp + 16);
+	n = (rsdt->len - sizeof(*rsdt)) / 4; ent = (unsigned *)(rsdt + 1);
+	for (i = 0; i < n; i++) {
+		t = (struct acpi_sdt *)ent[i];
+		if (mem_eq(t->sig, sig, 4)) return t;
+	}
+	return 0;
+}
+
+static void ioapic_write(unsigned reg, unsigned v) { ioapic[0] = reg; ioapic[4] = v; }
+
+static void ioapic_route(int irq, int vec)
+{
+	unsigned pin = irq_gsi[irq] - ioapic_gsi_base, lo = (unsigned)vec, f = irq_flags[irq];
+	if ((f & 3) == 3) lo |= 1u << 13;           /* active low */
+	if (((f >> 2) & 3) == 3) lo |= 1u << 15;    /* level triggered */
+	ioapic_write(0x11 + pin*2, lapic[LAPIC_ID/4] & 0xFF000000u);   /* dest: this CPU */
+	ioapic_write(0x10 + pin*2, lo);
+}
+
+static int apic_init(void)
+{
+	struct acpi_sdt *madt; unsigned char *p, *end; unsigned a, b, c, d; int i;
+
+	cpuid(1, &a, &b, &c, &d);
+	if (!(d & (1u << 9))) return 0;             /* no LAPIC */
+	if (!(madt = acpi_find("APIC"))) return 0;
+
+	for (i = 0; i < 16; i++) { irq_gsi[i] = (unsigned)i; irq_flags[i] = 0; }
+	ncpus = 0;
+	p = (unsigned char *)madt + sizeof(*madt);
+	lapic = (volatile unsigned *)*(unsigned *)p;
+	end = (unsigned char *)madt + madt->len;
+	for (p += 8; p + 2 <= end && p[1]; p += p[1]) {
+		switch (p[0]) {
+		case 0:     /* processor LAPIC */
+			if ((p[4] & 1) && ncpus < MAX_CPUS) cpu_apic_id[ncpus++] = p[3];
+			break;
+		case 1:     /* I/O APIC */
+			if (!ioapic) { ioapic = (volatile unsigned *)*(unsigned *)(p+4); ioapic_gsi_base = *(unsigned *)(p+8); }
+			break;
+		case 2:     /* interrupt source override (QEMU: IRQ0 -> GSI2) */
+			if (p[3] < 16) { irq_gsi[p[3]] = *(unsigned *)(p+4); irq_flags[p[3]] = *(unsigned short *)(p+8); }
+			break;
+		}
+	}
+	if (!ncpus) ncpus = 1;
+	if (!ioapic) return 0;
+
+	/* 8259s stay remapped to 0x20-0x2F but fully masked */
+	outb(0x21, 0xFF); outb(0xA1, 0xFF);
+	wrmsr(0x1B, rdmsr(0x1B) | 0x800);           /* IA32_APIC_BASE global enable */
+	lapic[LAPIC_TPR/4] = 0;
+	lapic[LAPIC_SVR/4] = 0x100 | 0xFF;          /* enable, spurious vector 0xFF */
+
+	ioapic_route(0, 0x20);
+	ioapic_route(1, 0x21);
+	ioapic_route(4, 0x24);
+	ioapic_route(12, 0x2C);
+	ioapic_route(14, 0x2E);
+	lapic_eoi = lapic + LAPIC_EOI/4;
+	return 1;
 }
 
 /* ---- PIT ---- */
@@ -327,6 +532,62 @@ static void pit_init(unsigned hz)
 	outb(0x43,0x34); outb(0x40, d & 0xFF); outb(0x40, (d>>8) & 0xFF);
 }
 
+/* ---- TSC ---- */
+
+static unsigned tsc_khz;                /* TSC cycles per millisecond */
+
+/* hlt on behalf of a task that is only waiting for an interrupt */
+static void cpu_halt(void)
+{
+	struct cpu *c = this_cpu();
+	c->halted = 1;
+	__asm__ volatile("hlt");
+	c->halted = 0;
+}
+
+static void wait_ticks(unsigned n) { unsigned t = ticks; while (ticks - t < n) cpu_halt(); }
+
+/* Count TSC cycles over 10 PIT ticks (100 ms); needs interrupts on */
+static void tsc_calibrate(void)
+{
+	unsigned long long t0;
+	wait_ticks(1);
+	t0 = rdtsc();
+	wait_ticks(10);
+	tsc_khz = (unsigned)(rdtsc() - t0) / (10 * 1000 / TIMER_HZ);
+}
+
+/* Cycles to milliseconds / microseconds without a 64-bit divide (drops low bits) */
+static unsigned tsc_div(unsigned long long cyc, unsigned per)
+{
+	while (cyc >> 32) { cyc >>= 1; per >>= 1; }
+	return per ? (unsigned)cyc / per : 0;
+}
+static unsigned tsc_to_ms(unsigned long long cyc) { return tsc_div(cyc, tsc_khz); }
+static unsigned tsc_to_us(unsigned long long cyc) { return tsc_div(cyc, tsc_khz / 1000); }
+
+/* ---- Boot stage timestamps ----
+ * The IPL and loader store RDTSC at fixed slots of a table at 0x700;
+ * kernel_main appends one per init step.
+ */
+
+#define BOOT_TSC         ((volatile unsigned long long *)0x700)
+#define BOOT_ASM_STAGES  8
+#define BOOT_MAX_STAGES  32             /* 0x700 - 0x7FF */
+
+static const char *boot_names[BOOT_MAX_STAGES] = {
+	"ipl", "kernel loaded", "loader", "e820", "font", "vesa mode", "protected mode",
+	"lz4 unpack",
+};
+static int boot_nstages = BOOT_ASM_STAGES;
+
+static void boot_mark(const char *name)
+{
+	if (boot_nstages >= BOOT_MAX_STAGES) return;
+	BOOT_TSC[boot_nstages] = rdtsc();
+	boot_names[boot_nstages++] = name;
+}
+
 /* ---- IDT ---- */
 
 struct idt_entry { unsigned short ol; unsigned short sel; unsigned char z, ta; unsigned short oh; } __attribute__((packed));
@@ -337,447 +598,3030 @@ static void idt_set_gate(int n, unsigned h)
 	idt[n].ol = h & 0xFFFF; idt[n].sel = 0x08; idt[n].z = 0; idt[n].ta = 0x8E; idt[n].oh = (h>>16) & 0xFFFF;
 }
 
-/* ---- Heap allocator ---- */
+/* Interrupt gate that ring 3 may raise with INT n */
+static void idt_set_user_gate(int n, unsigned h)
+{
+	idt_set_gate(n, h);
+	((volatile struct idt_entry *)0x70000)[n].ta = 0xEE;
+}
+
+/* ---- FPU/SSE (lazy switching) ----
+ * A CPU sets CR0.TS whenever it switches to a task that does not own its
+ * FPU registers; that task's first FPU/SSE instruction raises #NM and the
+ * state is swapped with FXSAVE/FXRSTOR. Integer-only tasks never pay for it.
+ */
+
+static int fpu_ok;
 
-struct heap_block { unsigned int size, used; struct heap_block *next; };
-static struct heap_block *heap_head;
+static inline void clts(void) { __asm__ volatile("clts"); }
 
-static void heap_init(void)
+static inline void stts(void)
 {
-	heap_head = (struct heap_block *)HEAP_START;
-	heap_head->size = HEAP_SIZE - sizeof(struct heap_block);
-	heap_head->used = 0; heap_head->next = 0;
+	unsigned cr0;
+	__asm__ volatile("movl %%cr0,%0" : "=r"(cr0));
+	if (!(cr0 & 8)) __asm__ volatile("movl %0,%%cr0" :: "r"(cr0 | 8));
 }
 
-static void *kmalloc(unsigned sz)
+static void fpu_setup(void)
 {
-	struct heap_block *b, *nb;
-	sz = (sz + 3) & ~3;
-	for (b = heap_head; b; b = b->next) {
-		if (!b->used && b->size >= sz) {
-			if (b->size > sz + sizeof(struct heap_block) + 4) {
-				nb = (struct heap_block *)((unsigned char *)b + sizeof(struct heap_block) + sz);
-				nb->size = b->size - sz - sizeof(struct heap_block);
-				nb->used = 0; nb->next = b->next;
-				b->size = sz; b->next = nb;
-			}
-			b->used = 1;
-			return (void *)((unsigned char *)b + sizeof(struct heap_block));
-		}
-	}
-	return 0;
+	unsigned a, b, c, d, cr;
+	this_cpu()->fpu_owner = -1;
+	cpuid(1, &a, &b, &c, &d);
+	if (!(d & (1u << 24)) || !(d & (1u << 25))) return;    /* FXSR + SSE */
+	__asm__ volatile("movl %%cr0,%0" : "=r"(cr));
+	cr = (cr & ~4u) | 2u | 0x20u | 8u;                    /* EM=0 MP=1 NE=1 TS=1 */
+	__asm__ volatile("movl %0,%%cr0" :: "r"(cr));
+	__asm__ volatile("movl %%cr4,%0" : "=r"(cr));
+	cr |= (1u << 9) | (1u << 10);                         /* OSFXSR, OSXMMEXCPT */
+	__asm__ volatile("movl %0,%%cr4" :: "r"(cr));
+	fpu_ok = 1;
+	string_init((d >> 26) & 1);                           /* SSE2 memcpy/memset */
 }
 
-static void kfree(void *p)
+static unsigned char *fpu_area_alloc(void)
 {
-	struct heap_block *b;
-	if (!p) return;
-	b = (struct heap_block *)((unsigned char *)p - sizeof(struct heap_block));
-	b->used = 0;
-	while (b->next && !b->next->used) {
-		b->size += sizeof(struct heap_block) + b->next->size;
-		b->next = b->next->next;
-	}
+	unsigned char *p = (unsigned char *)kmalloc(512 + 16);
+	return p ? (unsigned char *)(((unsigned)p + 15) & ~15u) : 0;
 }
 
-/* ---- Task management ---- */
+/* ---- Task management ----
+ * Every runnable task that is not on a CPU sits in exactly one per-CPU run
+ * queue. on_cpu stays set until the CPU that switched away from the task
+ * has left its stack (sched_tail), so no other CPU can pick it up early.
+ */
 
-struct task { unsigned esp; int active; char name[16]; };
+struct task {
+	unsigned esp; int active; char name[16];
+	void *stack;
+	volatile int on_cpu;
+	volatile int blocked;           /* task_block: 1 going to sleep, 2 off every run queue */
+	int queued, idle, cpu, pin;
+	unsigned char *fpu;             /* 16-byte aligned FXSAVE area */
+	int fpu_used, fpu_cpu;          /* fpu_cpu: CPU holding the live state, -1 if saved */
+	/* Accounting, shown by 'top' */
+	unsigned ticks;                 /* scheduler ticks spent running */
+	unsigned nvcsw, nivcsw;         /* switched out by yield / by the timer */
+	unsigned long long wait_disk, wait_input;   /* TSC cycles waiting */
+	int user;                       /* runs at CPL 3; stack is then its kernel stack */
+	void *ustack;
+	struct mm *mm;                  /* address space of an exec'd program, else the kernel's */
+	struct fs_entry files[TASK_FILES];      /* SYS_OPEN; start 0 = free */
+	unsigned fpos[TASK_FILES];
+	int job;                        /* jobs[] index + 1 of a shell job, else 0; keeps the slot */
+	volatile int bg;                /* a job in the background: console to its buffer, no keys */
+	volatile int killed;            /* 'kill': stops at the next point where it holds nothing */
+	unsigned exit_waiters;          /* tasks in task_join(), one bit each */
+	int joinable;                   /* keeps the slot until task_join() has seen it stop */
+};
 static struct task tasks[MAX_TASKS];
-static int current_task, num_tasks;
+static int num_tasks;
+static spinlock_t task_lock;            /* slot allocation in tasks[] */
 
 static void my_strcpy(char *d, const char *s) { while (*s) *d++ = *s++; *d = 0; }
 
-static void task_exit(void) { tasks[current_task].active = 0; for(;;) __asm__ volatile("hlt"); }
+static void task_yield(void) { __asm__ volatile("int $0x81" ::: "memory"); }
+
+/* schedule() never queues an inactive task again */
+static void task_exit(void) { tasks[current_task].active = 0; for(;;) task_yield(); }
+
+static void task_wake_mask(unsigned mask);
+
+/* Called by schedule() as id leaves its CPU for the last time */
+static void task_gone(int id)
+{
+	unsigned f = spin_lock_irqsave(&task_lock), w = tasks[id].exit_waiters;
+	tasks[id].exit_waiters = 0;
+	spin_unlock_irqrestore(&task_lock, f);
+	task_wake_mask(w);
+}
+
+/* Each CPU's idle task zeroes blocks for kzalloc while there is room in
+ * the pool, then halts. Whatever an interrupt made runnable here gets
+ * the CPU straight away rather than at the next tick. */
+static void idle_loop(void)
+{
+	for(;;) {
+		__asm__ volatile("sti");
+		if (!heap_zero_idle()) __asm__ volatile("sti; hlt");
+		if (this_cpu()->rq_n) task_yield();
+	}
+}
+
+static void rq_push(struct cpu *c, int id)
+{
+	unsigned f = spin_lock_irqsave(&c->rq_lock);
+	c->rq[(c->rq_head + c->rq_n++) % MAX_TASKS] = id;
+	tasks[id].queued = 1;
+	spin_unlock_irqrestore(&c->rq_lock, f);
+}
+
+/* Take the first runnable task; own=1 also accepts the task this CPU is leaving.
+ * Pinned tasks never move. A task whose FPU state is live on another CPU
+ * stays until that CPU has saved it, which it is asked to do here. */
+static int rq_take(struct cpu *c, struct cpu *self, int own)
+{
+	unsigned f = spin_lock_irqsave(&c->rq_lock);
+	int n, t, id = -1;
+	for (n = c->rq_n; n > 0 && id < 0; n--) {
+		t = c->rq[c->rq_head];
+		c->rq_head = (c->rq_head + 1) % MAX_TASKS; c->rq_n--;
+		if (!tasks[t].active) { tasks[t].queued = 0; continue; }   /* killed */
+		if ((tasks[t].on_cpu && !(own && t == self->cur)) || (!own && tasks[t].pin >= 0)
+		    || (tasks[t].fpu_cpu >= 0 && tasks[t].fpu_cpu != self->id)) {
+			if (tasks[t].fpu_cpu >= 0 && tasks[t].fpu_cpu != self->id && tasks[t].pin < 0)
+				cpus[tasks[t].fpu_cpu].fpu_flush = 1;
+			c->rq[(c->rq_head + c->rq_n++) % MAX_TASKS] = t;      /* leave it queued */
+			continue;
+		}
+		tasks[t].queued = 0; tasks[t].on_cpu = 1; id = t;
+	}
+	spin_unlock_irqrestore(&c->rq_lock, f);
+	return id;
+}
+
+/* Own queue empty: steal from the busiest peer */
+static int rq_steal(struct cpu *self)
+{
+	struct cpu *v = 0; int i, id;
+	for (i = 0; i < ncpus_online; i++)
+		if (&cpus[i] != self && cpus[i].rq_n > 0 && (!v || cpus[i].rq_n > v->rq_n)) v = &cpus[i];
+	if (!v || (id = rq_take(v, self, 0)) < 0) return -1;
+	self->steals++;
+	return id;
+}
+
+/* Save the FPU state of a task that is not running here, so that another
+ * CPU can take it; its next SSE use there restores it through #NM */
+static void fpu_release(struct cpu *c)
+{
+	int o = c->fpu_owner;
+	c->fpu_flush = 0;
+	if (o < 0 || o == c->cur) return;
+	clts();
+	__asm__ volatile("fxsave (%0)" :: "r"(tasks[o].fpu) : "memory");
+	c->fpu_owner = -1;
+	tasks[o].fpu_cpu = -1;
+}
+
+static unsigned schedule(unsigned esp, int voluntary)
+{
+	struct cpu *c = this_cpu();
+	int next;
+
+	tasks[c->cur].esp = esp;
+	if (c->fpu_flush) fpu_release(c);
+	if (!tasks[c->cur].active && c->cur != c->idle) task_gone(c->cur);
+	if (tasks[c->cur].active && c->cur != c->idle
+	    && !(tasks[c->cur].blocked == 1 && __sync_bool_compare_and_swap(&tasks[c->cur].blocked, 1, 2)))
+		rq_push(c, c->cur);
+	if ((next = rq_take(c, c, 1)) < 0 && (next = rq_steal(c)) < 0) {
+		next = c->idle;
+		tasks[next].on_cpu = 1;
+	}
+	tasks[next].cpu = c->id;
+	if (next != c->cur) {
+		if (voluntary) tasks[c->cur].nvcsw++; else tasks[c->cur].nivcsw++;
+		c->halted = 0;                  /* only the preempted task was in cpu_halt() */
+		TRACE(TR_SWITCH, c->cur << 16 | next);
+	}
+	c->prev = c->cur; c->cur = next;
+	if (tasks[next].user) c->tss.esp0 = (unsigned)tasks[next].stack + TASK_STACK_SIZE;
+	vm_switch(tasks[next].mm);
+	if (fpu_ok) { if (next == c->fpu_owner) clts(); else stts(); }
+	return tasks[next].esp;
+}
+
+/* Called by the ISR stubs once they run on the new task's stack */
+void sched_tail(void)
+{
+	struct cpu *c = this_cpu();
+	if (c->prev != c->cur) tasks[c->prev].on_cpu = 0;
+	c->prev = c->cur;
+}
+
+static struct cpu *least_loaded_cpu(void)
+{
+	struct cpu *best = &cpus[0]; int i;
+	for (i = 1; i < ncpus_online; i++)
+		if (cpus[i].rq_n < best->rq_n) best = &cpus[i];
+	return best;
+}
+
+/* Reserve a slot in tasks[]: a dead, dequeued one or a new one */
+static int task_slot(const char *name)
+{
+	unsigned f = spin_lock_irqsave(&task_lock);
+	int i, id = -1;
+	for (i = 0; i < num_tasks && id < 0; i++)
+		if (!tasks[i].active && !tasks[i].on_cpu && !tasks[i].queued && !tasks[i].idle && !tasks[i].job
+		    && !tasks[i].joinable) id = i;
+	if (id < 0 && num_tasks < MAX_TASKS) id = num_tasks++;
+	if (id >= 0) {
+		struct task *t = &tasks[id];
+		if (t->stack) { kfree(t->stack); t->stack = 0; }
+		if (t->ustack) { kfree(t->ustack); t->ustack = 0; }
+		vm_release(__sync_lock_test_and_set(&t->mm, 0));
+		heap_task_exit(id);             /* what the last task here leaked is not ours */
+		if (!t->fpu) t->fpu = fpu_area_alloc();
+		/* Drop a dead predecessor's claim on some CPU's FPU registers */
+		if (t->fpu_cpu >= 0) __sync_bool_compare_and_swap(&cpus[t->fpu_cpu].fpu_owner, id, -1);
+		for (i = 0; i < (int)sizeof(t->name) - 1 && name[i]; i++) t->name[i] = name[i];
+		t->name[i] = 0;
+		t->on_cpu = 0; t->queued = 0; t->idle = 0; t->cpu = 0; t->pin = -1; t->blocked = 0;
+		t->fpu_used = 0; t->fpu_cpu = -1; t->user = 0; t->job = 0; t->bg = 0;
+		t->killed = 0; t->exit_waiters = 0; t->joinable = 0;
+		memset(t->files, 0, sizeof(t->files));
+		t->ticks = t->nvcsw = t->nivcsw = 0; t->wait_disk = t->wait_input = 0;
+		t->active = 1;
+	}
+	spin_unlock_irqrestore(&task_lock, f);
+	return id;
+}
 
 static void task_init_main(void)
 {
+	struct cpu *c = &cpus[0];
 	my_strcpy(tasks[0].name, "shell");
-	tasks[0].active = 1; tasks[0].esp = 0;
-	current_task = 0; num_tasks = 1;
+	tasks[0].active = 1; tasks[0].esp = 0; tasks[0].on_cpu = 1;
+	tasks[0].pin = -1; tasks[0].fpu_cpu = -1; tasks[0].fpu = fpu_area_alloc();
+	num_tasks = 1;
+	c->cur = c->prev = 0;
 }
 
-static int task_create(void (*fn)(void), const char *name)
+static int task_spawn_stack(void (*fn)(void), const char *name, unsigned size)
 {
-	unsigned *sp; int id;
-	if (num_tasks >= MAX_TASKS) return -1;
-	id = num_tasks;
-	sp = (unsigned *)((unsigned char *)kmalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE);
+	unsigned *sp, *stk; int id;
+	if (!(stk = (unsigned *)kzalloc(size))) return -1;
+	if ((id = task_slot(name)) < 0) { kfree(stk); return -1; }
+	sp = (unsigned *)((unsigned char *)stk + size);
 	*(--sp) = (unsigned)task_exit;
-	*(--sp) = 0x202; *(--sp) = 0x08; *(--sp) = (unsigned)fn;
+	*(--sp) = 0x202; *(--sp) = SEL_KCODE; *(--sp) = (unsigned)fn;
 	*(--sp)=0; *(--sp)=0; *(--sp)=0; *(--sp)=0;
 	*(--sp)=0; *(--sp)=0; *(--sp)=0; *(--sp)=0;
+	tasks[id].stack = stk;
 	tasks[id].esp = (unsigned)sp;
-	tasks[id].active = 1;
-	my_strcpy(tasks[id].name, name);
-	num_tasks++;
 	return id;
 }
 
-/* ---- Mouse cursor (10x14 arrow) ---- */
+static int task_spawn(void (*fn)(void), const char *name) { return task_spawn_stack(fn, name, TASK_STACK_SIZE); }
 
-#define CUR_W 10
-#define CUR_H 14
+static int task_create(void (*fn)(void), const char *name)
+{
+	int id = task_spawn(fn, name);
+	if (id >= 0) rq_push(least_loaded_cpu(), id);
+	return id;
+}
 
-/* 1=white pixel, 2=black outline */
-static const unsigned char cursor_data[CUR_H][CUR_W] = {
-	{2,0,0,0,0,0,0,0,0,0},
-	{2,2,0,0,0,0,0,0,0,0},
-	{2,1,2,0,0,0,0,0,0,0},
-	{2,1,1,2,0,0,0,0,0,0},
-	{2,1,1,1,2,0,0,0,0,0},
-	{2,1,1,1,1,2,0,0,0,0},
-	{2,1,1,1,1,1,2,0,0,0},
-	{2,1,1,1,1,1,1,2,0,0},
-	{2,1,1,1,1,1,1,1,2,0},
-	{2,1,1,1,1,2,2,2,2,0},
-	{2,1,1,2,1,2,0,0,0,0},
-	{2,1,2,0,2,1,2,0,0,0},
-	{2,2,0,0,2,1,2,0,0,0},
-	{2,0,0,0,0,2,2,0,0,0},
-};
+/* A ring-3 task, not yet queued: the first switch to it IRETs to eip
+ * with the user stack at usp and eax in EAX */
+static int task_spawn_user(const char *name, unsigned eip, unsigned usp, unsigned eax)
+{
+	unsigned *sp, *stk; int id;
+	if (!(stk = (unsigned *)kzalloc(TASK_STACK_SIZE))) return -1;
+	if ((id = task_slot(name)) < 0) { kfree(stk); return -1; }
+	sp = (unsigned *)((unsigned char *)stk + TASK_STACK_SIZE);
+	*(--sp) = SEL_UDATA | 3; *(--sp) = usp;
+	*(--sp) = 0x202; *(--sp) = SEL_UCODE | 3; *(--sp) = eip;
+	*(--sp)=eax; *(--sp)=0; *(--sp)=0; *(--sp)=0;
+	*(--sp)=0; *(--sp)=0; *(--sp)=0; *(--sp)=0;
+	tasks[id].stack = stk;
+	tasks[id].esp = (unsigned)sp;
+	tasks[id].user = 1;
+	return id;
+}
 
-static unsigned char cursor_save[CUR_W * CUR_H];
+/* A program from kernel/user.c: runs on its own user stack and
+ * returns into user_exit. With paging it gets an address space where
+ * ring 3 sees only kernel/user.c's pages and that stack. */
+#define USER_STACK_SIZE 4096
 
-static void cursor_hide(int cx, int cy)
+static int task_create_user(void (*fn)(void), const char *name)
 {
-	int r, c, idx = 0;
-	unsigned off;
-	for (r = 0; r < CUR_H; r++)
-		for (c = 0; c < CUR_W; c++, idx++)
-			if (cursor_data[r][c] && (unsigned)(cx+c) < GFX_WIDTH && (unsigned)(cy+r) < GFX_HEIGHT) {
-				off = (unsigned)(cy+r)*GFX_WIDTH + (unsigned)(cx+c);
-				fb_write(off, cursor_save[idx]);
-			}
+	unsigned usp, *ustk = 0; struct mm *mm = 0; int id;
+	if (vm_on) {
+		if (vm_builtin((unsigned)user_exit, &mm, &usp) < 0) return -1;
+	} else {
+		if (!(ustk = (unsigned *)kzalloc(USER_STACK_SIZE))) return -1;
+		usp = (unsigned)ustk + USER_STACK_SIZE - 4;
+		*(unsigned *)usp = (unsigned)user_exit;
+	}
+	if ((id = task_spawn_user(name, (unsigned)fn, usp, 0)) < 0) { kfree(ustk); vm_release(mm); return -1; }
+	tasks[id].ustack = ustk;
+	tasks[id].mm = mm;
+	rq_push(least_loaded_cpu(), id);
+	return id;
 }
 
-static void cursor_show(int cx, int cy)
+/* An exec'd program in its own address space; it finds sys_fast in EAX */
+static int task_create_proc(struct mm *mm, const char *name, unsigned entry, unsigned usp)
 {
-	int r, c, idx = 0;
-	unsigned off;
-	for (r = 0; r < CUR_H; r++)
-		for (c = 0; c < CUR_W; c++, idx++) {
-			if ((unsigned)(cx+c) >= GFX_WIDTH || (unsigned)(cy+r) >= GFX_HEIGHT) continue;
-			off = (unsigned)(cy+r)*GFX_WIDTH + (unsigned)(cx+c);
-			cursor_save[idx] = fb_read(off);
-			if (cursor_data[r][c] == 2)
-				fb_write(off, 0);
-			else if (cursor_data[r][c] == 1)
-				fb_write(off, 15);
-		}
+	int id = task_spawn_user(name, entry, usp, (unsigned)sys_fast);
+	if (id < 0) return -1;
+	tasks[id].mm = mm;
+	rq_push(least_loaded_cpu(), id);
+	return id;
+}
+
+extern void sysenter_entry(void);
+
+#define MSR_SYSENTER_CS   0x174
+#define MSR_SYSENTER_ESP  0x175
+#define MSR_SYSENTER_EIP  0x176
+
+/* Per CPU: SYSENTER lands on the running task's kernel stack via tss.esp0 */
+static void sysenter_setup(void)
+{
+	struct cpu *c = this_cpu();
+	unsigned a, b, cx, d;
+	cpuid(1, &a, &b, &cx, &d);
+	/* SEP; the family 6 parts before model 3 stepping 3 report it falsely */
+	if (!(d & (1u << 11)) || ((a & 0xFFF) < 0x633 && ((a >> 8) & 0xF) == 6)) return;
+	wrmsr(MSR_SYSENTER_CS, SEL_KCODE);
+	wrmsr(MSR_SYSENTER_ESP, (unsigned)&c->tss.esp0);
+	wrmsr(MSR_SYSENTER_EIP, (unsigned)sysenter_entry);
+	sys_fast = 1;
+}
+
+/* Create a task that only ever runs on the given CPU */
+static int task_create_on(void (*fn)(void), const char *name, int cpu)
+{
+	int id = task_spawn(fn, name);
+	if (id >= 0) { tasks[id].pin = cpu; rq_push(&cpus[cpu], id); }
+	return id;
+}
+
+/* BSP idle task: runs only when its run queue is empty and nothing can be stolen */
+static void task_init_idle(void)
+{
+	int id = task_spawn(idle_loop, "idle0");
+	tasks[id].idle = 1;
+	cpus[0].idle = id;
+}
+
+extern void isr_yield(void);
+
+unsigned yield_handler(unsigned esp) { return schedule(esp, 1); }
+
+/* Sleep until task_wake(). The caller holds l, under which a waker will
+ * find it; the next schedule() takes the task off the run queues. */
+static void task_block(spinlock_t *l, unsigned flags)
+{
+	tasks[current_task].blocked = 1;
+	spin_unlock_irqrestore(l, flags);
+	task_yield();
+}
+
+/* Queue a blocked task on this CPU, where it usually runs next, unless
+ * it is pinned or its FPU state lives elsewhere */
+static void task_wake(int id)
+{
+	struct task *t = &tasks[id];
+	int s;
+	while ((s = t->blocked) != 0)
+		if (__sync_bool_compare_and_swap(&t->blocked, s, 0)) {
+			if (s == 2) rq_push(t->pin >= 0 ? &cpus[t->pin] : t->fpu_cpu >= 0 ? &cpus[t->fpu_cpu] : this_cpu(), id);
+			break;
+		}
+}
+
+static void task_wake_mask(unsigned mask)
+{
+	int i;
+	for (i = 0; mask; i++, mask >>= 1)
+		if (mask & 1) task_wake(i);
+}
+
+/* Ask id to stop. It does so only where it holds nothing of the kernel's:
+ * interrupted in ring 3, at the end of a system call, or where a kernel
+ * command checks 'killed'. Waits for input and IPC give up for a killed
+ * task, so it is woken to get there. */
+static void task_kill(int id)
+{
+	tasks[id].killed = 1;
+	task_wake(id);
+}
+
+/* Sleep until task id has stopped for good; id is a job's task or was
+ * made joinable before it was queued, so its slot is still its own */
+static void task_join(int id)
+{
+	unsigned f = spin_lock_irqsave(&task_lock);
+	while (tasks[id].active) {
+		tasks[id].exit_waiters |= 1u << current_task;
+		task_block(&task_lock, f);
+		f = spin_lock_irqsave(&task_lock);
+	}
+	tasks[id].joinable = 0;
+	spin_unlock_irqrestore(&task_lock, f);
+}
+
+/* ---- Sleeping locks ----
+ * Each lock's spinlock guards its state. A waiter adds itself to the
+ * waiters mask and sleeps in task_block(); releases wake the whole mask
+ * and everyone re-checks. The idle task cannot sleep, so it spins with
+ * interrupts on and the tick hands the CPU to the holder.
+ */
+
+static unsigned lock_wait(spinlock_t *l, unsigned flags, unsigned *waiters)
+{
+	struct cpu *c = this_cpu();
+	if (!(flags & 0x200) || c->in_softirq) {
+		vga_puts("\nKernel panic in task ");
+		vga_putint((unsigned)c->cur); vga_putchar(' '); vga_puts(tasks[c->cur].name);
+		vga_puts(": sleeping lock waited on with interrupts off\n");
+		for (;;) __asm__ volatile("cli; hlt");
+	}
+	if (c->cur != c->idle) {
+		*waiters |= 1u << c->cur;
+		task_block(l, flags);
+	} else {
+		spin_unlock_irqrestore(l, flags);
+		__asm__ volatile("pause");
+	}
+	return spin_lock_irqsave(l);
+}
+
+void mutex_lock(struct mutex *m)
+{
+	unsigned f = spin_lock_irqsave(&m->lock);
+	if (m->owner) m->contended++;
+	while (m->owner) f = lock_wait(&m->lock, f, &m->waiters);
+	m->owner = current_task + 1;
+	spin_unlock_irqrestore(&m->lock, f);
+}
+
+void mutex_unlock(struct mutex *m)
+{
+	unsigned f = spin_lock_irqsave(&m->lock), w = m->waiters;
+	m->owner = 0; m->waiters = 0;
+	spin_unlock_irqrestore(&m->lock, f);
+	task_wake_mask(w);
+}
+
+void sem_init(struct semaphore *s, int count) { s->lock = 0; s->count = count; s->waiters = 0; }
+
+void sem_down(struct semaphore *s)
+{
+	unsigned f = spin_lock_irqsave(&s->lock);
+	while (s->count <= 0) f = lock_wait(&s->lock, f, &s->waiters);
+	s->count--;
+	spin_unlock_irqrestore(&s->lock, f);
+}
+
+void sem_up(struct semaphore *s)
+{
+	unsigned f = spin_lock_irqsave(&s->lock), w = s->waiters;
+	s->count++; s->waiters = 0;
+	spin_unlock_irqrestore(&s->lock, f);
+	task_wake_mask(w);
+}
+
+void rw_read_lock(struct rwlock *l)
+{
+	unsigned f = spin_lock_irqsave(&l->lock);
+	if (l->writer || l->wwait) l->contended++;
+	while (l->writer || l->wwait) f = lock_wait(&l->lock, f, &l->waiters);
+	l->readers++;
+	spin_unlock_irqrestore(&l->lock, f);
+}
+
+void rw_read_unlock(struct rwlock *l)
+{
+	unsigned f = spin_lock_irqsave(&l->lock), w = 0;
+	if (--l->readers == 0) { w = l->waiters; l->waiters = 0; }
+	spin_unlock_irqrestore(&l->lock, f);
+	task_wake_mask(w);
+}
+
+void rw_write_lock(struct rwlock *l)
+{
+	unsigned f = spin_lock_irqsave(&l->lock);
+	if (l->writer || l->readers) l->contended++;
+	l->wwait++;
+	while (l->writer || l->readers) f = lock_wait(&l->lock, f, &l->waiters);
+	l->wwait--;
+	l->writer = 1;
+	spin_unlock_irqrestore(&l->lock, f);
+}
+
+void rw_write_unlock(struct rwlock *l)
+{
+	unsigned f = spin_lock_irqsave(&l->lock), w = l->waiters;
+	l->writer = 0; l->waiters = 0;
+	spin_unlock_irqrestore(&l->lock, f);
+	task_wake_mask(w);
+}
+
+extern void isr_nm(void);
+
+/* #NM: hand this CPU's FPU registers to the current task */
+void fpu_nm_handler(void)
+{
+	static const unsigned mxcsr_default = 0x1F80;
+	struct cpu *c = this_cpu();
+	struct task *t = &tasks[c->cur];
+
+	clts();
+	if (c->fpu_owner == c->cur) return;
+	c->fpu_traps++;
+	if (c->fpu_owner >= 0) {
+		struct task *o = &tasks[c->fpu_owner];
+		__asm__ volatile("fxsave (%0)" :: "r"(o->fpu) : "memory");
+		o->fpu_cpu = -1;
+	}
+	if (t->fpu_used)
+		__asm__ volatile("fxrstor (%0)" :: "r"(t->fpu) : "memory");
+	else {
+		__asm__ volatile("fninit; ldmxcsr %0" :: "m"(mxcsr_default));
+		t->fpu_used = 1;
+	}
+	c->fpu_owner = c->cur;
+	t->fpu_cpu = c->id;
+}
+
+/* kernel/string.c asks before touching XMM registers: only in task
+ * context with interrupts on, only for tasks that have a save area, and
+ * not inside a system call, where the registers hold user state */
+int may_use_fpu(void)
+{
+	unsigned fl;
+	struct cpu *c;
+	if (!fpu_ok) return 0;
+	__asm__ volatile("pushfl; popl %0" : "=r"(fl));
+	if (!(fl & 0x200)) return 0;
+	c = this_cpu();
+	return !c->in_softirq && tasks[c->cur].fpu != 0 && !tasks[c->cur].user;
+}
+
+/* ---- SMP bring-up ----
+ * APs are started with INIT-SIPI-SIPI into ap_tramp (loader.nas), copied to
+ * AP_TRAMP_ADDR. Each AP takes over its boot stack as its idle task and
+ * schedules from its own LAPIC timer, calibrated against the PIT.
+ */
+
+#define AP_TRAMP_ADDR   0x7000          /* page-aligned, below 1MB: SIPI vector 0x07 */
+#define LAPIC_TIMER_VEC 0x30
+
+extern char ap_tramp[], ap_tramp_end[];
+extern void isr_lapic_timer(void);
+
+unsigned ap_stack;                      /* read by start_ap */
+static volatile int ap_boot_cpu;
+static unsigned lapic_timer_count;      /* LAPIC counts (div 16) per PIT tick */
+
+static void lapic_ipi(unsigned apic_id, unsigned cmd)
+{
+	lapic[LAPIC_ICRHI/4] = apic_id << 24;
+	lapic[LAPIC_ICRLO/4] = cmd;
+	while (lapic[LAPIC_ICRLO/4] & (1u << 12));      /* delivery pending */
+}
+
+static void lapic_timer_start(void)
+{
+	lapic[LAPIC_TDCR/4] = 3;                        /* divide by 16 */
+	lapic[LAPIC_LVT_TMR/4] = 0x20000 | LAPIC_TIMER_VEC;  /* periodic */
+	lapic[LAPIC_TICR/4] = lapic_timer_count;
+}
+
+void ap_main(void)
+{
+	struct cpu *c = &cpus[ap_boot_cpu];
+	int id;
+
+	cpu_setup(c);
+	vm_cpu_init();
+	sysenter_setup();
+	lapic[LAPIC_TPR/4] = 0;
+	lapic[LAPIC_SVR/4] = 0x100 | 0xFF;
+	/* This boot context becomes the CPU's idle task */
+	id = task_slot("idle");
+	tasks[id].name[4] = (char)('0' + c->id); tasks[id].name[5] = 0;
+	tasks[id].idle = 1; tasks[id].on_cpu = 1; tasks[id].cpu = c->id;
+	tasks[id].stack = (void *)(ap_stack - TASK_STACK_SIZE);
+	c->cur = c->prev = c->idle = id;
+	fpu_setup();
+	c->online = 1;
+	lapic_timer_start();
+	idle_loop();
+}
+
+static void smp_init(void)
+{
+	unsigned bsp = lapic[LAPIC_ID/4] >> 24, t, stk;
+	unsigned char *d = (unsigned char *)AP_TRAMP_ADDR; const char *p;
+	int i;
+
+	/* Calibrate the LAPIC timer against 10 PIT ticks */
+	lapic[LAPIC_TDCR/4] = 3;
+	wait_ticks(1);
+	lapic[LAPIC_TICR/4] = 0xFFFFFFFF;
+	wait_ticks(10);
+	lapic_timer_count = (0xFFFFFFFF - lapic[LAPIC_TCCR/4]) / 10;
+	lapic[LAPIC_TICR/4] = 0;
+
+	for (p = ap_tramp; p < ap_tramp_end; p++) *d++ = (unsigned char)*p;
+	cpus[0].apic_id = (int)bsp; cpus[0].online = 1;
+
+	for (i = 0; i < ncpus && ncpus_online < MAX_CPUS; i++) {
+		struct cpu *c = &cpus[ncpus_online];
+		if (cpu_apic_id[i] == bsp) continue;
+		if (!(stk = (unsigned)kmalloc(TASK_STACK_SIZE))) break;
+		c->id = ncpus_online; c->apic_id = cpu_apic_id[i];
+		ap_stack = stk + TASK_STACK_SIZE;
+		ap_boot_cpu = c->id;
+		lapic_ipi(cpu_apic_id[i], 0x4500);                          /* INIT */
+		wait_ticks(1);
+		lapic_ipi(cpu_apic_id[i], 0x4600 | (AP_TRAMP_ADDR >> 12));  /* SIPI */
+		wait_ticks(1);
+		if (!c->online) lapic_ipi(cpu_apic_id[i], 0x4600 | (AP_TRAMP_ADDR >> 12));
+		for (t = ticks; !c->online && ticks - t < 50;) __asm__ volatile("hlt");
+		if (!c->online) { kfree((void *)stk); break; }
+		ncpus_online++;
+	}
+}
+
+/* ---- Sampling profiler ----
+ * Every timer interrupt on every CPU is a sample: the interrupted EIP goes
+ * into a per-CPU histogram over the kernel text and the running task id
+ * into a per-CPU counter. To sample faster than TIMER_HZ the PIT and the
+ * LAPIC timers run timer_div times faster and only every timer_div-th
+ * interrupt is a scheduler tick. Symbols come from ksyms.c, generated
+ * from kernel.elf at link time.
+ */
+
+#define PROF_SHIFT      4               /* 16-byte buckets */
+#define PROF_MAX_HZ     10000
+
+struct irq_frame {                      /* PUSHAD + CPU-pushed frame */
+	unsigned edi, esi, ebp, esp, ebx, edx, ecx, eax;
+	unsigned eip, cs, eflags;
+};
+
+struct ksym { unsigned addr; const char *name; };
+extern const struct ksym ksyms[];
+extern const unsigned ksyms_count;
+extern char _text_start[], _etext[];
+
+static volatile int prof_on;
+static volatile unsigned timer_div = 1;
+static unsigned prof_hz = TIMER_HZ;
+
+static void prof_sample(struct cpu *c, const struct irq_frame *f)
+{
+	unsigned off = f->eip - (unsigned)_text_start;
+	c->prof_samples++;
+	c->prof_task[c->cur]++;
+	if (c->prof_hist && off < (unsigned)(_etext - _text_start)) c->prof_hist[off >> PROF_SHIFT]++;
+	else c->prof_other++;
+}
+
+static void timer_set_rate(unsigned div)
+{
+	timer_div = div;
+	pit_init(TIMER_HZ * div);               /* APs pick it up on their next interrupt */
+}
+
+/* Index of the symbol containing addr, or -1 */
+static int ksym_find(unsigned addr)
+{
+	int lo = 0, hi = (int)ksyms_count - 1, r = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (ksyms[mid].addr <= addr) { r = mid; lo = mid + 1; } else hi = mid - 1;
+	}
+	return r;
+}
+
+/* ---- Mouse cursor (10x14 arrow) ---- */
+
+#define CUR_W 10
+#define CUR_H 14
+
+/* 1=white pixel, 2=black outline */
+static const unsigned char cursor_data[CUR_H][CUR_W] = {
+	{2,0,0,0,0,0,0,0,0,0},
+	{2,2,0,0,0,0,0,0,0,0},
+	{2,1,2,0,0,0,0,0,0,0},
+	{2,1,1,2,0,0,0,0,0,0},
+	{2,1,1,1,2,0,0,0,0,0},
+	{2,1,1,1,1,2,0,0,0,0},
+	{2,1,1,1,1,1,2,0,0,0},
+	{2,1,1,1,1,1,1,2,0,0},
+	{2,1,1,1,1,1,1,1,2,0},
+	{2,1,1,1,1,2,2,2,2,0},
+	{2,1,1,2,1,2,0,0,0,0},
+	{2,1,2,0,2,1,2,0,0,0},
+	{2,2,0,0,2,1,2,0,0,0},
+	{2,0,0,0,0,2,2,0,0,0},
+};
+
+static unsigned char cursor_save[CUR_W * CUR_H];
+
+static void cursor_hide(int cx, int cy)
+{
+	int r, c, idx = 0;
+	unsigned off;
+	for (r = 0; r < CUR_H; r++)
+		for (c = 0; c < CUR_W; c++, idx++)
+			if (cursor_data[r][c] && (unsigned)(cx+c) < GFX_WIDTH && (unsigned)(cy+r) < GFX_HEIGHT) {
+				off = (unsigned)(cy+r)*GFX_WIDTH + (unsigned)(cx+c);
+				fb_write(off, cursor_save[idx]);
+			}
+}
+
+static void cursor_show(int cx, int cy)
+{
+	int r, c, idx = 0;
+	unsigned off;
+	for (r = 0; r < CUR_H; r++)
+		for (c = 0; c < CUR_W; c++, idx++) {
+			if ((unsigned)(cx+c) >= GFX_WIDTH || (unsigned)(cy+r) >= GFX_HEIGHT) continue;
+			off = (unsigned)(cy+r)*GFX_WIDTH + (unsigned)(cx+c);
+			cursor_save[idx] = fb_read(off);
+			if (cursor_data[r][c] == 2)
+				fb_write(off, 0);
+			else if (cursor_data[r][c] == 1)
+				fb_write(off, 15);
+		}
+}
+
+/* ---- Interrupt handlers ---- */
+
+extern void isr_timer(void);
+extern void isr_keyboard(void);
+extern void isr_mouse(void);
+extern void isr_ata(void);
+extern void isr_serial(void);
+extern void isr_spurious(void);
+extern void isr_bench_none(void), isr_bench_pic(void), isr_bench_apic(void);
+
+/* Called by every ISR stub right before IRET; IF=0 on entry and exit. */
+void do_softirq(void)
+{
+	struct cpu *c = this_cpu();
+	unsigned pending, d; int i, b;
+
+	/* Interrupts have been off since irq_enter() — account it */
+	d = (unsigned)(rdtsc() - c->irqoff_start);
+	if (d > c->irqoff_max) c->irqoff_max = d;
+	for (b = 0, d >>= 8; d && b < IRQOFF_BUCKETS - 1; d >>= 1) b++;
+	c->irqoff_hist[b]++;
+
+	if (c->trace_irq) { TRACE(TR_IRQ_EXIT, c->trace_irq - 1); c->trace_irq = 0; }
+	if (c->in_softirq) return;          /* nested IRQ: outer loop picks it up */
+	c->in_softirq = 1;
+	while ((pending = c->softirq_pending) != 0) {
+		c->softirq_pending = 0;
+		__asm__ volatile("sti" ::: "memory");
+		TRACE(TR_SOFTIRQ, pending);
+		for (i = 0; i < NR_SOFTIRQS; i++)
+			if (pending & (1u << i)) softirq_vec[i]();
+		TRACE(TR_SOFTIRQ_EXIT, pending);
+		__asm__ volatile("cli" ::: "memory");
+	}
+	c->in_softirq = 0;
+}
+
+/* A killed task interrupted in ring 3 stops here */
+static void kill_point(struct cpu *c, unsigned esp)
+{
+	if (tasks[c->cur].killed && (((const struct irq_frame *)esp)->cs & 3)) tasks[c->cur].active = 0;
+}
+
+unsigned timer_handler(unsigned esp)
+{
+	struct cpu *c = this_cpu();
+
+	irq_enter(0);
+	if (prof_on) prof_sample(c, (const struct irq_frame *)esp);
+	if (++c->timer_sub < timer_div) return esp;
+	c->timer_sub = 0;
+	ticks++;
+	tasks[c->halted ? c->idle : c->cur].ticks++;
+	raise_softirq(SOFTIRQ_TIMER);
+
+	/* ---- Task switching (not while a softirq is running on this stack) ---- */
+	if (c->in_softirq) return esp;
+	kill_point(c, esp);
+	return schedule(esp, 0);
+}
+
+/* LAPIC timer on the APs: scheduling only, ticks stay with the BSP's PIT */
+unsigned lapic_timer_handler(unsigned esp)
+{
+	struct cpu *c = this_cpu();
+	unsigned div = timer_div;
+
+	if (c->timer_div != div) {
+		c->timer_div = div; c->timer_sub = 0;
+		lapic[LAPIC_TICR/4] = lapic_timer_count / div;
+	}
+	if (prof_on) prof_sample(c, (const struct irq_frame *)esp);
+	if (++c->timer_sub < div) return esp;
+	c->timer_sub = 0;
+	tasks[c->halted ? c->idle : c->cur].ticks++;
+	if (c->in_softirq) return esp;
+	kill_point(c, esp);
+	return schedule(esp, 0);
+}
+
+void keyboard_handler(void)
+{
+	struct raw_input r;
+
+	irq_enter(1);
+	r.tsc = this_cpu()->irqoff_start;
+	r.byte = inb(0x60);
+	spsc_put(&kbd_raw, &r);
+	raise_softirq(SOFTIRQ_KBD);
+}
+
+void mouse_handler(void)
+{
+	struct raw_input r;
+
+	irq_enter(12);
+	/* Only read if data is from auxiliary device (mouse, not keyboard) */
+	if (!(inb(0x64) & 0x20)) { inb(0x60); return; }
+	r.tsc = this_cpu()->irqoff_start;
+	r.byte = inb(0x60);
+	spsc_put(&mouse_raw, &r);
+	raise_softirq(SOFTIRQ_MOUSE);
+}
+
+/* ---- Bottom halves ---- */
+
+static void mouse_move(int dx, int dy)
+{
+	int x = mouse_x + dx, y = mouse_y + dy;
+	if (x < 0) x = 0;
+	if (x > GFX_WIDTH - CUR_W) x = GFX_WIDTH - CUR_W;
+	if (y < 0) y = 0;
+	if (y > TASKBAR_Y - 1) y = TASKBAR_Y - 1;
+	mouse_x = x; mouse_y = y;
+}
+
+static void timer_softirq(void)
+{
+	static unsigned gui_last_sec = 0xFFFFFFFF;
+	int saved_bank = cur_bank;          /* save shell's bank state */
+
+	/* ---- GUI: clock (once per second) ---- */
+	{
+		unsigned total_sec = ticks / TIMER_HZ;
+		if (total_sec != gui_last_sec) {
+			unsigned sec = total_sec % 60;
+			unsigned min = (total_sec / 60) % 60;
+			unsigned hr  = total_sec / 3600;
+			char tb[9];
+			tb[0] = '0'+hr/10; tb[1] = '0'+hr%10; tb[2] = ':';
+			tb[3] = '0'+min/10; tb[4] = '0'+min%10; tb[5] = ':';
+			tb[6] = '0'+sec/10; tb[7] = '0'+sec%10; tb[8] = 0;
+			gfx_text(GFX_WIDTH - 72, TASKBAR_Y + 9, tb, COL_TBTEXT, COL_TASKBAR);
+			gui_last_sec = total_sec;
+		}
+	}
+
+	/* ---- GUI: consume mouse events, coalescing motion between button changes ---- */
+	{
+		struct input_event ev; int dx = 0, dy = 0, n = 0;
+		while (spsc_get(&mouse_events, &ev)) {
+			dx += ev.dx; dy += ev.dy; n++;
+			if (ev.btns != mouse_btns) {
+				mouse_move(dx, dy); dx = dy = 0;
+				mouse_btns = ev.btns;
+			}
+		}
+		if (dx || dy) mouse_move(dx, dy);
+		if (n > 1) mouse_coalesced += (unsigned)(n - 1);
+	}
+
+	/* ---- GUI: mouse cursor (skip during scroll) ---- */
+	if (!gui_no_cursor) {
+		int mx = mouse_x, my = mouse_y;
+		if (mx != gui_old_mx || my != gui_old_my) {
+			if (gui_old_mx >= 0) cursor_hide(gui_old_mx, gui_old_my);
+			cursor_show(mx, my);
+			gui_old_mx = mx; gui_old_my = my;
+		}
+	}
+
+	cur_bank = saved_bank;              /* restore shell's bank state */
+	if (saved_bank >= 0)                /* restore hardware bank too */
+		hal_fb_bank(saved_bank);
+}
+
+static void kbd_softirq(void)
+{
+	static int e0_flag = 0;
+	struct raw_input r;
+	struct input_event ev;
+	unsigned char sc;
+
+	while (spsc_get(&kbd_raw, &r)) {
+		sc = (unsigned char)r.byte;
+		if (sc == 0xE0) { e0_flag = 1; continue; }
+		ev.tsc = r.tsc;
+		ev.type = (sc & 0x80) ? EV_KEYUP : EV_KEYDOWN;
+		ev.code = (unsigned char)((sc & 0x7F) | (e0_flag ? 0x80 : 0));
+		ev.ch = 0; ev.btns = 0; ev.dx = ev.dy = 0;
+		if (e0_flag) {
+			if (ev.code == 0xC8) ev.ch = KEY_UP;        /* up arrow */
+			else if (ev.code == 0xD0) ev.ch = KEY_DOWN; /* down arrow */
+		} else if (ev.code < sizeof(sc_to_ascii))
+			ev.ch = sc_to_ascii[ev.code];
+		e0_flag = 0;
+		spsc_put(&kbd_events, &ev);
+	}
+	input_wake();
+}
+
+static void mouse_softirq(void)
+{
+	static int cycle = 0;
+	static unsigned char bytes[3];
+	struct raw_input r;
+	struct input_event ev;
+	int dx, dy;
+
+	while (spsc_get(&mouse_raw, &r)) {
+		bytes[cycle] = (unsigned char)r.byte;
+
+		/* Byte 0 must have bit 3 set (PS/2 always-1 bit); resync if not */
+		if (cycle == 0 && !(bytes[0] & 0x08)) continue;
+
+		cycle++;
+		if (cycle < 3) continue;
+		cycle = 0;
+
+		dx = bytes[1]; dy = bytes[2];
+		if (bytes[0] & 0x10) dx -= 256;
+		if (bytes[0] & 0x20) dy -= 256;
+		ev.tsc = r.tsc; ev.type = EV_MOUSE; ev.code = 0; ev.ch = 0;
+		ev.btns = bytes[0] & 7;
+		ev.dx = (short)dx; ev.dy = (short)-dy;
+		spsc_put(&mouse_events, &ev);
+	}
+}
+
+static void softirq_init(void)
+{
+	softirq_vec[SOFTIRQ_TIMER] = timer_softirq;
+	softirq_vec[SOFTIRQ_KBD]   = kbd_softirq;
+	softirq_vec[SOFTIRQ_MOUSE] = mouse_softirq;
+}
+
+/* ---- Keyboard ---- */
+
+/* Next character from the keyboard or COM1, 0 if none is queued */
+static char kbd_trygetchar(void)
+{
+	struct input_event ev;
+	struct raw_input r;
+	if (tasks[current_task].killed) return '\n';   /* empty lines until it stops */
+	if (tasks[current_task].bg) return 0;   /* a background job waits for 'fg' */
+	while (spsc_get(&serial_rx, &r)) {
+		if (r.byte == '\r') return '\n';
+		if (r.byte == 0x7F) return '\b';
+		if (r.byte == '\n') continue;      /* CR LF from a terminal */
+		return (char)r.byte;
+	}
+	while (spsc_get(&kbd_events, &ev)) {
+		if (ev.type != EV_KEYDOWN || !ev.ch) continue;
+		kbd_lat_last = (unsigned)(rdtsc() - ev.tsc);
+		if (kbd_lat_last > kbd_lat_max) kbd_lat_max = kbd_lat_last;
+		return ev.ch;
+	}
+	return 0;
+}
+
+/* Tasks asleep in kbd_getchar(): the IRQ and softirq that queue input
+ * wake them all, and each one re-checks */
+static spinlock_t input_lock;
+static unsigned input_waiters;
+
+static void input_wake(void)
+{
+	unsigned f = spin_lock_irqsave(&input_lock), w = input_waiters;
+	input_waiters = 0;
+	spin_unlock_irqrestore(&input_lock, f);
+	task_wake_mask(w);
+}
+
+static char kbd_getchar(void)
+{
+	struct cpu *c;
+	unsigned long long t0;
+	unsigned f;
+	char ch;
+	while (!(ch = kbd_trygetchar())) {
+		t0 = rdtsc();
+		f = spin_lock_irqsave(&input_lock);
+		c = this_cpu();
+		if ((f & 0x200) && !c->in_softirq && c->cur != c->idle) {
+			input_waiters |= 1u << c->cur;
+			if (tasks[c->cur].bg || (serial_rx.head == serial_rx.tail && kbd_events.head == kbd_events.tail))
+				task_block(&input_lock, f);
+			else {
+				input_waiters &= ~(1u << c->cur);
+				spin_unlock_irqrestore(&input_lock, f);
+			}
+		} else {
+			spin_unlock_irqrestore(&input_lock, f);
+			cpu_halt();
+		}
+		tasks[current_task].wait_input += rdtsc() - t0;
+	}
+	return ch;
+}
+
+/* ---- ATA PIO ---- */
+
+static volatile unsigned ata_irqs;
+static spinlock_t ata_lock;             /* one command at a time: page faults read from any CPU */
+
+/* IRQ14: the driver polls, so only acknowledge (status read clears INTRQ) */
+void ata_handler(void)
+{
+	irq_enter(14);
+	inb(0x1F7);
+	ata_irqs++;
+}
+
+static void ata_read_sector(unsigned lba, void *buf)
+{
+	int i; unsigned short *p = (unsigned short *)buf;
+	unsigned long long t0 = rdtsc();
+	unsigned f = spin_lock_irqsave(&ata_lock);
+	while (inb(0x1F7) & 0x80);
+	outb(0x1F6, 0xE0|((lba>>24)&0xF));
+	outb(0x1F2,1); outb(0x1F3,lba&0xFF); outb(0x1F4,(lba>>8)&0xFF); outb(0x1F5,(lba>>16)&0xFF);
+	outb(0x1F7,0x20);
+	TRACE(TR_ATA_CMD, lba);
+	while (!(inb(0x1F7) & 0x08));
+	tasks[current_task].wait_disk += rdtsc() - t0;
+	for (i=0;i<256;i++) p[i]=inw(0x1F0);
+	spin_unlock_irqrestore(&ata_lock, f);
+	TRACE(TR_ATA_DONE, lba);
+}
+
+static void ata_write_sector(unsigned lba, const void *buf)
+{
+	int i; const unsigned short *p = (const unsigned short *)buf;
+	unsigned long long t0 = rdtsc(), t1;
+	unsigned f = spin_lock_irqsave(&ata_lock);
+	while (inb(0x1F7)&0x80);
+	outb(0x1F6,0xE0|((lba>>24)&0xF));
+	outb(0x1F2,1); outb(0x1F3,lba&0xFF); outb(0x1F4,(lba>>8)&0xFF); outb(0x1F5,(lba>>16)&0xFF);
+	outb(0x1F7,0x30);
+	TRACE(TR_ATA_CMD, lba | 0x80000000u);     /* top bit: write */
+	while (!(inb(0x1F7)&0x08));
+	t1 = rdtsc();
+	for (i=0;i<256;i++) outw(0x1F0,p[i]);
+	t0 += rdtsc() - t1;                       /* the data transfer is work, not waiting */
+	while (inb(0x1F7)&0x80);
+	spin_unlock_irqrestore(&ata_lock, f);
+	tasks[current_task].wait_disk += rdtsc() - t0;
+	TRACE(TR_ATA_DONE, lba | 0x80000000u);
+}
+
+/* FLUSH CACHE: what the drive has cached goes to the medium */
+static void ata_flush(void)
+{
+	unsigned long long t0 = rdtsc();
+	unsigned f = spin_lock_irqsave(&ata_lock);
+	while (inb(0x1F7)&0x80);
+	outb(0x1F6,0xE0);
+	outb(0x1F7,0xE7);
+	while (inb(0x1F7)&0x80);
+	spin_unlock_irqrestore(&ata_lock, f);
+	tasks[current_task].wait_disk += rdtsc() - t0;
+}
+
+/* ---- PCI ----
+ * Configuration mechanism #1. A function is addressed as
+ * bus << 8 | device << 3 | function; only the first PCI_BUSES buses are
+ * scanned (QEMU puts everything on bus 0).
+ */
+
+#define PCI_BUSES       8
+
+static unsigned pci_read(int bdf, int reg)
+{
+	outl(0xCF8, 0x80000000u | (unsigned)bdf << 8 | (unsigned)(reg & 0xFC));
+	return inl(0xCFC);
+}
+
+static void pci_write(int bdf, int reg, unsigned v)
+{
+	outl(0xCF8, 0x80000000u | (unsigned)bdf << 8 | (unsigned)(reg & 0xFC));
+	outl(0xCFC, v);
+}
+
+/* The next present function after bdf (-1 starts the scan), or -1 */
+static int pci_next(int bdf)
+{
+	while (++bdf < PCI_BUSES << 8) {
+		if ((bdf & 7) && !(pci_read(bdf & ~7, 0x0C) & 0x800000)) { bdf |= 7; continue; }   /* single function */
+		if ((pci_read(bdf, 0) & 0xFFFF) != 0xFFFF) return bdf;
+		if (!(bdf & 7)) bdf |= 7;       /* no device in this slot */
+	}
+	return -1;
+}
+
+/* ---- virtio-blk ----
+ * The legacy (I/O port) interface of a virtio-blk PCI device, one
+ * virtqueue; modern-only devices (no I/O BAR) are left to ATA. Request
+ * slot s owns the descriptor chain 3s -> 3s+1 -> 3s+2: header, data,
+ * status byte (a flush skips the data). A caller queues its request and
+ * sleeps until the IRQ handler finds it in the used ring, so every task
+ * can have one in flight. Callers that cannot sleep (page faults under
+ * vm_lock) get slot 0 to themselves, keep interrupts off until their
+ * request is done and reap the used ring themselves. Without the
+ * device, disk I/O stays on ATA PIO.
+ */
+
+#define VBLK_DEVICE     0x10011AF4u     /* 1AF4:1001, transitional virtio-blk */
+#define VIO_HOST_FEAT   0x00
+#define VIO_GUEST_FEAT  0x04
+#define VIO_QUEUE_PFN   0x08
+#define VIO_QUEUE_SIZE  0x0C
+#define VIO_QUEUE_SEL   0x0E
+#define VIO_NOTIFY      0x10
+#define VIO_STATUS      0x12            /* 1 acknowledge, 2 driver, 4 driver ok */
+#define VIO_ISR         0x13            /* reading it acknowledges the interrupt */
+#define VIO_BLK_CAP     0x14            /* capacity in sectors, 64-bit */
+#define VRING_NEXT      1
+#define VRING_WRITE     2               /* the device writes this buffer */
+#define VBLK_REQS       16
+#define VBLK_F_FLUSH    (1u << 9)       /* writes are cached until a flush request */
+#define VBLK_T_FLUSH    4
+
+struct vring_desc { unsigned addr, addr_hi, len; unsigned short flags, next; };
+struct vring_avail { unsigned short flags, idx, ring[]; };
+struct vring_used { unsigned short flags, idx; struct { unsigned id, len; } ring[]; };
+
+struct vblk_req {
+	unsigned type, reserved, sector, sector_hi;     /* the header the device reads */
+	volatile unsigned char status;
+	volatile int done;
+	int busy, waiter;               /* waiter: task asleep on it, or -1 */
+};
+
+static unsigned short vblk_io;          /* BAR0; 0 while disk I/O goes to ATA */
+static int vblk_irq, vblk_flush;        /* vblk_flush: VBLK_F_FLUSH negotiated */
+static unsigned vblk_qsize, vblk_nreq, vblk_cap;
+static unsigned short vblk_used_idx;
+static struct vring_desc *vblk_desc;
+static volatile struct vring_avail *vblk_avail;
+static volatile struct vring_used *vblk_used;
+static struct vblk_req vblk_req[VBLK_REQS];
+static spinlock_t vblk_lock;
+static struct {
+	unsigned reqs, sectors, irqs, sleeps, polled, errors;
+	unsigned inflight, inflight_max;
+} vblk_stats;
+
+extern void isr_vblk(void);
+
+/* Mark finished requests done and wake their waiters (vblk_lock held) */
+static void vblk_reap(void)
+{
+	struct vblk_req *r;
+	while (vblk_used_idx != vblk_used->idx) {
+		r = &vblk_req[vblk_used->ring[vblk_used_idx % vblk_qsize].id / 3];
+		vblk_used_idx++;
+		r->done = 1;
+		vblk_stats.inflight--;
+		if (r->waiter >= 0) { task_wake(r->waiter); r->waiter = -1; }
+	}
+}
+
+/* Completions: the woken tasks run once the idle loop or the next tick
+ * gets to them */
+void vblk_handler(void)
+{
+	unsigned f;
+	irq_enter(vblk_irq);
+	inb(vblk_io + VIO_ISR);
+	f = spin_lock_irqsave(&vblk_lock);
+	vblk_stats.irqs++;
+	vblk_reap();
+	spin_unlock_irqrestore(&vblk_lock, f);
+}
+
+/* Whether a caller with these saved flags can sleep until the IRQ */
+static int vblk_can_sleep(unsigned f)
+{
+	struct cpu *c = this_cpu();
+	return (f & 0x200) && vblk_irq && !c->in_softirq && c->cur != c->idle;
+}
+
+/* Queue n sectors at lba to or from buf (identity-mapped kernel memory),
+ * or with write VBLK_T_FLUSH and n 0 a flush; the slot, or -1 if all
+ * the caller may use are in flight */
+static int vblk_submit(unsigned lba, unsigned n, void *buf, int write)
+{
+	unsigned f = spin_lock_irqsave(&vblk_lock);
+	struct vblk_req *r;
+	unsigned s = 0, end = vblk_nreq;
+	if (vblk_nreq > 1 && vblk_can_sleep(f)) s = 1;
+	else if (vblk_nreq > 1) end = 1;
+	for (; s < end && vblk_req[s].busy; s++);
+	if (s == end) { spin_unlock_irqrestore(&vblk_lock, f); return -1; }
+	r = &vblk_req[s];
+	r->busy = 1; r->done = 0; r->waiter = -1; r->status = 0xFF;
+	r->type = (unsigned)write; r->sector = lba;
+	vblk_desc[s * 3].next = (unsigned short)(s * 3 + (n ? 1 : 2));
+	vblk_desc[s * 3 + 1].addr = (unsigned)buf;
+	vblk_desc[s * 3 + 1].len = n * 512;
+	vblk_desc[s * 3 + 1].flags = (unsigned short)(VRING_NEXT | (write ? 0 : VRING_WRITE));
+	vblk_avail->ring[vblk_avail->idx % vblk_qsize] = (unsigned short)(s * 3);
+	__sync_synchronize();
+	vblk_avail->idx++;
+	__sync_synchronize();
+	vblk_stats.reqs++; vblk_stats.sectors += n;
+	if (++vblk_stats.inflight > vblk_stats.inflight_max) vblk_stats.inflight_max = vblk_stats.inflight;
+	outw(vblk_io + VIO_NOTIFY, 0);
+	spin_unlock_irqrestore(&vblk_lock, f);
+	TRACE(TR_ATA_CMD, lba | (write ? 0x80000000u : 0));
+	return (int)s;
+}
+
+/* Wait for slot s and free it: 0, or -1 if the device failed the request */
+static int vblk_wait(int s)
+{
+	struct vblk_req *r = &vblk_req[s];
+	unsigned long long t0 = rdtsc();
+	unsigned f = spin_lock_irqsave(&vblk_lock);
+	struct cpu *c = this_cpu();
+	int err, polled = 0;
+	while (!r->done) {
+		if (vblk_can_sleep(f)) {
+			r->waiter = c->cur;
+			vblk_stats.sleeps++;
+			task_block(&vblk_lock, f);
+		} else {
+			vblk_reap();
+			spin_unlock_irqrestore(&vblk_lock, f);
+			polled = 1;
+			__asm__ volatile("pause");
+		}
+		f = spin_lock_irqsave(&vblk_lock);
+		c = this_cpu();
+	}
+	err = r->status != 0;
+	r->busy = 0;
+	vblk_stats.polled += (unsigned)polled;
+	vblk_stats.errors += (unsigned)err;
+	spin_unlock_irqrestore(&vblk_lock, f);
+	tasks[current_task].wait_disk += rdtsc() - t0;
+	TRACE(TR_ATA_DONE, r->sector | (r->type ? 0x80000000u : 0));
+	return err ? -1 : 0;
+}
+
+/* A caller that cannot sleep waits for slot 0 only, whose holder is
+ * another such caller with interrupts off: it finishes without needing
+ * this CPU, so the wait is bounded */
+static int vblk_rw_phys(unsigned lba, unsigned n, void *buf, int write)
+{
+	unsigned f, flags;
+	int s;
+	__asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+	if (vblk_can_sleep(flags)) __asm__ volatile("pushl %0; popfl" :: "r"(flags) : "memory");
+	while ((s = vblk_submit(lba, n, buf, write)) < 0) {
+		f = spin_lock_irqsave(&vblk_lock);
+		vblk_reap();
+		spin_unlock_irqrestore(&vblk_lock, f);
+		__asm__ volatile("pause");
+	}
+	s = vblk_wait(s);
+	__asm__ volatile("pushl %0; popfl" :: "r"(flags) : "memory");
+	return s;
+}
+
+/* The device sees physical addresses: kernel memory below USER_BASE is
+ * mapped 1:1, a user buffer goes through a bounce frame a page at a time */
+static int vblk_rw(unsigned lba, unsigned n, void *buf, int write)
+{
+	unsigned char *b = (unsigned char *)buf;
+	unsigned bounce, k;
+	int r = 0;
+	if ((unsigned)buf < USER_BASE) return vblk_rw_phys(lba, n, buf, write);
+	if (!(bounce = frame_alloc())) return -1;
+	for (; n && !r; n -= k, lba += k, b += k * 512) {
+		k = n < PAGE_SIZE / 512 ? n : PAGE_SIZE / 512;
+		if (write) memcpy((void *)bounce, b, k * 512);
+		r = vblk_rw_phys(lba, k, (void *)bounce, write);
+		if (!r && !write) memcpy(b, (const void *)bounce, k * 512);
+	}
+	frame_free(bounce);
+	return r;
+}
+
+/* Find and start the device; disk I/O switches over once it is ready */
+static void vblk_init(void)
+{
+	unsigned char *ring;
+	unsigned q, avail_end, i;
+	unsigned short io;
+	int bdf = -1, irq;
+
+	while ((bdf = pci_next(bdf)) >= 0 && pci_read(bdf, 0) != VBLK_DEVICE);
+	if (bdf < 0 || !(pci_read(bdf, 0x10) & 1)) return;
+	io = (unsigned short)(pci_read(bdf, 0x10) & ~3u);
+	pci_write(bdf, 0x04, pci_read(bdf, 0x04) | 5);     /* I/O space, bus master */
+	outb(io + VIO_STATUS, 0);                           /* reset */
+	outb(io + VIO_STATUS, 1 | 2);
+	vblk_flush = (inl(io + VIO_HOST_FEAT) & VBLK_F_FLUSH) != 0;
+	outl(io + VIO_GUEST_FEAT, vblk_flush ? VBLK_F_FLUSH : 0);
+	outw(io + VIO_QUEUE_SEL, 0);
+	if ((q = inw(io + VIO_QUEUE_SIZE)) < 3) return;
+
+	/* Legacy layout: descriptors and avail ring, then the used ring on the next page */
+	avail_end = (16 * q + 6 + 2 * q + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (!(ring = (unsigned char *)kmalloc(avail_end + ((6 + 8 * q + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) + PAGE_SIZE - 1)))
+		return;
+	ring = (unsigned char *)(((unsigned)ring + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+	memset(ring, 0, avail_end + 6 + 8 * q);
+	vblk_desc = (struct vring_desc *)ring;
+	vblk_avail = (volatile struct vring_avail *)(ring + 16 * q);
+	vblk_used = (volatile struct vring_used *)(ring + avail_end);
+	vblk_qsize = q;
+	vblk_nreq = q / 3 < VBLK_REQS ? q / 3 : VBLK_REQS;
+	for (i = 0; i < vblk_nreq; i++) {
+		vblk_desc[i * 3].addr = (unsigned)&vblk_req[i];
+		vblk_desc[i * 3].len = 16;
+		vblk_desc[i * 3].flags = VRING_NEXT;
+		vblk_desc[i * 3].next = (unsigned short)(i * 3 + 1);
+		vblk_desc[i * 3 + 1].next = (unsigned short)(i * 3 + 2);
+		vblk_desc[i * 3 + 2].addr = (unsigned)&vblk_req[i].status;
+		vblk_desc[i * 3 + 2].len = 1;
+		vblk_desc[i * 3 + 2].flags = VRING_WRITE;
+	}
+	outl(io + VIO_QUEUE_PFN, (unsigned)ring / PAGE_SIZE);
+	outb(io + VIO_STATUS, 1 | 2 | 4);
+	vblk_cap = inl(io + VIO_BLK_CAP);
+
+	/* INTx as the BIOS routed it: level triggered, shareable */
+	irq = (int)(pci_read(bdf, 0x3C) & 0xFF);
+	if (irq > 0 && irq < 16) {
+		idt_set_gate(0x20 + irq, (unsigned)isr_vblk);
+		if (lapic_eoi) ioapic_route(irq, 0x20 + irq);
+		else if (irq < 8) outb(0x21, inb(0x21) & ~(1u << irq));
+		else outb(0xA1, inb(0xA1) & ~(1u << (irq - 8)));
+		vblk_irq = irq;
+	}
+	vblk_io = io;
+}
+
+/* ---- HAL for heap.c, fs.c and console.c ---- */
+
+unsigned char *hal_fb_win = (unsigned char *)0xA0000;
+
+/* Bochs VBE dispi interface — register 0x05 = BANK */
+void hal_fb_bank(int bank) { outw(0x1CE, 0x05); outw(0x1CF, (unsigned short)bank); }
+
+int  hal_task(void) { return current_task; }
+unsigned long long hal_cycles(void) { return rdtsc(); }
+void hal_read_sector(unsigned lba, void *buf) { hal_read_sectors(lba, 1, buf); }
+void hal_write_sector(unsigned lba, const void *buf) { hal_write_sectors(lba, 1, buf); }
+
+void hal_read_sectors(unsigned lba, unsigned n, void *buf)
+{
+	if (vblk_io) vblk_rw(lba, n, buf, 0);
+	else for (; n--; lba++, buf = (unsigned char *)buf + 512) ata_read_sector(lba, buf);
+}
+
+void hal_write_sectors(unsigned lba, unsigned n, const void *buf)
+{
+	if (vblk_io) vblk_rw(lba, n, (void *)buf, 1);
+	else for (; n--; lba++, buf = (const unsigned char *)buf + 512) ata_write_sector(lba, buf);
+}
+
+/* Without VBLK_F_FLUSH the device writes through */
+void hal_flush(void)
+{
+	if (!vblk_io) ata_flush();
+	else if (vblk_flush) vblk_rw(0, 0, 0, VBLK_T_FLUSH);
+}
+void hal_console_mirror(char c) { serial_putc(c); }
+
+/* Keep the timer softirq off the cursor while the console scrolls */
+void hal_scroll_enter(void)
+{
+	gui_no_cursor = 1;
+	if (gui_old_mx >= 0)
+		cursor_hide(gui_old_mx, gui_old_my);
+}
+
+void hal_scroll_leave(void)
+{
+	int mx = mouse_x, my = mouse_y;
+	cursor_show(mx, my);
+	gui_old_mx = mx; gui_old_my = my;
+	gui_no_cursor = 0;
+}
+
+/* ---- String helpers ---- */
+
+static int my_strcmp(const char *a, const char *b)
+{ while (*a && *a==*b){a++;b++;} return (unsigned char)*a-(unsigned char)*b; }
+
+static int starts_with(const char *s, const char *p)
+{ while(*p){if(*s++!=*p++)return 0;} return 1; }
+
+/* ---- IPC ports ----
+ * Named message queues between tasks with blocking send and receive.
+ * Messages up to PORT_INLINE bytes are copied through the port's ring.
+ * Larger ones travel as pages: the whole pages of a page-aligned buffer
+ * in an exec'd program are unmapped from the sender and mapped at a
+ * page-aligned receive buffer, so they cross without being copied.
+ * Everything else is copied into fresh frames on send and out of them
+ * on receive, so it is copied twice: kernel tasks, unaligned buffers and
+ * the tail of a message that does not fill its last page. A send does
+ * not wait for its receiver, so there is no buffer to copy into directly.
+ */
+
+#define PORT_MAX       8
+#define PORT_SLOTS     8
+#define PORT_INLINE    256
+#define PORT_MSG_MAX   65536
+#define PORT_PAGES     (PORT_MSG_MAX / PAGE_SIZE)
+
+struct port_msg {
+	unsigned len;
+	union { unsigned char data[PORT_INLINE]; unsigned frame[PORT_PAGES]; } u;
+};
+
+struct port {
+	char name[FS_NAME_MAX + 1];
+	spinlock_t lock;
+	struct port_msg ring[PORT_SLOTS];
+	unsigned head, n;
+	unsigned rwait, swait;          /* tasks blocked receiving / sending, one bit each */
+	unsigned msgs, moved;           /* messages sent, pages remapped */
+};
+
+static struct port *ports[PORT_MAX];
+static spinlock_t port_lock;            /* creation */
+
+/* The port called name, created on first use; -1 if none is free */
+static int port_open(const char *name)
+{
+	unsigned f = spin_lock_irqsave(&port_lock);
+	int i, j, id = -1;
+	for (i = 0; i < PORT_MAX && id < 0; i++)
+		if (ports[i] && my_strcmp(ports[i]->name, name) == 0) id = i;
+	for (i = 0; i < PORT_MAX && id < 0; i++)
+		if (!ports[i] && (ports[i] = (struct port *)kzalloc(sizeof(struct port))) != 0) {
+			for (j = 0; j < FS_NAME_MAX && name[j]; j++) ports[i]->name[j] = name[j];
+			id = i;
+		}
+	spin_unlock_irqrestore(&port_lock, f);
+	return id;
+}
+
+static unsigned port_npages(unsigned len) { return len <= PORT_INLINE ? 0 : (len + PAGE_SIZE - 1) / PAGE_SIZE; }
+
+/* Pages [from, to) of a large message, copied out of buf */
+static int port_copy_in(struct port_msg *m, unsigned from, unsigned to, const unsigned char *buf)
+{
+	unsigned i, n;
+	for (i = from; i < to; i++) {
+		if (!(m->u.frame[i] = frame_alloc())) {
+			while (i-- > from) frame_free(m->u.frame[i]);
+			return SYS_ENOMEM;
+		}
+		n = m->len - i * PAGE_SIZE < PAGE_SIZE ? m->len - i * PAGE_SIZE : PAGE_SIZE;
+		memcpy((void *)m->u.frame[i], buf + i * PAGE_SIZE, n);
+		memset((unsigned char *)m->u.frame[i] + n, 0, PAGE_SIZE - n);
+	}
+	return 0;
+}
+
+/* A message that will not be sent: its whole pages go back to buf */
+static void port_unsend(struct port_msg *m, struct mm *mm, const void *buf, unsigned whole)
+{
+	unsigned i, np = port_npages(m->len);
+	if (whole && vm_give(mm, (unsigned)buf, whole, m->u.frame) < 0) whole = 0;
+	for (i = whole; i < np; i++) frame_free(m->u.frame[i]);
+}
+
+/* buf lies in the current task's address space; blocks while the ring is
+ * full, or gives up with SYS_EINTR once the task is killed */
+static int port_send(int id, const void *buf, unsigned len)
+{
+	struct port *p = id >= 0 && id < PORT_MAX ? ports[id] : 0;
+	struct mm *mm = tasks[current_task].mm;
+	struct port_msg m;
+	unsigned f, w, np = port_npages(len), whole = 0;
+
+	if (!p || len > PORT_MSG_MAX) return SYS_EINVAL;
+	m.len = len;
+	if (!np) memcpy(m.u.data, buf, len);
+	else {
+		if (mm && !((unsigned)buf % PAGE_SIZE)) whole = len / PAGE_SIZE;
+		if (port_copy_in(&m, whole, np, buf) < 0) return SYS_ENOMEM;
+		if (whole && vm_take(mm, (unsigned)buf, whole, m.u.frame) < 0) {
+			if (port_copy_in(&m, 0, whole, buf) < 0) {
+				while (np-- > whole) frame_free(m.u.frame[np]);
+				return SYS_ENOMEM;
+			}
+			whole = 0;
+		}
+	}
+	f = spin_lock_irqsave(&p->lock);
+	while (p->n == PORT_SLOTS) {
+		if (tasks[current_task].killed) {
+			spin_unlock_irqrestore(&p->lock, f);
+			port_unsend(&m, mm, buf, whole);
+			return SYS_EINTR;
+		}
+		p->swait |= 1u << current_task;
+		task_block(&p->lock, f);
+		f = spin_lock_irqsave(&p->lock);
+	}
+	memcpy(&p->ring[(p->head + p->n++) % PORT_SLOTS], &m, np ? sizeof(m.len) + np * 4 : sizeof(m.len) + len);
+	p->msgs++; p->moved += whole;
+	w = p->rwait; p->rwait = 0;
+	spin_unlock_irqrestore(&p->lock, f);
+	task_wake_mask(w);
+	return 0;
+}
+
+/* The next message, cut to max bytes; blocks while there is none, or
+ * returns SYS_EAGAIN if !wait and SYS_EINTR once the task is killed */
+static int port_recv(int id, void *buf, unsigned max, int wait)
+{
+	struct port *p = id >= 0 && id < PORT_MAX ? ports[id] : 0;
+	struct mm *mm = tasks[current_task].mm;
+	struct port_msg m, *s;
+	unsigned f, w, np, n, i, whole = 0;
+
+	if (!p) return SYS_EINVAL;
+	f = spin_lock_irqsave(&p->lock);
+	while (!p->n) {
+		if (!wait) { spin_unlock_irqrestore(&p->lock, f); return SYS_EAGAIN; }
+		if (tasks[current_task].killed) { spin_unlock_irqrestore(&p->lock, f); return SYS_EINTR; }
+		p->rwait |= 1u << current_task;
+		task_block(&p->lock, f);
+		f = spin_lock_irqsave(&p->lock);
+	}
+	s = &p->ring[p->head];
+	np = port_npages(s->len);
+	memcpy(&m, s, np ? sizeof(m.len) + np * 4 : sizeof(m.len) + s->len);
+	p->head = (p->head + 1) % PORT_SLOTS; p->n--;
+	w = p->swait; p->swait = 0;
+	spin_unlock_irqrestore(&p->lock, f);
+	task_wake_mask(w);
+
+	n = m.len < max ? m.len : max;
+	if (!np) { memcpy(buf, m.u.data, n); return (int)n; }
+	if (mm && !((unsigned)buf % PAGE_SIZE)) whole = n / PAGE_SIZE;
+	if (whole && vm_give(mm, (unsigned)buf, whole, m.u.frame) < 0) whole = 0;
+	for (i = whole; i < np; i++) {
+		if (i * PAGE_SIZE < n)
+			memcpy((unsigned char *)buf + i * PAGE_SIZE, (const void *)m.u.frame[i],
+			       n - i * PAGE_SIZE < PAGE_SIZE ? n - i * PAGE_SIZE : PAGE_SIZE);
+		frame_free(m.u.frame[i]);
+	}
+	return (int)n;
+}
+
+/* ---- System calls and user faults ----
+ * Entered through INT 0x80 or SYSENTER (loader.nas) with the user's
+ * registers in a PUSHAD frame; the result goes back in its EAX. Pointers
+ * from exec'd programs must lie in their mappings; the programs linked
+ * into the kernel share its address space and are only checked for
+ * wrap-around.
+ */
+
+extern void isr_syscall(void);
+extern void isr_fault0(void), isr_fault6(void), isr_fault13(void), isr_fault14(void);
+
+static unsigned syscall_count[SYS_NR];
+
+static int user_range(unsigned p, unsigned n, int write)
+{
+	struct mm *mm = tasks[current_task].mm;
+	return mm ? vm_user_ok(mm, p, n, write) : p && p + n >= p;
+}
+
+/* Copy a file name out of user memory */
+static int user_name(unsigned p, char *name)
+{
+	int i;
+	for (i = 0; i < FS_NAME_MAX && user_range(p + i, 1, 0) && ((const char *)p)[i]; i++) name[i] = ((const char *)p)[i];
+	name[i] = 0;
+	return i > 0;
+}
+
+/* The task's open file fd, or 0 */
+static struct fs_entry *user_file(unsigned fd)
+{
+	struct task *t = &tasks[current_task];
+	return fd < TASK_FILES && t->files[fd].start ? &t->files[fd] : 0;
+}
+
+void syscall_handler(struct irq_frame *f)
+{
+	char name[FS_NAME_MAX + 1];
+	struct task *t = &tasks[current_task];
+	struct fs_entry e, *fp;
+	unsigned i, t0;
+	int r = SYS_EINVAL;
+
+	if (f->eax < SYS_NR) syscall_count[f->eax]++;
+	switch (f->eax) {
+	case SYS_NULL:
+		r = 0;
+		break;
+	case SYS_EXIT:
+		tasks[current_task].active = 0;
+		for (;;) task_yield();
+	case SYS_WRITE:
+		if (!user_range(f->ebx, f->esi, 0)) break;
+		for (i = 0; i < f->esi; i++) vga_putchar(((const char *)f->ebx)[i]);
+		r = (int)f->esi;
+		break;
+	case SYS_GETC:
+		r = (unsigned char)kbd_getchar();
+		break;
+	case SYS_SLEEP:
+		t0 = ticks;
+		while ((ticks - t0) * 1000 < f->ebx * TIMER_HZ && !t->killed) cpu_halt();
+		r = 0;
+		break;
+	case SYS_FREAD:
+		if (!user_name(f->ebx, name) || !user_range(f->esi, f->edi, 1)) break;
+		if ((r = fs_find(name, &e)) == 0) r = (int)vm_file_read(&e, 0, (void *)f->esi, f->edi);
+		break;
+	case SYS_FWRITE:
+		if (!user_name(f->ebx, name) || !user_range(f->esi, f->edi, 0)) break;
+		if (fs_find(name, &e) == 0) vm_forget(e.start);
+		fs_delete(name);
+		r = fs_create(name, (const void *)f->esi, f->edi);
+		break;
+	case SYS_OPEN:
+		if (!user_name(f->ebx, name) || (f->esi && !user_range(f->esi, 4, 1))) break;
+		for (i = 0; i < TASK_FILES && t->files[i].start; i++);
+		if (i == TASK_FILES) { r = SYS_EMFILE; break; }
+		if ((r = fs_find(name, &t->files[i])) < 0) break;
+		t->fpos[i] = 0;
+		if (f->esi) *(unsigned *)f->esi = t->files[i].size;
+		r = (int)i;
+		break;
+	case SYS_READ:
+		if (!(fp = user_file(f->ebx))) { r = SYS_EBADF; break; }
+		if (!user_range(f->esi, f->edi, 1)) break;
+		r = (int)vm_file_read(fp, t->fpos[f->ebx], (void *)f->esi, f->edi);
+		t->fpos[f->ebx] += (unsigned)r;
+		break;
+	case SYS_CLOSE:
+		if (!(fp = user_file(f->ebx))) { r = SYS_EBADF; break; }
+		fp->start = 0;
+		r = 0;
+		break;
+	case SYS_MMAP:
+		if (!(fp = user_file(f->ebx))) { r = SYS_EBADF; break; }
+		if (!t->mm || !user_range(f->edi, 4, 1)) break;
+		if ((r = vm_mmap(t->mm, fp, f->esi & PROT_WRITE, &i)) == 0) *(unsigned *)f->edi = i;
+		break;
+	case SYS_MUNMAP:
+		if (t->mm) r = vm_munmap(t->mm, f->ebx);
+		break;
+	case SYS_MSYNC:
+		if (t->mm) r = vm_msync(t->mm, f->ebx);
+		break;
+	case SYS_PORT:
+		if (user_name(f->ebx, name) && (r = port_open(name)) < 0) r = SYS_ENOMEM;
+		break;
+	case SYS_SEND:
+		if (user_range(f->esi, f->edi, 0)) r = port_send((int)f->ebx, (const void *)f->esi, f->edi);
+		break;
+	case SYS_RECV:
+		if (user_range(f->esi, f->edi, 1)) r = port_recv((int)f->ebx, (void *)f->esi, f->edi, 1);
+		break;
+	}
+	f->eax = (unsigned)r;
+	if (t->killed) { t->active = 0; for (;;) task_yield(); }
+}
+
+struct fault_frame {                    /* PUSHAD + error code + CPU-pushed frame */
+	unsigned edi, esi, ebp, esp, ebx, edx, ecx, eax;
+	unsigned err, eip, cs, eflags;
+};
+
+/* A page fault in an exec'd program's mappings is demand paging, also
+ * when a system call touches them. Any other fault kills a user task
+ * and stops the CPU if it happened in the kernel. */
+unsigned fault_handler(struct fault_frame *f, int vec)
+{
+	static const char *const names[] = { "#DE", 0, 0, 0, 0, 0, "#UD", 0, 0, 0, 0, 0, 0, "#GP", "#PF" };
+	struct mm *mm = tasks[current_task].mm;
+	unsigned cr2;
+	if (vec == 14 && mm) {
+		__asm__ volatile("movl %%cr2,%0" : "=r"(cr2));
+		if (vm_fault(mm, cr2, f->err)) return (unsigned)f;
+	}
+	vga_puts(f->cs & 3 ? "\nTask " : "\nKernel panic in task ");
+	vga_putint((unsigned)current_task);vga_putchar(' ');vga_puts(tasks[current_task].name);
+	vga_puts(": ");vga_puts(names[vec]);vga_puts(" at ");vga_puthex(f->eip);
+	if (vec == 13 || vec == 14) { vga_puts(" err ");vga_puthex(f->err); }
+	if (vec == 14) { __asm__ volatile("movl %%cr2,%0" : "=r"(cr2)); vga_puts(" addr ");vga_puthex(cr2); }
+	if (!(f->cs & 3)) {
+		vga_putchar('\n');
+		for (;;) __asm__ volatile("cli; hlt");
+	}
+	vga_puts(", killed\n");
+	tasks[current_task].active = 0;
+	return schedule((unsigned)f, 0);
+}
+
+/* ---- PS/2 mouse init ---- */
+
+static void mouse_wait_in(void)  { int i; for(i=0;i<100000;i++) if(!(inb(0x64)&2)) return; }
+static void mouse_wait_out(void) { int i; for(i=0;i<100000;i++) if(inb(0x64)&1) return; }
+
+static void mouse_init(void)
+{
+	unsigned char st;
+
+	/* Flush any stale data in the controller buffer */
+	while (inb(0x64) & 1) inb(0x60);
+
+	mouse_wait_in(); outb(0x64, 0xA8);
+	mouse_wait_in(); outb(0x64, 0x20);
+	mouse_wait_out(); st = inb(0x60);
+	st |= 2;
+	mouse_wait_in(); outb(0x64, 0x60);
+	mouse_wait_in(); outb(0x60, st);
+	mouse_wait_in(); outb(0x64, 0xD4);
+	mouse_wait_in(); outb(0x60, 0xF6);
+	mouse_wait_out(); inb(0x60);
+	mouse_wait_in(); outb(0x64, 0xD4);
+	mouse_wait_in(); outb(0x60, 0xF4);
+	mouse_wait_out(); inb(0x60);
+}
+
+/* ---- Filesystem commands ---- */
+
+static void cmd_dir(void)
+{
+	struct fs_entry e[FS_MAX_FILES]; int i, count = fs_list(e);
+	for (i = 0; i < count; i++) {
+		vga_puts("  "); vga_puts(e[i].name);
+		{ int l=0; const char *p=e[i].name; while(*p++)l++; while(l++<20) vga_putchar(' '); }
+		vga_putint(e[i].size); vga_puts(" bytes\n");
+	}
+	if (!count) vga_puts("  (no files)\n");
+	vga_putint((unsigned)count); vga_puts(" file(s)\n");
+}
+
+/* Straight out of the page cache, a page at a time */
+static void cmd_type(const char *fn)
+{
+	struct fs_entry e; unsigned off, n, j, pa;
+	unsigned char buf[512];
+	if (fs_find(fn, &e) < 0) { vga_puts("File not found: "); vga_puts(fn); vga_putchar('\n'); return; }
+	for (off = 0; off < e.size; off += n) {
+		n = e.size - off < PAGE_SIZE ? e.size - off : PAGE_SIZE;
+		if ((pa = vm_page_get(&e, off)) != 0) {
+			for (j = 0; j < n; j++) vga_putchar(((const char *)pa)[j]);
+			vm_page_put(pa);
+		} else {
+			if (n > 512) n = 512;
+			n = fs_read(&e, off, buf, n);
+			for (j = 0; j < n; j++) vga_putchar((char)buf[j]);
+		}
+	}
+}
+
+static void cmd_write(const char *fn)
+{
+	struct fs_entry e[FS_MAX_FILES]; int bp=0,ls,r; char c;
+	unsigned char *file_buf;
+	if(fs_find(fn,e)==0){vga_puts("File exists. Use 'del' first.\n");return;}
+	if(fs_list(e)==FS_MAX_FILES){vga_puts("Directory full.\n");return;}
+	if(!(file_buf=(unsigned char *)kmalloc(FILE_BUF_SIZE))){vga_puts("Out of memory.\n");return;}
+	vga_puts("Enter text (blank line to save):\n");
+	for(;;){
+		vga_puts("> "); ls=bp;
+		for(;;){c=kbd_getchar();if(c=='\n'){vga_putchar('\n');break;}
+			else if(c=='\b'){if(bp>ls){bp--;vga_putchar('\b');}}
+			else if(bp<FILE_BUF_SIZE-2){file_buf[bp++]=(unsigned char)c;vga_putchar(c);}}
+		if(bp==ls)break;
+		if(bp<FILE_BUF_SIZE-1)file_buf[bp++]='\n';
+	}
+	if(tasks[current_task].killed)bp=0;     /* kbd_getchar gave it empty lines */
+	r=bp?fs_create(fn,file_buf,(unsigned)bp):0;
+	kfree(file_buf);
+	if(!bp){vga_puts("Empty file, not saved.\n");return;}
+	if(r==FS_EEXIST){vga_puts("File exists. Use 'del' first.\n");return;}
+	if(r<0){vga_puts("Directory full.\n");return;}
+	vga_puts("Saved: ");vga_puts(fn);vga_puts(" (");vga_putint((unsigned)bp);vga_puts(" bytes)\n");
+}
+
+static void cmd_del(const char *fn)
+{
+	struct fs_entry e;
+	if(fs_find(fn,&e)==0)vm_forget(e.start);     /* drop its cached pages */
+	if(fs_delete(fn)<0){vga_puts("File not found: ");vga_puts(fn);vga_putchar('\n');return;}
+	vga_puts("Deleted: ");vga_puts(fn);vga_putchar('\n');
+}
+
+/* copy SRC DST: a reader task fills two buffers in turn while this task
+ * writes out the other one, so the next read is in flight during each
+ * write. 'empty' and 'full' count the buffers on each side. Killing
+ * either task sets 'cancel'; each side checks it after every wait and
+ * posts the other's semaphore on the way out, and the writer joins the
+ * reader before it drops the half-written file. */
+#define COPY_CHUNK 8192
+
+static struct {
+	struct fs_entry src;
+	unsigned char *buf[2];
+	unsigned len[2];
+	struct semaphore empty, full;
+	volatile int cancel;
+} copy_st;
+static struct mutex copy_lock;          /* one copy at a time owns copy_st */
+
+static int copy_cancelled(void)
+{
+	if (tasks[current_task].killed) copy_st.cancel = 1;
+	return copy_st.cancel;
+}
+
+static void copy_reader(void)
+{
+	unsigned off, k = 0;
+	for (off = 0; off < copy_st.src.size; off += COPY_CHUNK, k ^= 1) {
+		sem_down(&copy_st.empty);
+		if (copy_cancelled()) { sem_up(&copy_st.full); return; }
+		copy_st.len[k] = fs_read_sectors(&copy_st.src, off, copy_st.buf[k], COPY_CHUNK);
+		sem_up(&copy_st.full);
+	}
+}
+
+static void cmd_copy(const char *arg)
+{
+	char src[FS_NAME_MAX + 1];
+	struct fs_entry d;
+	unsigned long long t0, t, stall = 0;
+	unsigned off, k, n = 0, us;
+	int i, r, rd;
+	for (i = 0; arg[i] && arg[i] != ' ' && i < FS_NAME_MAX; i++) src[i] = arg[i];
+	src[i] = 0;
+	while (arg[i] && arg[i] != ' ') i++;
+	while (arg[i] == ' ') i++;
+	if (!src[0] || !arg[i]) { vga_puts("Usage: copy SRC DST\n"); return; }
+	arg += i;
+	mutex_lock(&copy_lock);
+	if (fs_find(src, &copy_st.src) < 0) { vga_puts("File not found: ");vga_puts(src);vga_putchar('\n'); goto out; }
+	if (!(copy_st.buf[0] = (unsigned char *)kmalloc(2 * COPY_CHUNK))) { vga_puts("Out of memory.\n"); goto out; }
+	copy_st.buf[1] = copy_st.buf[0] + COPY_CHUNK;
+	if ((r = fs_create_begin(arg, copy_st.src.size, &d)) < 0) {
+		vga_puts(r == FS_EEXIST ? "File exists. Use 'del' first.\n" : "Directory full.\n");
+		goto free;
+	}
+	sem_init(&copy_st.empty, 2);
+	sem_init(&copy_st.full, 0);
+	copy_st.cancel = 0;
+	t0 = rdtsc();
+	if ((rd = task_spawn(copy_reader, "copy")) < 0) { fs_create_end(&d, 0); vga_puts("No free task slot.\n"); goto free; }
+	tasks[rd].joinable = 1;
+	rq_push(least_loaded_cpu(), rd);
+	for (off = 0, k = 0; off < copy_st.src.size; off += COPY_CHUNK, k ^= 1, n++) {
+		t = rdtsc();
+		sem_down(&copy_st.full);
+		stall += rdtsc() - t;
+		if (copy_cancelled()) break;
+		fs_write(&d, off, copy_st.buf[k], copy_st.len[k]);
+		sem_up(&copy_st.empty);
+	}
+	if (off < copy_st.src.size) sem_up(&copy_st.empty);     /* the reader may wait there */
+	task_join(rd);
+	if (copy_st.cancel) { fs_create_end(&d, 0); vga_puts("Copy stopped.\n"); goto free; }
+	if ((r = fs_create_end(&d, 1)) < 0) {
+		vga_puts(r == FS_EEXIST ? "File exists. Use 'del' first.\n" : "Directory full.\n");
+		goto free;
+	}
+	t = rdtsc() - t0;
+	us = tsc_to_us(t);
+	vga_puts("Copied ");vga_puts(src);vga_puts(" to ");vga_puts(arg);vga_puts(": ");
+	vga_putint(copy_st.src.size);vga_puts(" bytes in ");vga_putint(us);vga_puts(" us, ");
+	us = us ? copy_st.src.size * 10 / us : 0;     /* bytes/us = MB/s */
+	vga_putint(us / 10);vga_putchar('.');vga_putint(us % 10);vga_puts(" MB/s (");
+	vga_putint(n);vga_puts(" chunks, ");vga_putint(tsc_to_us(stall));vga_puts(" us waiting for reads)\n");
+	vga_puts("BENCH name=copy_chunk cycles=");vga_putint(tsc_div(t, n ? n : 1));
+	vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
+free:
+	kfree(copy_st.buf[0]);
+out:
+	mutex_unlock(&copy_lock);
+}
+
+/* ---- Task commands ---- */
+
+static void cmd_ps(void)
+{
+	int i,l; const char *p;
+	vga_puts("  ID  Name         CPU Status\n");
+	for(i=0;i<num_tasks;i++){
+		vga_puts("  ");vga_putint((unsigned)i);vga_puts(i<10?"   ":"  ");vga_puts(tasks[i].name);
+		l=0;p=tasks[i].name;while(*p++)l++;while(l++<13)vga_putchar(' ');
+		vga_putint((unsigned)tasks[i].cpu);vga_puts("   ");
+		if(tasks[i].active&&tasks[i].on_cpu)vga_puts("running");
+		else if(tasks[i].active&&tasks[i].blocked)vga_puts("blocked");
+		else if(tasks[i].active)vga_puts("ready");
+		else vga_puts("stopped");
+		vga_puts(tasks[i].user?" (user)\n":"\n");
+	}
+}
+
+/* CPU-bound work split across N tasks; scales with the number of CPUs */
+#define SMPBENCH_ITERS 20000000u
+
+static volatile int smpbench_done;
+
+static void smpbench_task(void)
+{
+	volatile unsigned x = 1; unsigned i;
+	for (i = 0; i < SMPBENCH_ITERS; i++) x = x * 1664525u + 1013904223u;
+	__sync_fetch_and_add(&smpbench_done, 1);
+}
+
+static void cmd_smpbench(const char *arg)
+{
+	int n = 0, i; unsigned t0, dt, st0 = 0, st1 = 0;
+	while (*arg >= '0' && *arg <= '9') n = n*10 + (*arg++ - '0');
+	if (n <= 0) n = ncpus_online;
+	if (n > MAX_TASKS - ncpus_online - 1) n = MAX_TASKS - ncpus_online - 1;
+	for (i = 0; i < ncpus_online; i++) st0 += cpus[i].steals;
+	smpbench_done = 0;
+	t0 = ticks;
+	for (i = 0; i < n; i++)
+		if (task_create(smpbench_task, "smpbench") < 0) { n = i; break; }
+	while (smpbench_done < n) task_yield();
+	dt = ticks - t0;
+	for (i = 0; i < ncpus_online; i++) st1 += cpus[i].steals;
+	vga_putint((unsigned)n);vga_puts(" tasks on ");vga_putint((unsigned)ncpus_online);
+	vga_puts(" CPU(s): ");vga_putint(dt*1000/TIMER_HZ);vga_puts(" ms, steals ");vga_putint(st1-st0);vga_putchar('\n');
+}
+
+/* fsbench: two background tasks each read one of the two largest files
+ * FSBENCH_PASSES times through fs_read, first one after the other and
+ * then at the same time; both runs must see the same bytes. BENCH lines
+ * give cycles per file pass. */
+
+#define FSBENCH_PASSES 16
+
+static struct fsbench_job { struct fs_entry e; unsigned sum; } fsbench_jobs[2];
+static volatile int fsbench_next;
+static struct semaphore fsbench_done;
+
+static void fsbench_task(void)
+{
+	struct fsbench_job *j = &fsbench_jobs[__sync_fetch_and_add(&fsbench_next, 1) & 1];
+	unsigned char buf[512];
+	unsigned off, n, k, p, sum = 0;
+	for (p = 0; p < FSBENCH_PASSES; p++)
+		for (off = 0; off < j->e.size; off += n) {
+			if (!(n = fs_read(&j->e, off, buf, sizeof(buf)))) break;
+			for (k = 0; k < n; k++) sum = sum * 31 + buf[k];
+		}
+	j->sum = sum;
+	sem_up(&fsbench_done);
+}
+
+/* Run the jobs from first on: together, or each waited for in turn.
+ * Whatever was started is always waited for, so a failed run leaves no
+ * task behind to post into the next one; 0 means a task did not start. */
+static unsigned long long fsbench_run(int together)
+{
+	unsigned long long t0 = rdtsc();
+	int i, up = 0;
+	sem_init(&fsbench_done, 0);
+	fsbench_next = 0;
+	for (i = 0; i < 2; i++) {
+		if (task_create(fsbench_task, "fsbench") < 0) break;
+		if (together) up++; else sem_down(&fsbench_done);
+	}
+	while (up--) sem_down(&fsbench_done);
+	return i < 2 ? 0 : rdtsc() - t0;
+}
+
+static void cmd_fsbench(void)
+{
+	struct fs_entry e[FS_MAX_FILES];
+	unsigned long long serial, both;
+	unsigned sums[2];
+	int n = fs_list(e), i, a = -1, b = -1;
+	for (i = 0; i < n; i++)
+		if (a < 0 || e[i].size > e[a].size) { b = a; a = i; }
+		else if (b < 0 || e[i].size > e[b].size) b = i;
+	if (b < 0) { vga_puts("fsbench: needs two files\n"); return; }
+	fsbench_jobs[0].e = e[a]; fsbench_jobs[1].e = e[b];
+	if (!(serial = fsbench_run(0))) { vga_puts("No free task slot.\n"); return; }
+	sums[0] = fsbench_jobs[0].sum; sums[1] = fsbench_jobs[1].sum;
+	if (!(both = fsbench_run(1))) { vga_puts("No free task slot.\n"); return; }
+
+	vga_puts(e[a].name);vga_puts(" (");vga_putint(e[a].size);vga_puts(" bytes) and ");
+	vga_puts(e[b].name);vga_puts(" (");vga_putint(e[b].size);vga_puts(" bytes), ");
+	vga_putint(FSBENCH_PASSES);vga_puts(" passes each\n");
+	vga_puts("  one after the other  ");vga_putint(tsc_to_us(serial));vga_puts(" us\n");
+	vga_puts("  both at once         ");vga_putint(tsc_to_us(both));vga_puts(" us (");
+	vga_putint(tsc_to_us(both) * 100 / (tsc_to_us(serial) + 1));vga_puts("% of the time)\n");
+	vga_puts(sums[0] == fsbench_jobs[0].sum && sums[1] == fsbench_jobs[1].sum
+	         ? "  same data both times\n" : "  DATA DIFFERS between the runs\n");
+	vga_puts("BENCH name=fs_serial cycles=");vga_putint(tsc_div(serial, 2 * FSBENCH_PASSES));
+	vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
+	vga_puts("BENCH name=fs_parallel cycles=");vga_putint(tsc_div(both, 2 * FSBENCH_PASSES));
+	vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
+}
+
+/* Run a ring-3 program in the foreground */
+static void cmd_user(const char *arg)
+{
+	int i, id;
+	for (i = 0; i < user_nprogs; i++)
+		if (my_strcmp(arg, user_progs[i].name) == 0) break;
+	if (i == user_nprogs) {
+		if (*arg) { vga_puts("Unknown program: ");vga_puts(arg);vga_putchar('\n'); }
+		vga_puts(sys_fast ? "System calls: SYSENTER, INT 0x80\n" : "System calls: INT 0x80\n");
+		for (i = 0; i < user_nprogs; i++) {
+			int l = 0; const char *p = user_progs[i].name;
+			vga_puts("  ");vga_puts(p);while(*p++)l++;while(l++<10)vga_putchar(' ');
+			vga_puts(user_progs[i].help);vga_putchar('\n');
+		}
+		return;
+	}
+	if ((id = task_create_user(user_progs[i].fn, user_progs[i].name)) < 0) { vga_puts("No free task slot.\n"); return; }
+	while (tasks[id].active) task_yield();
+}
+
+/* Run an ELF program from the disk in the foreground, then show how
+ * its pages got there */
+static void cmd_exec(const char *arg)
+{
+	char fn[FS_NAME_MAX + 1]; struct mm *mm; unsigned entry, sp; int i, id, r;
+	for (i = 0; i < FS_NAME_MAX && arg[i] && arg[i] != ' '; i++) fn[i] = arg[i];
+	fn[i] = 0;
+	if (!fn[0]) { vga_puts("Usage: exec FILE [args]\n"); return; }
+	if (!vm_on) { vga_puts("No paging on this CPU (needs PSE).\n"); return; }
+	if ((r = vm_exec(fn, arg + i, &mm, &entry, &sp)) < 0) {
+		vga_puts(r == FS_ENOENT ? "File not found: " : r == VM_ENOMEM ? "Out of memory: " : "Not an executable: ");
+		vga_puts(fn); vga_putchar('\n'); return;
+	}
+	if ((id = task_create_proc(mm, fn, entry, sp)) < 0) { vm_release(mm); vga_puts("No free task slot.\n"); return; }
+	while (tasks[id].active || tasks[id].on_cpu) task_yield();
+	if (!(mm = __sync_lock_test_and_set(&tasks[id].mm, 0))) return;
+	vga_puts("[");vga_puts(fn);vga_puts(": ");vga_putint(mm->pf_read + mm->pf_shared + mm->pf_cached + mm->pf_zero);
+	vga_puts(" page faults: ");vga_putint(mm->pf_read);vga_puts(" read, ");vga_putint(mm->pf_shared);
+	vga_puts(" shared, ");vga_putint(mm->pf_cached);vga_puts(" copied, ");vga_putint(mm->pf_zero);
+	vga_puts(" zero; ");vga_putint(tsc_to_us(mm->pf_cycles));vga_puts(" us");
+	if ((r = (int)vm_release(mm)) != 0) { vga_puts("; ");vga_putint(r);vga_puts(" written back"); }
+	vga_puts("]\n");
+}
+
+static void cmd_boottime(void)
+{
+	int i, l; const char *p;
+	vga_puts("  Stage                 at ms   +us\n");
+	for (i = 0; i < boot_nstages; i++) {
+		unsigned long long t = BOOT_TSC[i];
+		vga_puts("  ");vga_puts(boot_names[i]);p=boot_names[i];l=0;while(*p++)l++;while(l++<20)vga_putchar(' ');
+		vga_putint(tsc_to_ms(t - BOOT_TSC[0]));vga_putchar('\t');
+		vga_putint(i ? tsc_to_us(t - BOOT_TSC[i-1]) : 0);vga_putchar('\n');
+	}
+}
+
+/* Live per-task view, redrawn every second until a key is pressed */
+static void cmd_top(void)
+{
+	unsigned last[MAX_TASKS], t0, dt, idle, d, i;
+	int l; const char *p;
+	char c = 0;
+
+	for (i = 0; i < MAX_TASKS; i++) last[i] = tasks[i].ticks;
+	t0 = ticks;
+	while (!c) {
+		for (dt = 0; dt < TIMER_HZ && !(c = kbd_trygetchar()); dt++) wait_ticks(1);
+		dt = (ticks - t0) * (unsigned)ncpus_online;     /* CPU-ticks in this interval */
+		t0 = ticks;
+		if (!dt) dt = 1;
+		for (i = 0, idle = 0; i < (unsigned)num_tasks; i++)
+			if (tasks[i].idle) idle += tasks[i].ticks - last[i];
+
+		vga_clear();
+		if (serial_ok) { serial_putc('\033'); serial_putc('['); serial_putc('H');
+		                 serial_putc('\033'); serial_putc('['); serial_putc('J'); }
+		vga_puts("top - up ");vga_putint(ticks/TIMER_HZ);vga_puts("s, ");vga_putint((unsigned)ncpus_online);
+		vga_puts(" CPU(s), idle ");vga_putint(idle*100/dt);vga_puts("%   (any key quits)\n\n");
+		vga_puts("  ID  Name         CPU %CPU  Ticks   Vol     Invol   Disk ms Input ms  Heap\n");
+		for (i = 0; i < (unsigned)num_tasks; i++) {
+			struct task *t = &tasks[i];
+			if (!t->active && !t->idle) continue;
+			d = t->ticks - last[i]; last[i] = t->ticks;
+			vga_puts("  ");vga_putint(i);vga_puts(i<10?"   ":"  ");vga_puts(t->name);
+			l=0;p=t->name;while(*p++)l++;while(l++<13)vga_putchar(' ');
+			vga_putint((unsigned)t->cpu);vga_puts("   ");vga_putint(d*100/dt);vga_putchar('\t');
+			vga_putint(t->ticks);vga_putchar('\t');vga_putint(t->nvcsw);vga_putchar('\t');
+			vga_putint(t->nivcsw);vga_putchar('\t');vga_putint(tsc_to_ms(t->wait_disk));vga_putchar('\t');
+			vga_putint(tsc_to_ms(t->wait_input));vga_putchar('\t');vga_putint(heap_task_bytes[i]);vga_putchar('\n');
+		}
+		if (heap_task_bytes[HEAP_EXITED]) {
+			vga_puts("\n  Heap left by exited tasks: ");vga_putint(heap_task_bytes[HEAP_EXITED]);vga_putchar('\n');
+		}
+	}
+}
+
+/* Two tasks pinned to one CPU yielding back and forth, with and without SSE */
+#define FPUBENCH_N 10000
+
+static volatile int fpubench_sse, fpubench_started, fpubench_done;
+static volatile unsigned long long fpubench_t0, fpubench_t1;
+
+static void fpubench_task(void)
+{
+	int i;
+	if (__sync_fetch_and_add(&fpubench_started, 1) == 0) fpubench_t0 = rdtsc();
+	for (i = 0; i < FPUBENCH_N; i++) {
+		if (fpubench_sse) __asm__ volatile("pxor %%xmm0, %%xmm0" ::: "memory");
+		task_yield();
+	}
+	if (__sync_add_and_fetch(&fpubench_done, 1) == 2) fpubench_t1 = rdtsc();
+}
+
+/* Cycles per task switch; sse=1 makes every switch take an #NM trap */
+static unsigned ctxsw_cycles(int sse, unsigned *traps)
+{
+	int cpu = ncpus_online - 1;
+	unsigned tr = cpus[cpu].fpu_traps;
+	fpubench_sse = sse; fpubench_started = 0; fpubench_done = 0;
+	if (task_create_on(fpubench_task, "ctxsw", cpu) < 0) return 0;
+	if (task_create_on(fpubench_task, "ctxsw", cpu) < 0) { fpubench_done = 1; }
+	while (fpubench_done < 2) task_yield();
+	if (traps) *traps = cpus[cpu].fpu_traps - tr;
+	return (unsigned)(fpubench_t1 - fpubench_t0) / (2 * FPUBENCH_N);
+}
+
+static void cmd_fpubench(void)
+{
+	unsigned plain, sse, traps;
+	if (!fpu_ok) { vga_puts("No FXSR/SSE support.\n"); return; }
+	plain = ctxsw_cycles(0, 0);
+	sse = ctxsw_cycles(1, &traps);
+	vga_puts("Context switch (cycles/switch, CPU ");vga_putint((unsigned)(ncpus_online-1));vga_puts("):\n");
+	vga_puts("  integer only  ");vga_putint(plain);vga_putchar('\n');
+	vga_puts("  SSE in use    ");vga_putint(sse);vga_puts("  (#NM traps ");vga_putint(traps);vga_puts(")\n");
+}
+
+static void cmd_prof(const char *arg)
+{
+	unsigned text = (unsigned)(_etext - _text_start), nb = (text >> PROF_SHIFT) + 1;
+	unsigned total = 0, other = 0, *sym, i, k;
+	int j;
+
+	if (starts_with(arg, "start")) {
+		unsigned hz = 0;
+		arg += 5; while (*arg == ' ') arg++;
+		while (*arg >= '0' && *arg <= '9') hz = hz*10 + (unsigned)(*arg++ - '0');
+		if (!hz) hz = 1000;
+		if (hz > PROF_MAX_HZ) hz = PROF_MAX_HZ;
+		if (hz < TIMER_HZ) hz = TIMER_HZ;
+		prof_on = 0;
+		for (j = 0; j < ncpus_online; j++) {
+			struct cpu *c = &cpus[j];
+			if (!c->prof_hist && !(c->prof_hist = kmalloc(nb * 4))) { vga_puts("Out of memory.\n"); return; }
+			memset(c->prof_hist, 0, nb * 4);
+			memset(c->prof_task, 0, sizeof(c->prof_task));
+			c->prof_samples = c->prof_other = 0;
+		}
+		prof_hz = (hz / TIMER_HZ) * TIMER_HZ;
+		timer_set_rate(hz / TIMER_HZ);
+		prof_on = 1;
+		vga_puts("Profiling at ");vga_putint(prof_hz);vga_puts(" Hz per CPU\n");
+		return;
+	}
+	if (my_strcmp(arg, "stop") == 0) {
+		prof_on = 0;
+		timer_set_rate(1);
+		vga_puts("Profiler stopped.\n");
+		return;
+	}
+	if (my_strcmp(arg, "report") != 0) { vga_puts("Usage: prof start [hz] | stop | report\n"); return; }
+
+	for (j = 0; j < ncpus_online; j++) { total += cpus[j].prof_samples; other += cpus[j].prof_other; }
+	vga_puts("Samples: ");vga_putint(total);vga_puts(" at ");vga_putint(prof_hz);
+	vga_puts(" Hz, outside kernel text ");vga_putint(other);vga_putchar('\n');
+	if (!total) return;
+
+	/* Fold every CPU's buckets into per-symbol counts (last slot: unknown) */
+	if (!(sym = kzalloc((ksyms_count + 1) * 4))) { vga_puts("Out of memory.\n"); return; }
+	for (j = 0; j < ncpus_online; j++) {
+		if (!cpus[j].prof_hist) continue;
+		for (i = 0; i < nb; i++) {
+			int s;
+			if (!cpus[j].prof_hist[i]) continue;
+			s = ksym_find((unsigned)_text_start + (i << PROF_SHIFT));
+			sym[s < 0 ? ksyms_count : (unsigned)s] += cpus[j].prof_hist[i];
+		}
+	}
+	vga_puts("  Samples    %  Function\n");
+	for (k = 0; k < 12; k++) {
+		unsigned best = 0, bi = 0;
+		for (i = 0; i <= ksyms_count; i++) if (sym[i] > best) { best = sym[i]; bi = i; }
+		if (!best) break;
+		vga_puts("  ");vga_putint(best);vga_putchar('\t');vga_putint(best * 100 / total);vga_puts("\t");
+		if (bi < ksyms_count) vga_puts(ksyms[bi].name); else vga_puts("?");
+		vga_putchar('\n');
+		sym[bi] = 0;
+	}
+	kfree(sym);
+
+	vga_puts("  By task:\n");
+	for (i = 0; i < (unsigned)num_tasks; i++) {
+		unsigned n = 0;
+		for (j = 0; j < ncpus_online; j++) n += cpus[j].prof_task[i];
+		if (!n) continue;
+		vga_puts("  ");vga_putint(n);vga_putchar('\t');vga_putint(n * 100 / total);vga_puts("\t");
+		vga_puts(tasks[i].name);vga_putchar('\n');
+	}
+}
+
+/* ---- Memory commands ---- */
+
+static void cmd_mem(void)
+{
+	unsigned short e820n=*(volatile unsigned short*)0x500;
+	struct e820_entry *e=(struct e820_entry*)0x504;
+	unsigned tkb=0,hu,hf; int i;
+	vga_puts("Memory Map (E820):\n");
+	for(i=0;i<e820n&&i<20;i++){
+		vga_puts("  ");vga_puthex(e[i].blo);vga_puts(" - ");vga_puthex(e[i].blo+e[i].llo);
+		switch(e[i].type){case 1:vga_puts(" usable");tkb+=e[i].llo/1024;break;
+			case 2:vga_puts(" reserved");break;default:vga_puts(" other");break;}
+		vga_putchar('\n');
+	}
+	if(!e820n)vga_puts("  (not available)\n");
+	vga_puts("Total: ");vga_putint(tkb);vga_puts(" KB (");vga_putint(tkb/1024);vga_puts(" MB)\n\n");
+	vga_puts("Heap:\n");
+	heap_usage(&hu,&hf);
+	vga_puts("  Used: ");vga_putint(hu);vga_puts("  Free: ");vga_putint(hf);vga_putchar('\n');
+	{
+		/* Average cycles of a kzalloc from the pool and of one that zeroed on the spot */
+		struct heap_zstats z = heap_zstats;
+		unsigned ah = tsc_div(z.hit_cycles, z.hits ? z.hits : 1), am = tsc_div(z.miss_cycles, z.misses ? z.misses : 1);
+		vga_puts("  Zeroed pool: ");vga_putint(heap_zn);vga_putchar('/');vga_putint(HEAP_ZPOOL);
+		vga_puts(" blocks  kzalloc hits ");vga_putint(z.hits);vga_puts(" misses ");vga_putint(z.misses);
+		vga_puts(" (");vga_putint(z.hits * 100 / (z.hits + z.misses + !(z.hits + z.misses)));vga_puts("%)\n");
+		vga_puts("  Cycles per hit ");vga_putint(ah);vga_puts(", per miss ");vga_putint(am);
+		vga_puts("; saved ~");vga_putint(z.misses && am > ah ? tsc_to_us((unsigned long long)z.hits * (am - ah)) : 0);
+		vga_puts(" us\n");
+	}
+	if(vm_on){
+		unsigned pf,pt,pc; vm_stats(&pf,&pt,&pc);
+		vga_puts("Pages (4KB):\n  Free: ");vga_putint(pf);vga_puts(" of ");vga_putint(pt);
+		vga_puts("  Page cache: ");vga_putint(pc);vga_putchar('\n');
+	}
 }
 
-/* ---- Interrupt handlers ---- */
-
-extern void isr_timer(void);
-extern void isr_keyboard(void);
-extern void isr_mouse(void);
-
-unsigned timer_handler(unsigned esp)
+static void cmd_memtest(void)
 {
-	static unsigned gui_last_sec = 0xFFFFFFFF;
-	int saved_bank = cur_bank;          /* save shell's bank state */
+	void *a,*b,*c;
+	vga_puts("malloc(100)... ");a=kmalloc(100);
+	if(a){vga_puts("OK ");vga_puthex((unsigned)a);vga_putchar('\n');}else{vga_puts("FAIL\n");return;}
+	vga_puts("malloc(200)... ");b=kmalloc(200);
+	if(b){vga_puts("OK ");vga_puthex((unsigned)b);vga_putchar('\n');}else{vga_puts("FAIL\n");return;}
+	vga_puts("free(first)... ");kfree(a);vga_puts("OK\n");
+	vga_puts("malloc(50)...  ");c=kmalloc(50);
+	if(c){vga_puts("OK ");vga_puthex((unsigned)c);if(c==a)vga_puts(" (reused!)");vga_putchar('\n');}
+	else{vga_puts("FAIL\n");return;}
+	kfree(b);kfree(c);vga_puts("All tests passed.\n");
+}
 
-	ticks++;
+static void cmd_heapstat(const char *arg)
+{
+	unsigned oldest[HEAP_SITES], done[HEAP_SITES], dt, i, k;
 
-	/* ---- GUI: clock (once per second) ---- */
-	{
-		unsigned total_sec = ticks / TIMER_HZ;
-		if (total_sec != gui_last_sec) {
-			unsigned sec = total_sec % 60;
-			unsigned min = (total_sec / 60) % 60;
-			unsigned hr  = total_sec / 3600;
-			char tb[9];
-			tb[0] = '0'+hr/10; tb[1] = '0'+hr%10; tb[2] = ':';
-			tb[3] = '0'+min/10; tb[4] = '0'+min%10; tb[5] = ':';
-			tb[6] = '0'+sec/10; tb[7] = '0'+sec%10; tb[8] = 0;
-			gfx_text(GFX_WIDTH - 72, TASKBAR_Y + 9, tb, COL_TBTEXT, COL_TASKBAR);
-			gui_last_sec = total_sec;
-		}
+	if (my_strcmp(arg, "on") == 0 || my_strcmp(arg, "off") == 0) {
+		heap_track_set(arg[1] == 'n');
+		vga_puts(heap_track ? "Heap tracking on.\n" : "Heap tracking off.\n");
+		return;
 	}
-
-	/* ---- GUI: mouse cursor (skip during scroll) ---- */
-	if (!gui_no_cursor) {
-		int mx = mouse_x, my = mouse_y;
-		if (mx != gui_old_mx || my != gui_old_my) {
-			if (gui_old_mx >= 0) cursor_hide(gui_old_mx, gui_old_my);
-			cursor_show(mx, my);
-			gui_old_mx = mx; gui_old_my = my;
+	if (*arg) { vga_puts("Usage: heapstat [on|off]\n"); return; }
+
+	heap_site_oldest(oldest);
+	for (i = 0; i < HEAP_SITES; i++) done[i] = 0;
+
+	dt = ticks - heap_track_start; if (!dt) dt = 1;
+	vga_puts("Tracking ");vga_puts(heap_track ? "on" : "off");vga_puts(" for ");vga_putint(dt / TIMER_HZ);
+	vga_puts("s  live ");vga_putint(heap_live);vga_puts("  peak ");vga_putint(heap_peak);
+	if (heap_lost) { vga_puts("  untracked ");vga_putint(heap_lost); }
+	vga_puts("\nSize classes (requested bytes):\n ");
+	for (i = 0; i < HEAP_CLASSES; i++) {
+		if (!heap_classes[i]) continue;
+		vga_puts(" <=");vga_putint(16u << i);if (i == HEAP_CLASSES - 1) vga_putchar('+');
+		vga_putchar(':');vga_putint(heap_classes[i]);
+	}
+	vga_puts("\n  Live B  Blocks  Allocs/s  Oldest s  Call site\n");
+	for (k = 0; k < 10; k++) {
+		unsigned best = HEAP_SITES, bl = 0;
+		int s;
+		for (i = 0; i < HEAP_SITES; i++)
+			if (heap_sites[i].caller && !done[i] && (best == HEAP_SITES || heap_sites[i].live_bytes > bl
+			    || (heap_sites[i].live_bytes == bl && heap_sites[i].allocs > heap_sites[best].allocs)))
+				{ best = i; bl = heap_sites[i].live_bytes; }
+		if (best == HEAP_SITES) break;
+		done[best] = 1;
+		vga_puts("  ");vga_putint(bl);vga_putchar('\t');vga_putint(heap_sites[best].live_n);vga_putchar('\t');
+		vga_putint(heap_sites[best].allocs * TIMER_HZ / dt);vga_putchar('\t');
+		vga_putint(heap_sites[best].live_n ? (ticks - oldest[best]) / TIMER_HZ : 0);vga_putchar('\t');
+		vga_puthex(heap_sites[best].caller);
+		if ((s = ksym_find(heap_sites[best].caller)) >= 0 && heap_sites[best].caller < (unsigned)_etext) {
+			vga_putchar(' ');vga_puts(ksyms[s].name);vga_putchar('+');vga_putint(heap_sites[best].caller - ksyms[s].addr);
 		}
+		vga_putchar('\n');
 	}
+}
 
-	cur_bank = saved_bank;              /* restore shell's bank state */
-	if (saved_bank >= 0) {              /* restore hardware bank too */
-		outw(0x1CE, 0x05);
-		outw(0x1CF, (unsigned short)saved_bank);
+static void cmd_irqstat(void)
+{
+	unsigned n,max=0;
+	int i,j;
+	vga_puts("IRQ-off time (cycles, all CPUs):\n");
+	for(i=0;i<IRQOFF_BUCKETS;i++){
+		for(j=n=0;j<ncpus_online;j++)n+=cpus[j].irqoff_hist[i];
+		if(!n)continue;
+		vga_puts("  <");vga_putint(256u<<i);
+		if(i==IRQOFF_BUCKETS-1)vga_putchar('+');
+		vga_puts("\t");vga_putint(n);vga_putchar('\n');
 	}
+	for(j=0;j<ncpus_online;j++)if(cpus[j].irqoff_max>max)max=cpus[j].irqoff_max;
+	vga_puts("  max: ");vga_putint(max);vga_putchar('\n');
+}
 
-	/* ---- Task switching ---- */
-	if (num_tasks <= 1) return esp;
-	tasks[current_task].esp = esp;
-	{
-		int next = current_task;
-		do { next = (next+1) % num_tasks; } while (!tasks[next].active && next != current_task);
-		current_task = next;
+/* Round trip of a software interrupt into stubs that differ only in EOI */
+#define INT_BENCH_N 1000
+#define INT_BENCH(vec, out) do { unsigned long long t0 = rdtsc(); int k; \
+	for (k = 0; k < INT_BENCH_N; k++) __asm__ volatile("int $" #vec ::: "memory"); \
+	out = (unsigned)(rdtsc() - t0) / INT_BENCH_N; } while (0)
+
+static void cmd_apic(void)
+{
+	unsigned none, pic, apic = 0;
+	vga_puts(lapic_eoi ? "Interrupts: LAPIC + I/O APIC\n" : "Interrupts: 8259 PIC\n");
+	if (lapic) {
+		vga_puts("  LAPIC ");vga_puthex((unsigned)lapic);
+		if (ioapic) { vga_puts("  IOAPIC ");vga_puthex((unsigned)ioapic); }
+		vga_puts("  CPUs ");vga_putint((unsigned)ncpus_online);vga_putchar('/');vga_putint((unsigned)ncpus);vga_putchar('\n');
+		vga_puts("  IRQ0->GSI");vga_putint(irq_gsi[0]);vga_puts("  IRQ14 count ");vga_putint(ata_irqs);vga_putchar('\n');
 	}
-	return tasks[current_task].esp;
+	INT_BENCH(0x82, none);
+	INT_BENCH(0x83, pic);
+	if (lapic_eoi) INT_BENCH(0x84, apic);
+	vga_puts("Entry/exit cost (cycles):\n");
+	vga_puts("  int+iret     ");vga_putint(none);vga_putchar('\n');
+	vga_puts("  + PIC EOI    ");vga_putint(pic);vga_putchar('\n');
+	if (lapic_eoi) { vga_puts("  + LAPIC EOI  ");vga_putint(apic);vga_putchar('\n'); }
 }
 
-void keyboard_handler(void)
+static void cmd_lspci(void)
 {
-	static int e0_flag = 0;
-	unsigned char sc = inb(0x60);
-	int next;
+	int bdf = -1;
+	vga_puts("  Bus:Dev.Fn  Device:Vendor  Class     IRQ\n");
+	while ((bdf = pci_next(bdf)) >= 0) {
+		vga_puts("  ");vga_putint((unsigned)bdf >> 8);vga_putchar(':');vga_putint((unsigned)bdf >> 3 & 31);
+		vga_putchar('.');vga_putint((unsigned)bdf & 7);vga_puts("\t");vga_puthex(pci_read(bdf, 0));
+		vga_putchar(' ');vga_puthex(pci_read(bdf, 0x08) >> 8);vga_putchar(' ');
+		vga_putint(pci_read(bdf, 0x3C) & 0xFF);vga_putchar('\n');
+	}
+}
 
-	if (sc == 0xE0) { e0_flag = 1; return; }
+static void cmd_disk_journal(void)
+{
+	vga_puts("  Journal: ");vga_putint(fs_stats.commits);vga_puts(" commits of ");vga_putint(fs_stats.ops);
+	vga_puts(" changes, ");vga_putint(fs_stats.flushes);vga_puts(" flushes, ");vga_putint(fs_stats.checkpoints);
+	vga_puts(fs_stats.replayed ? " checkpoints; replayed at mount\n" : " checkpoints\n");
+}
 
-	if (e0_flag) {
-		e0_flag = 0;
-		if (sc & 0x80) return;          /* release of extended key */
-		char ch = 0;
-		if (sc == 0x48) ch = KEY_UP;    /* up arrow */
-		else if (sc == 0x50) ch = KEY_DOWN; /* down arrow */
-		if (ch) {
-			next = (kbd_head+1) % KBD_BUF_SIZE;
-			if (next != kbd_tail) { kbd_buf[kbd_head] = ch; kbd_head = next; }
-		}
+static void cmd_disk(void)
+{
+	if (!vblk_io) {
+		vga_puts("Disk: ATA PIO, primary master, one polled sector per command\n");
+		vga_puts("  IRQ14 count ");vga_putint(ata_irqs);vga_putchar('\n');
+		cmd_disk_journal();
 		return;
 	}
+	vga_puts("Disk: virtio-blk at I/O ");vga_puthex(vblk_io);vga_puts(", IRQ ");vga_putint((unsigned)vblk_irq);
+	vga_puts(", ");vga_putint(vblk_cap);vga_puts(" sectors\n");
+	vga_puts("  Queue ");vga_putint(vblk_qsize);vga_puts(" descriptors, ");vga_putint(vblk_nreq);
+	vga_puts(" requests; in flight now ");vga_putint(vblk_stats.inflight);
+	vga_puts(", max ");vga_putint(vblk_stats.inflight_max);vga_putchar('\n');
+	vga_puts("  Requests ");vga_putint(vblk_stats.reqs);vga_puts(" (");vga_putint(vblk_stats.sectors);
+	vga_puts(" sectors), errors ");vga_putint(vblk_stats.errors);vga_putchar('\n');
+	vga_puts("  IRQs ");vga_putint(vblk_stats.irqs);vga_puts(", waits slept ");vga_putint(vblk_stats.sleeps);
+	vga_puts(", polled ");vga_putint(vblk_stats.polled);
+	vga_puts(vblk_flush ? "; write-back cache\n" : "; write-through\n");
+	cmd_disk_journal();
+}
 
-	if (sc & 0x80) return;
-	if (sc < sizeof(sc_to_ascii) && sc_to_ascii[sc]) {
-		next = (kbd_head+1) % KBD_BUF_SIZE;
-		if (next != kbd_tail) { kbd_buf[kbd_head] = sc_to_ascii[sc]; kbd_head = next; }
+static void cmd_input(void)
+{
+	unsigned i; const struct spsc *r;
+	vga_puts("  Ring          Size  Queued  Peak  Dropped\n");
+	for(i=0;i<sizeof(input_rings)/sizeof(input_rings[0]);i++){
+		int l=0; const char *p;
+		r=input_rings[i];
+		vga_puts("  ");vga_puts(r->name);p=r->name;while(*p++)l++;while(l++<14)vga_putchar(' ');
+		vga_putint(r->mask+1);vga_putchar('\t');vga_putint(r->head-r->tail);vga_putchar('\t');
+		vga_putint(r->hiwat);vga_putchar('\t');vga_putint(r->dropped);vga_putchar('\n');
 	}
+	vga_puts("  Mouse packets coalesced: ");vga_putint(mouse_coalesced);vga_putchar('\n');
+	vga_puts("  Key latency (cycles): last ");vga_putint(kbd_lat_last);
+	vga_puts("  max ");vga_putint(kbd_lat_max);vga_putchar('\n');
+	if (serial_ok) { vga_puts("  Serial TX stalls (ring full): ");vga_putint(serial_tx_stalls);vga_putchar('\n'); }
 }
 
-void mouse_handler(void)
-{
-	static int cycle = 0;
-	static unsigned char bytes[3];
-	int dx, dy;
+/* ---- Window manager ----
+ * 'wm' composites a few windows over a snapshot of the console and lets
+ * the mouse raise them and drag them by the title bar until a key is
+ * pressed, then puts the console back. Every composite is timed; the
+ * "Frame time" window shows the frames that moved a window.
+ */
 
-	/* Only read if data is from auxiliary device (mouse, not keyboard) */
-	if (!(inb(0x64) & 0x20)) { inb(0x60); return; }
+#define WM_BENCH_FRAMES 200
 
-	bytes[cycle] = inb(0x60);
+struct wm_timing { unsigned n, last, max, px; unsigned long long sum; };
 
-	/* Byte 0 must have bit 3 set (PS/2 always-1 bit); resync if not */
-	if (cycle == 0 && !(bytes[0] & 0x08)) return;
+static char *fmt_uint(char *p, unsigned n)
+{
+	char d[10]; int i = 0;
+	do d[i++] = (char)('0' + n % 10); while (n /= 10);
+	while (i) *p++ = d[--i];
+	*p = 0;
+	return p;
+}
 
-	cycle++;
-	if (cycle < 3) return;
-	cycle = 0;
+static void wm_line(int id, int row, const char *label, unsigned v, const char *unit)
+{
+	char s[24], *p = s;
+	while (*label) *p++ = *label++;
+	p = fmt_uint(p, v);
+	while (*unit) *p++ = *unit++;
+	while (p < s + 18) *p++ = ' ';
+	*p = 0;
+	wm_text(id, 4, 2 + row * CHAR_H, s, COL_FG, WM_COL_CLIENT);
+}
 
-	mouse_btns = bytes[0] & 7;
-	dx = bytes[1]; dy = bytes[2];
-	if (bytes[0] & 0x10) dx -= 256;
-	if (bytes[0] & 0x20) dy -= 256;
-	mouse_x += dx; mouse_y -= dy;
-	if (mouse_x < 0) mouse_x = 0;
-	if (mouse_x > GFX_WIDTH - CUR_W) mouse_x = GFX_WIDTH - CUR_W;
-	if (mouse_y < 0) mouse_y = 0;
-	if (mouse_y > TASKBAR_Y - 1) mouse_y = TASKBAR_Y - 1;
+static void wm_show_timing(int id, const struct wm_timing *t)
+{
+	wm_line(id, 0, "frames ", t->n, "");
+	wm_line(id, 1, "last   ", tsc_to_us(t->last), " us");
+	wm_line(id, 2, "avg    ", t->n ? tsc_div(t->sum, t->n * (tsc_khz / 1000)) : 0, " us");
+	wm_line(id, 3, "max    ", tsc_to_us(t->max), " us");
+	wm_line(id, 4, "pixels ", t->px, "");
 }
 
-/* ---- Keyboard ---- */
+static void wm_show_tasks(int id)
+{
+	char s[24], *p; const char *q; int i;
+	for (i = 0; i < num_tasks && i < 10; i++) {
+		p = fmt_uint(s, (unsigned)i); *p++ = ' ';
+		for (q = tasks[i].name; *q && p < s + 12; ) *p++ = *q++;
+		while (p < s + 13) *p++ = ' ';
+		for (q = !tasks[i].active ? "-" : tasks[i].on_cpu ? "run" : tasks[i].blocked ? "wait" : "ready"; *q; ) *p++ = *q++;
+		while (p < s + 18) *p++ = ' ';
+		*p = 0;
+		wm_text(id, 4, 2 + i * CHAR_H, s, COL_FG, WM_COL_CLIENT);
+	}
+}
 
-static char kbd_getchar(void)
+static void wm_time(struct wm_timing *t, unsigned long long cyc, unsigned px)
 {
-	char c;
-	while (kbd_head == kbd_tail) __asm__ volatile("hlt");
-	c = kbd_buf[kbd_tail]; kbd_tail = (kbd_tail+1) % KBD_BUF_SIZE;
-	return c;
+	t->n++; t->sum += cyc; t->last = (unsigned)cyc; t->px = px;
+	if (t->last > t->max) t->max = t->last;
 }
 
-/* ---- ATA PIO ---- */
+static void cmd_wm(const char *arg)
+{
+	unsigned char *bg = (unsigned char *)kmalloc(GFX_WIDTH * WM_HEIGHT), b, ob = 0;
+	struct wm_timing drag = { 0, 0, 0, 0, 0 }, full = { 0, 0, 0, 0, 0 };
+	struct wm_rect r;
+	unsigned long long t0;
+	unsigned last = 0, px, i;
+	int wt, wf, wp, id, mover = -1, dx = 0, dy = 0, x, y, moved;
+
+	if (!bg) { vga_puts("wm: out of memory\n"); return; }
+	fb_read_span(0, bg, GFX_WIDTH * WM_HEIGHT);
+	wm_init(bg);
+	memset(&wm_stats, 0, sizeof(wm_stats));
+	wt = wm_create(24, 24, 160, 176, "Tasks");
+	wf = wm_create(380, 40, 160, 94, "Frame time");
+	wp = wm_create(200, 230, 180, 112, "Palette");
+	for (i = 0; i < 16; i++) wm_fill(wp, (int)(i % 8) * 22, (int)(i / 8) * 46, 22, 46, (unsigned char)i);
+	wm_show_tasks(wt);
+	wm_composite();
+
+	if (starts_with(arg, "bench")) {
+		/* Drag "Frame time" around, then redraw the whole area as often */
+		for (i = 0; i < WM_BENCH_FRAMES; i++) {
+			wm_rect(wf, &r);
+			wm_move(wf, r.x + (i / 50 % 2 ? -4 : 4), r.y + (i / 25 % 2 ? -2 : 2));
+			t0 = rdtsc(); px = wm_composite(); wm_time(&drag, rdtsc() - t0, px);
+		}
+		for (i = 0; i < WM_BENCH_FRAMES / 4; i++) {
+			wm_damage(0, 0, GFX_WIDTH, WM_HEIGHT);
+			t0 = rdtsc(); px = wm_composite(); wm_time(&full, rdtsc() - t0, px);
+		}
+	} else {
+		while (!kbd_trygetchar()) {
+			x = mouse_x; y = mouse_y; b = mouse_btns; moved = 0;
+			if ((b & 1) && !(ob & 1) && (id = wm_at(x, y)) >= 0) {
+				wm_raise(id);
+				if (wm_in_title(id, x, y)) { wm_rect(id, &r); mover = id; dx = x - r.x; dy = y - r.y; }
+			}
+			if (!(b & 1)) mover = -1;
+			if (mover >= 0) {
+				wm_rect(mover, &r);
+				if (y - dy > WM_HEIGHT - WM_TITLE_H) dy = y - (WM_HEIGHT - WM_TITLE_H);
+				if (y - dy < 0) dy = y;
+				if (x - dx != r.x || y - dy != r.y) { wm_move(mover, x - dx, y - dy); moved = 1; }
+			}
+			if (ticks - last >= TIMER_HZ) { wm_show_tasks(wt); last = ticks; }
+			t0 = rdtsc(); px = wm_composite();
+			if (moved) { wm_time(&drag, rdtsc() - t0, px); wm_show_timing(wf, &drag); }
+			ob = b;
+			wait_ticks(1);
+		}
+	}
+	wm_exit();
+	wm_composite();
+	kfree(bg);
+
+	vga_puts("wm: ");vga_putint(wm_stats.frames);vga_puts(" composites, ");vga_putint(drag.n);vga_puts(" while dragging");
+	if (drag.n) {
+		vga_puts(": avg ");vga_putint(tsc_div(drag.sum, drag.n * (tsc_khz / 1000)));
+		vga_puts(" us, max ");vga_putint(tsc_to_us(drag.max));vga_puts(" us");
+	}
+	vga_putchar('\n');
+	if (!full.n) return;
+	vga_puts("BENCH name=wm_drag cycles=");vga_putint(tsc_div(drag.sum, drag.n));
+	vga_puts(" px=");vga_putint(drag.px);vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
+	vga_puts("BENCH name=wm_full cycles=");vga_putint(tsc_div(full.sum, full.n));
+	vga_puts(" px=");vga_putint(full.px);vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
+}
 
-static void ata_read_sector(unsigned lba, void *buf)
+/* ---- Benchmarks ----
+ * Each bench runs n operations and cmd_bench reports TSC cycles per
+ * operation, plus one "BENCH name=... " line per result for scripts
+ * that compare runs.
+ */
+
+static unsigned bench_seed = 12345;
+static unsigned bench_rand(void) { bench_seed = bench_seed * 1664525u + 1013904223u; return bench_seed >> 16; }
+
+static void bench_gfx_rect(unsigned n)
 {
-	int i; unsigned short *p = (unsigned short *)buf;
-	while (inb(0x1F7) & 0x80);
-	outb(0x1F6, 0xE0|((lba>>24)&0xF));
-	outb(0x1F2,1); outb(0x1F3,lba&0xFF); outb(0x1F4,(lba>>8)&0xFF); outb(0x1F5,(lba>>16)&0xFF);
-	outb(0x1F7,0x20);
-	while (!(inb(0x1F7) & 0x08));
-	for (i=0;i<256;i++) p[i]=inw(0x1F0);
+	unsigned i;
+	for (i = 0; i < n; i++) gfx_rect(0, 0, GFX_WIDTH, TASKBAR_Y, (unsigned char)(i & 1 ? COL_BG : 0));
 }
 
-static void ata_write_sector(unsigned lba, const void *buf)
+static void bench_gfx_char(unsigned n)
 {
-	int i; const unsigned short *p = (const unsigned short *)buf;
-	while (inb(0x1F7)&0x80);
-	outb(0x1F6,0xE0|((lba>>24)&0xF));
-	outb(0x1F2,1); outb(0x1F3,lba&0xFF); outb(0x1F4,(lba>>8)&0xFF); outb(0x1F5,(lba>>16)&0xFF);
-	outb(0x1F7,0x30);
-	while (!(inb(0x1F7)&0x08));
-	for (i=0;i<256;i++) outw(0x1F0,p[i]);
-	outb(0x1F7,0xE7); while (inb(0x1F7)&0x80);
+	unsigned i;
+	for (i = 0; i < n; i++)
+		gfx_char((int)(i % CONSOLE_COLS) * CHAR_W, (int)(i / CONSOLE_COLS % CONSOLE_ROWS) * CHAR_H,
+		         (char)('!' + i % 94), COL_FG, COL_BG);
 }
 
-/* ---- String helpers ---- */
+static void bench_vga_scroll(unsigned n)
+{
+	unsigned i;
+	for (i = 0; i < n; i++) vga_scroll();
+}
 
-static int my_strcmp(const char *a, const char *b)
-{ while (*a && *a==*b){a++;b++;} return (unsigned char)*a-(unsigned char)*b; }
+/* n creates and deletes of a one-sector file, committed together */
+static void bench_fs_create(unsigned n)
+{
+	static const char data[64] = "bench";
+	unsigned i;
+	for (i = 0; i < n; i++) { fs_create("bench.tmp", data, sizeof(data)); fs_delete("bench.tmp"); }
+	fs_commit();
+}
 
-static int starts_with(const char *s, const char *p)
-{ while(*p){if(*s++!=*p++)return 0;} return 1; }
+static void bench_disk_read(unsigned n)
+{
+	unsigned char buf[512];
+	unsigned i;
+	for (i = 0; i < n; i++) hal_read_sector(i, buf);
+}
 
-/* ---- PS/2 mouse init ---- */
+/* Whole pages, one at a time and then BENCH_QD in flight at once (virtio-blk) */
+#define BENCH_QD 8
 
-static void mouse_wait_in(void)  { int i; for(i=0;i<100000;i++) if(!(inb(0x64)&2)) return; }
-static void mouse_wait_out(void) { int i; for(i=0;i<100000;i++) if(inb(0x64)&1) return; }
+static void bench_disk_page(unsigned n)
+{
+	unsigned char *buf = (unsigned char *)kmalloc(PAGE_SIZE);
+	unsigned i;
+	if (!buf) return;
+	for (i = 0; i < n; i++) hal_read_sectors(i * 8, 8, buf);
+	kfree(buf);
+}
 
-static void mouse_init(void)
+static void bench_disk_queue(unsigned n)
 {
-	unsigned char st;
+	unsigned char *buf = (unsigned char *)kmalloc(BENCH_QD * PAGE_SIZE);
+	unsigned i, k;
+	int s[BENCH_QD];
+	if (!buf) return;
+	for (i = 0; i < n; i += BENCH_QD) {
+		for (k = 0; k < BENCH_QD; k++) s[k] = vblk_io ? vblk_submit((i + k) * 8, 8, buf + k * PAGE_SIZE, 0) : -1;
+		for (k = 0; k < BENCH_QD; k++)
+			if (s[k] >= 0) vblk_wait(s[k]);
+			else hal_read_sectors((i + k) * 8, 8, buf + k * PAGE_SIZE);
+	}
+	kfree(buf);
+}
 
-	/* Flush any stale data in the controller buffer */
-	while (inb(0x64) & 1) inb(0x60);
+#define BENCH_SLOTS 64
 
-	mouse_wait_in(); outb(0x64, 0xA8);
-	mouse_wait_in(); outb(0x64, 0x20);
-	mouse_wait_out(); st = inb(0x60);
-	st |= 2;
-	mouse_wait_in(); outb(0x64, 0x60);
-	mouse_wait_in(); outb(0x60, st);
-	mouse_wait_in(); outb(0x64, 0xD4);
-	mouse_wait_in(); outb(0x60, 0xF6);
-	mouse_wait_out(); inb(0x60);
-	mouse_wait_in(); outb(0x64, 0xD4);
-	mouse_wait_in(); outb(0x60, 0xF4);
-	mouse_wait_out(); inb(0x60);
+static void bench_kmalloc(unsigned n)
+{
+	void *slot[BENCH_SLOTS]; unsigned i, k;
+	for (i = 0; i < BENCH_SLOTS; i++) slot[i] = 0;
+	for (i = 0; i < n; i++) {
+		k = bench_rand() % BENCH_SLOTS;
+		if (slot[k]) { kfree(slot[k]); slot[k] = 0; }
+		else slot[k] = kmalloc(16 + bench_rand() % 2048);
+	}
+	for (i = 0; i < BENCH_SLOTS; i++) if (slot[i]) kfree(slot[i]);
 }
 
-/* ---- Filesystem commands ---- */
+static const struct bench {
+	const char *name, *unit;
+	void (*fn)(unsigned n);
+	unsigned n;
+} benches[] = {
+	{ "gfx_rect",   "fill",   bench_gfx_rect,   20 },
+	{ "gfx_char",   "glyph",  bench_gfx_char,   5000 },
+	{ "vga_scroll", "line",   bench_vga_scroll, 50 },
+	{ "disk_read",  "sector", bench_disk_read,  256 },
+	{ "disk_page",  "page",   bench_disk_page,  64 },
+	{ "disk_queue", "page",   bench_disk_queue, 64 },
+	{ "fs_create",  "file",   bench_fs_create,  100 },
+	{ "kmalloc",    "op",     bench_kmalloc,    20000 },
+	{ "ctxsw",      "switch", 0,                2 * FPUBENCH_N },
+};
 
-static void cmd_dir(void)
+/* Operations per second for a cost of cyc cycles per operation */
+static unsigned bench_per_sec(unsigned cyc)
 {
-	struct fs_entry *e; int i, count = 0;
-	ata_read_sector(FS_DIR_SECTOR, disk_buf);
-	e = (struct fs_entry *)disk_buf;
-	for (i = 0; i < FS_MAX_FILES; i++) {
-		if (!e[i].name[0]) break;
-		vga_puts("  "); vga_puts(e[i].name);
-		{ int l=0; const char *p=e[i].name; while(*p++)l++; while(l++<20) vga_putchar(' '); }
-		vga_putint(e[i].size); vga_puts(" bytes\n"); count++;
+	if (!cyc) return 0;
+	if (cyc >= 4000000) return tsc_khz / (cyc / 1000);
+	return tsc_khz / cyc * 1000 + tsc_khz % cyc * 1000 / cyc;
+}
+
+static void cmd_bench(const char *arg)
+{
+	unsigned cyc[sizeof(benches)/sizeof(benches[0])], i, sh, ran = 0;
+	unsigned long long t0;
+
+	for (i = 0; i < sizeof(benches)/sizeof(benches[0]); i++) {
+		const struct bench *b = &benches[i];
+		cyc[i] = 0;
+		if (*arg && my_strcmp(arg, b->name) != 0) continue;
+		if (!b->fn) { cyc[i] = ctxsw_cycles(0, 0); ran++; continue; }
+		t0 = rdtsc();
+		b->fn(b->n);
+		t0 = rdtsc() - t0;
+		for (sh = 0; t0 >> 32; sh++) t0 >>= 1;  /* no 64-bit divide here */
+		cyc[i] = ((unsigned)t0 / b->n) << sh;
+		ran++;
+	}
+	vga_clear();            /* the graphics benches scribbled over the console */
+	if (!ran) { vga_puts("Unknown bench: "); vga_puts(arg); vga_putchar('\n'); return; }
+
+	vga_puts("TSC ");vga_putint(tsc_khz / 1000);vga_puts(" MHz\n");
+	vga_puts("  Bench       cycles/op   ops/sec\n");
+	for (i = 0; i < sizeof(benches)/sizeof(benches[0]); i++) {
+		int l = 0; const char *p;
+		if (!cyc[i]) continue;
+		vga_puts("  ");vga_puts(benches[i].name);p=benches[i].name;while(*p++)l++;while(l++<12)vga_putchar(' ');
+		vga_putint(cyc[i]);vga_putchar('\t');vga_putint(bench_per_sec(cyc[i]));
+		vga_putchar(' ');vga_puts(benches[i].unit);vga_puts("/s\n");
+	}
+	for (i = 0; i < sizeof(benches)/sizeof(benches[0]); i++) {
+		if (!cyc[i]) continue;
+		vga_puts("BENCH name=");vga_puts(benches[i].name);
+		vga_puts(" cycles=");vga_putint(cyc[i]);
+		vga_puts(" per_sec=");vga_putint(bench_per_sec(cyc[i]));
+		vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
 	}
-	if (!count) vga_puts("  (no files)\n");
-	vga_putint((unsigned)count); vga_puts(" file(s)\n");
 }
 
-static void cmd_type(const char *fn)
+/* membench: throughput of each copy/fill kernel by block size, in MB/s
+ * (bytes per cycle times the TSC rate in MHz) */
+
+#define MEMBENCH_MAX    65536
+#define MEMBENCH_BYTES  (4u << 20)      /* moved per size and variant */
+
+static const unsigned membench_sizes[] = { 64, 256, 1024, 4096, 65536 };
+
+static void cmd_membench(void)
 {
-	struct fs_entry *e; int i; unsigned rem, sec, tp, j;
-	ata_read_sector(FS_DIR_SECTOR, disk_buf); e = (struct fs_entry *)disk_buf;
-	for (i=0;i<FS_MAX_FILES;i++) {
-		if (!e[i].name[0]) break;
-		if (my_strcmp(e[i].name,fn)==0) {
-			rem=e[i].size; sec=e[i].start;
-			while (rem) { ata_read_sector(sec,disk_buf); tp=rem>512?512:rem;
-				for(j=0;j<tp;j++) vga_putchar((char)disk_buf[j]); rem-=tp; sec++; }
-			return;
+	static const char *names[] = { "memcpy_rep", "memcpy_sse2", "memset_rep", "memset_sse2" };
+	void *sp = kmalloc(MEMBENCH_MAX + 16), *dp = kmalloc(MEMBENCH_MAX + 16);
+	unsigned char *src, *dst;
+	unsigned a, b, c, d, v, k, i, n, cyc, sh, sse2;
+	unsigned long long t0;
+
+	cpuid(1, &a, &b, &c, &d);
+	sse2 = fpu_ok && (d & (1u << 26));
+	if (!sp || !dp) { vga_puts("membench: out of memory\n"); goto out; }
+	src = (unsigned char *)(((unsigned)sp + 15) & ~15u);
+	dst = (unsigned char *)(((unsigned)dp + 15) & ~15u);
+	memset_rep(src, 0x5A, MEMBENCH_MAX);
+
+	vga_puts("  size     rep cpy  sse2 cpy   rep set  sse2 set  (MB/s)\n");
+	for (k = 0; k < sizeof(membench_sizes)/sizeof(membench_sizes[0]); k++) {
+		unsigned sz = membench_sizes[k], mb[4];
+		n = MEMBENCH_BYTES / sz;
+		for (v = 0; v < 4; v++) {
+			mb[v] = 0;
+			if ((v & 1) && !sse2) continue;
+			t0 = rdtsc();
+			for (i = 0; i < n; i++) {
+				switch (v) {
+				case 0: memcpy_rep(dst, src, sz); break;
+				case 1: memcpy_sse2(dst, src, sz); break;
+				case 2: memset_rep(dst, (int)i, sz); break;
+				default: memset_sse2(dst, (int)i, sz); break;
+				}
+			}
+			t0 = rdtsc() - t0;
+			for (sh = 0; t0 >> 32; sh++) t0 >>= 1;  /* no 64-bit divide here */
+			cyc = ((unsigned)t0 / n) << sh;
+			mb[v] = cyc ? sz * (tsc_khz / 1000) / cyc : 0;
+			vga_puts("BENCH name=");vga_puts(names[v]);
+			vga_puts(" size=");vga_putint(sz);
+			vga_puts(" cycles=");vga_putint(cyc);
+			vga_puts(" mb_s=");vga_putint(mb[v]);
+			vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
 		}
+		vga_puts("  ");vga_putint(sz);
+		for (v = 0; v < 4; v++) { vga_putchar('\t'); if (mb[v]) vga_putint(mb[v]); else vga_putchar('-'); }
+		vga_putchar('\n');
 	}
-	vga_puts("File not found: "); vga_puts(fn); vga_putchar('\n');
+	if (!sse2) vga_puts("No SSE2: memcpy/memset use rep movs/stos only.\n");
+out:
+	if (sp) kfree(sp);
+	if (dp) kfree(dp);
 }
 
-static void cmd_write(const char *fn)
+static int ipc_alive(int id) { return id >= 0 && (tasks[id].active || tasks[id].on_cpu); }
+
+/* ipcbench: round trips between two exec'd ipc.elf processes, which
+ * send the totals back on a port. MB/s counts both directions. */
+static void cmd_ipcbench(void)
 {
-	struct fs_entry *e; int bp=0,ls,sl=-1,i,j; unsigned fs=110,end,sn; char c;
-	ata_read_sector(FS_DIR_SECTOR,disk_buf); e=(struct fs_entry*)disk_buf;
-	for(i=0;i<FS_MAX_FILES;i++){
-		if(!e[i].name[0]){if(sl<0)sl=i;continue;}
-		if(my_strcmp(e[i].name,fn)==0){vga_puts("File exists. Use 'del' first.\n");return;}
-		end=e[i].start+(e[i].size+511)/512; if(end>fs)fs=end;
+	static const char *const roles[2] = { "pong", "ping" };
+	struct mm *mm; unsigned entry, sp, res[4], rtt, mb, moved;
+	int id[2], k, r, port, pp;
+
+	if (!vm_on) { vga_puts("No paging on this CPU (needs PSE).\n"); return; }
+	if ((port = port_open("ipcbench")) < 0 || (pp = port_open("ping")) < 0 || port_open("pong") < 0) {
+		vga_puts("No free port.\n"); return;
 	}
-	if(sl<0){vga_puts("Directory full.\n");return;}
-	vga_puts("Enter text (blank line to save):\n");
-	for(;;){
-		vga_puts("> "); ls=bp;
-		for(;;){c=kbd_getchar();if(c=='\n'){vga_putchar('\n');break;}
-			else if(c=='\b'){if(bp>ls){bp--;vga_putchar('\b');}}
-			else if(bp<FILE_BUF_SIZE-2){file_buf[bp++]=(unsigned char)c;vga_putchar(c);}}
-		if(bp==ls)break; if(bp<FILE_BUF_SIZE-1)file_buf[bp++]='\n';
+	for (k = 0; k < PORT_MAX; k++) while (ports[k] && port_recv(k, 0, 0, 0) >= 0);     /* a dead run's leftovers */
+	moved = ports[pp]->moved;
+	for (k = 0; k < 2; k++) {
+		id[k] = -1;
+		if ((r = vm_exec("ipc.elf", roles[k], &mm, &entry, &sp)) < 0) {
+			vga_puts(r == FS_ENOENT ? "File not found: ipc.elf\n" : "Cannot run ipc.elf\n"); continue;
+		}
+		if ((id[k] = task_create_proc(mm, "ipc", entry, sp)) < 0) { vm_release(mm); vga_puts("No free task slot.\n"); }
 	}
-	if(!bp){vga_puts("Empty file, not saved.\n");return;}
-	sn=((unsigned)bp+511)/512;
-	for(i=0;i<(int)sn;i++){int o=i*512,tc=bp-o;if(tc>512)tc=512;
-		for(j=0;j<512;j++)disk_buf[j]=(j<tc)?file_buf[o+j]:0;
-		ata_write_sector(fs+(unsigned)i,disk_buf);}
-	ata_read_sector(FS_DIR_SECTOR,disk_buf);e=(struct fs_entry*)disk_buf;
-	for(j=0;j<20;j++)e[sl].name[j]=0;
-	for(j=0;fn[j]&&j<19;j++)e[sl].name[j]=fn[j];
-	e[sl].start=fs;e[sl].size=(unsigned)bp;e[sl].flags=0;
-	ata_write_sector(FS_DIR_SECTOR,disk_buf);
-	vga_puts("Saved: ");vga_puts(fn);vga_puts(" (");vga_putint((unsigned)bp);vga_puts(" bytes)\n");
+	/* One of them blocked after the other is gone will never be woken */
+	while (ipc_alive(id[0]) || ipc_alive(id[1])) {
+		for (k = 0; k < 2; k++)
+			if (id[k] >= 0 && !ipc_alive(id[1 - k]) && tasks[id[k]].active && tasks[id[k]].blocked == 2) tasks[id[k]].active = 0;
+		task_yield();
+	}
+	for (k = 0; k < 2; k++) if (id[k] >= 0) vm_release(__sync_lock_test_and_set(&tasks[id[k]].mm, 0));
+
+	vga_puts("  size     cycles/rt   rt/sec     MB/s\n");
+	while (port_recv(port, res, sizeof(res), 0) == sizeof(res)) {
+		rtt = tsc_div((unsigned long long)res[3] << 32 | res[2], res[1]);
+		mb = rtt ? 2 * res[0] * (tsc_khz / 1000) / rtt : 0;
+		vga_puts("  ");vga_putint(res[0]);vga_putchar('\t');vga_putint(rtt);vga_putchar('\t');
+		vga_putint(bench_per_sec(rtt));vga_putchar('\t');vga_putint(mb);vga_putchar('\n');
+		vga_puts("BENCH name=ipc size=");vga_putint(res[0]);
+		vga_puts(" cycles=");vga_putint(rtt);
+		vga_puts(" mb_s=");vga_putint(mb);
+		vga_puts(" tsc_khz=");vga_putint(tsc_khz);vga_putchar('\n');
+	}
+	vga_putint(ports[pp]->moved - moved);vga_puts(" pages remapped instead of copied\n");
 }
 
-static void cmd_del(const char *fn)
+/* ---- Trace command ---- */
+
+/* The dump goes to COM1 when present: thousands of lines through the
+ * framebuffer console would mostly trace vga_scroll. */
+static void trace_putc(char c) { if (serial_ok) serial_putc(c); else vga_putchar(c); }
+static void trace_puts(const char *p) { while (*p) trace_putc(*p++); }
+
+static void trace_puthex(unsigned v, int digits)
+{
+	while (digits--) trace_putc("0123456789abcdef"[(v >> (digits * 4)) & 0xF]);
+}
+
+static void trace_putint(unsigned n)
 {
-	struct fs_entry *e; int i,j;
-	ata_read_sector(FS_DIR_SECTOR,disk_buf);e=(struct fs_entry*)disk_buf;
-	for(i=0;i<FS_MAX_FILES;i++){
-		if(!e[i].name[0])continue;
-		if(my_strcmp(e[i].name,fn)==0){
-			for(j=0;j<32;j++)((unsigned char*)&e[i])[j]=0;
-			ata_write_sector(FS_DIR_SECTOR,disk_buf);
-			vga_puts("Deleted: ");vga_puts(fn);vga_putchar('\n');return;
+	char buf[12]; int i = 0;
+	do buf[i++] = (char)('0' + n % 10); while (n /= 10);
+	while (--i >= 0) trace_putc(buf[i]);
+}
+
+static void cmd_trace(const char *arg)
+{
+	unsigned n, i, total = 0;
+	int j;
+
+	if (my_strcmp(arg, "on") == 0) {
+		for (j = 0; j < ncpus_online; j++) {
+			struct cpu *c = &cpus[j];
+			if (!c->trace && !(c->trace = kmalloc(TRACE_EVENTS * sizeof(struct trace_ev)))) {
+				vga_puts("Out of memory.\n"); return;
+			}
+			c->trace_head = 0;
+		}
+		trace_on = 1;
+		vga_puts("Tracing on (");vga_putint(TRACE_EVENTS);vga_puts(" events per CPU).\n");
+		return;
+	}
+	if (my_strcmp(arg, "off") == 0) { trace_on = 0; vga_puts("Tracing off.\n"); return; }
+	if (my_strcmp(arg, "dump") != 0) {
+		vga_puts("Tracing ");vga_puts(trace_on ? "on" : "off");vga_puts(", events:");
+		for (j = 0; j < ncpus_online; j++) { vga_putchar(' ');vga_putint(cpus[j].trace_head); }
+		vga_puts("\nUsage: trace on | off | dump\n");
+		return;
+	}
+
+	trace_on = 0;
+	trace_puts("TRACE begin tsc_khz=");trace_putint(tsc_khz);
+	trace_puts(" cpus=");trace_putint((unsigned)ncpus_online);trace_putc('\n');
+	for (i = 0; i < (unsigned)num_tasks; i++) {
+		trace_puts("TASK ");trace_putint(i);trace_putc(' ');trace_puts(tasks[i].name);trace_putc('\n');
+	}
+	for (j = 0; j < ncpus_online; j++) {
+		struct cpu *c = &cpus[j];
+		if (!c->trace) continue;
+		n = c->trace_head < TRACE_EVENTS ? c->trace_head : TRACE_EVENTS;
+		for (i = c->trace_head - n; i != c->trace_head; i++) {
+			const struct trace_ev *e = &c->trace[i & (TRACE_EVENTS - 1)];
+			trace_puts("T ");trace_putint((unsigned)j);trace_putc(' ');
+			trace_puthex((unsigned)(e->tsc >> 32), 8);trace_puthex((unsigned)e->tsc, 8);trace_putc(' ');
+			trace_puts(e->type < TR_NTYPES ? trace_names[e->type] : "?");trace_putc(' ');
+			trace_puthex(e->arg, 8);trace_putc('\n');
 		}
+		total += n;
 	}
-	vga_puts("File not found: ");vga_puts(fn);vga_putchar('\n');
+	trace_puts("TRACE end\n");
+	if (serial_ok) { vga_putint(total);vga_puts(" events written to COM1.\n"); }
 }
 
-/* ---- Task commands ---- */
+/* ---- Jobs ----
+ * 'cmd &' runs cmd in a kernel task of its own. While in the background
+ * its console output collects in the job's buffer and it reads no keys;
+ * 'fg' prints what it has collected, gives it the console and waits for
+ * it. 'jobs' shows the task ids, so 'ps' and 'kill' work on them too.
+ */
 
-static void cmd_ps(void)
+#define JOB_MAX        4
+#define JOB_OUT        4096
+#define JOB_STACK_SIZE 16384            /* commands keep buffers on the stack */
+
+struct job {
+	int task;                       /* 0: slot free (task 0 is the shell) */
+	char cmd[CMD_BUF_SIZE];
+	char *out;                      /* JOB_OUT bytes */
+	unsigned n, lost;               /* bytes collected, dropped when full */
+	int told;                       /* "Done" already shown at a prompt */
+};
+static struct job jobs[JOB_MAX];
+static spinlock_t job_lock;             /* out, n and lost */
+
+static void shell_exec(char *cmd);
+
+int hal_console_sink(char c)
 {
-	int i,l; const char *p;
-	vga_puts("  ID  Name         Status\n");
-	for(i=0;i<num_tasks;i++){
-		vga_puts("  ");vga_putint((unsigned)i);vga_puts("   ");vga_puts(tasks[i].name);
-		l=0;p=tasks[i].name;while(*p++)l++;while(l++<13)vga_putchar(' ');
-		if(i==current_task)vga_puts("running\n");
-		else if(tasks[i].active)vga_puts("ready\n");
-		else vga_puts("stopped\n");
-	}
+	struct job *j;
+	unsigned f;
+	if (!tasks[current_task].bg) return 0;
+	j = &jobs[tasks[current_task].job - 1];
+	f = spin_lock_irqsave(&job_lock);
+	if (j->n < JOB_OUT) j->out[j->n++] = c; else j->lost++;
+	spin_unlock_irqrestore(&job_lock, f);
+	return 1;
 }
 
-/* ---- Memory commands ---- */
+static void job_task(void)
+{
+	struct job *j = &jobs[tasks[current_task].job - 1];
+	shell_exec(j->cmd);
+	fs_commit();
+}
 
-struct e820_entry { unsigned int blo,bhi,llo,lhi,type,acpi; } __attribute__((packed));
+/* Returned or was killed; its task slot stays reserved until job_free */
+static int job_done(const struct job *j) { return !tasks[j->task].active; }
 
-static void cmd_mem(void)
+static void job_free(struct job *j) { kfree(j->out); j->out = 0; tasks[j->task].job = 0; j->task = 0; }
+
+static void job_start(const char *cmd, unsigned len)
 {
-	unsigned short e820n=*(volatile unsigned short*)0x500;
-	struct e820_entry *e=(struct e820_entry*)0x504;
-	unsigned tkb=0; struct heap_block *b; unsigned hu=0,hf=0; int i;
-	vga_puts("Memory Map (E820):\n");
-	for(i=0;i<e820n&&i<20;i++){
-		vga_puts("  ");vga_puthex(e[i].blo);vga_puts(" - ");vga_puthex(e[i].blo+e[i].llo);
-		switch(e[i].type){case 1:vga_puts(" usable");tkb+=e[i].llo/1024;break;
-			case 2:vga_puts(" reserved");break;default:vga_puts(" other");break;}
+	struct job *j;
+	char name[16];
+	int i, id;
+	for (i = 0; i < JOB_MAX && jobs[i].task; i++);
+	if (i == JOB_MAX) for (i = 0; i < JOB_MAX && !(job_done(&jobs[i]) && jobs[i].told); i++);
+	if (i == JOB_MAX) { vga_puts("Too many jobs. Use 'fg' first.\n"); return; }
+	j = &jobs[i];
+	if (j->task) job_free(j);
+	if (!(j->out = (char *)kmalloc(JOB_OUT))) { vga_puts("Out of memory.\n"); return; }
+	memcpy(j->cmd, cmd, len);
+	j->cmd[len] = 0;
+	j->n = j->lost = 0; j->told = 0;
+	for (id = 0; id < (int)sizeof(name) - 1 && cmd[id] && cmd[id] != ' '; id++) name[id] = cmd[id];
+	name[id] = 0;
+	if ((id = task_spawn_stack(job_task, name, JOB_STACK_SIZE)) < 0) {
+		kfree(j->out); j->out = 0;
+		vga_puts("No free task slot.\n"); return;
+	}
+	j->task = id;
+	tasks[id].job = i + 1; tasks[id].bg = 1;
+	rq_push(least_loaded_cpu(), id);
+	vga_putchar('[');vga_putint((unsigned)(i + 1));vga_puts("] task ");vga_putint((unsigned)id);vga_putchar('\n');
+}
+
+/* Before each prompt: say which background jobs have finished */
+static void job_notify(void)
+{
+	struct job *j;
+	for (j = jobs; j < jobs + JOB_MAX; j++) {
+		if (!j->task || !job_done(j) || j->told) continue;
+		j->told = 1;
+		vga_putchar('[');vga_putint((unsigned)(j - jobs + 1));vga_puts("] Done  ");vga_puts(j->cmd);
+		if (j->n) { vga_puts("  ("); vga_putint(j->n); vga_puts(" bytes of output, 'fg "); vga_putint((unsigned)(j - jobs + 1)); vga_puts("')"); }
+		else job_free(j);
 		vga_putchar('\n');
 	}
-	if(!e820n)vga_puts("  (not available)\n");
-	vga_puts("Total: ");vga_putint(tkb);vga_puts(" KB (");vga_putint(tkb/1024);vga_puts(" MB)\n\n");
-	vga_puts("Heap:\n");
-	for(b=heap_head;b;b=b->next){if(b->used)hu+=b->size;else hf+=b->size;}
-	vga_puts("  Used: ");vga_putint(hu);vga_puts("  Free: ");vga_putint(hf);vga_putchar('\n');
 }
 
-static void cmd_memtest(void)
+static void cmd_jobs(void)
 {
-	void *a,*b,*c;
-	vga_puts("malloc(100)... ");a=kmalloc(100);
-	if(a){vga_puts("OK ");vga_puthex((unsigned)a);vga_putchar('\n');}else{vga_puts("FAIL\n");return;}
-	vga_puts("malloc(200)... ");b=kmalloc(200);
-	if(b){vga_puts("OK ");vga_puthex((unsigned)b);vga_putchar('\n');}else{vga_puts("FAIL\n");return;}
-	vga_puts("free(first)... ");kfree(a);vga_puts("OK\n");
-	vga_puts("malloc(50)...  ");c=kmalloc(50);
-	if(c){vga_puts("OK ");vga_puthex((unsigned)c);if(c==a)vga_puts(" (reused!)");vga_putchar('\n');}
-	else{vga_puts("FAIL\n");return;}
-	kfree(b);kfree(c);vga_puts("All tests passed.\n");
+	const struct job *j;
+	int any = 0;
+	for (j = jobs; j < jobs + JOB_MAX; j++) {
+		if (!j->task) continue;
+		any = 1;
+		vga_putchar('[');vga_putint((unsigned)(j - jobs + 1));vga_puts(job_done(j) ? "] done     task " : "] running  task ");
+		vga_putint((unsigned)j->task);vga_puts(j->task < 10 ? "   " : "  ");
+		vga_putint(j->n);vga_puts(" bytes  ");vga_puts(j->cmd);vga_putchar('\n');
+	}
+	if (!any) vga_puts("(no jobs)\n");
+}
+
+/* fg [N]: job N, or the highest-numbered one */
+static void cmd_fg(const char *arg)
+{
+	struct job *j;
+	unsigned f, shown = 0, n;
+	int i = 0;
+	while (*arg >= '0' && *arg <= '9') i = i * 10 + (*arg++ - '0');
+	if (!i) for (i = JOB_MAX; i > 1 && !jobs[i - 1].task; i--);
+	if (i > JOB_MAX || !jobs[i - 1].task) { vga_puts("No such job.\n"); return; }
+	j = &jobs[i - 1];
+	vga_puts(j->cmd);vga_putchar('\n');
+	/* Catch up with the buffer, then switch the job to the console with
+	 * job_lock held so no character lands between the two */
+	for (;;) {
+		f = spin_lock_irqsave(&job_lock);
+		if ((n = j->n) == shown) {
+			if (tasks[j->task].job == i) tasks[j->task].bg = 0;
+			spin_unlock_irqrestore(&job_lock, f);
+			input_wake();           /* in case it sleeps in kbd_getchar */
+			break;
+		}
+		spin_unlock_irqrestore(&job_lock, f);
+		for (; shown < n; shown++) if (j->out[shown] != '\f') vga_putchar(j->out[shown]);
+	}
+	if (j->lost) { vga_puts("(");vga_putint(j->lost);vga_puts(" bytes of output lost)\n"); }
+	task_join(j->task);
+	job_free(j);
 }
 
 /* ---- Shell ---- */
@@ -786,13 +3630,23 @@ static void print_prompt(void) { vga_puts("C:\\>"); }
 
 static void shell_exec(char *cmd)
 {
+	unsigned n=0;
 	while(*cmd==' ')cmd++;
-	if(!cmd[0]){}
+	while(cmd[n])n++;
+	while(n&&cmd[n-1]==' ')n--;
+	if(n&&cmd[n-1]=='&'){
+		do n--; while(n&&cmd[n-1]==' ');
+		if(n)job_start(cmd,n); else vga_puts("Usage: COMMAND &\n");
+	}
+	else if(!cmd[0]){}
 	else if(my_strcmp(cmd,"help")==0){
 		vga_puts("Commands:\n");
 		vga_puts("  help ver clear echo uptime history\n");
-		vga_puts("  dir ls type cat write del\n");
-		vga_puts("  mem memtest ps kill\n");
+		vga_puts("  dir ls type cat write del copy sync\n");
+		vga_puts("  mem memtest heapstat ps top kill jobs fg user exec irqstat apic lspci disk\n");
+		vga_puts("  COMMAND & runs it in the background\n");
+		vga_puts("  smpbench fpubench fsbench\n");
+		vga_puts("  input prof bench membench ipcbench wm trace boottime shutdown\n");
 	}
 	else if(my_strcmp(cmd,"history")==0){
 		int i;
@@ -811,17 +3665,51 @@ static void shell_exec(char *cmd)
 		vga_putint(m);vga_puts("m ");vga_putint(s);vga_puts("s (");vga_putint(t);vga_puts(" ticks)\n");
 	}
 	else if(my_strcmp(cmd,"dir")==0||my_strcmp(cmd,"ls")==0) cmd_dir();
+	else if(my_strcmp(cmd,"sync")==0) fs_sync();
 	else if(starts_with(cmd,"type ")) cmd_type(cmd+5);
 	else if(starts_with(cmd,"cat ")) cmd_type(cmd+4);
 	else if(starts_with(cmd,"write ")) cmd_write(cmd+6);
 	else if(starts_with(cmd,"del ")) cmd_del(cmd+4);
+	else if(starts_with(cmd,"copy")) cmd_copy(cmd+4+(cmd[4]==' '));
 	else if(my_strcmp(cmd,"mem")==0) cmd_mem();
 	else if(my_strcmp(cmd,"memtest")==0) cmd_memtest();
+	else if(starts_with(cmd,"heapstat")) cmd_heapstat(cmd+8+(cmd[8]==' '));
 	else if(my_strcmp(cmd,"ps")==0) cmd_ps();
+	else if(my_strcmp(cmd,"top")==0) cmd_top();
+	else if(my_strcmp(cmd,"jobs")==0) cmd_jobs();
+	else if(starts_with(cmd,"fg")) cmd_fg(cmd+2+(cmd[2]==' '));
+	else if(my_strcmp(cmd,"boottime")==0) cmd_boottime();
+	else if(my_strcmp(cmd,"irqstat")==0) cmd_irqstat();
+	else if(my_strcmp(cmd,"apic")==0) cmd_apic();
+	else if(my_strcmp(cmd,"lspci")==0) cmd_lspci();
+	else if(my_strcmp(cmd,"disk")==0) cmd_disk();
+	else if(starts_with(cmd,"smpbench")) cmd_smpbench(cmd+8+(cmd[8]==' '));
+	else if(my_strcmp(cmd,"fsbench")==0) cmd_fsbench();
+	else if(my_strcmp(cmd,"fpubench")==0) cmd_fpubench();
+	else if(starts_with(cmd,"user")) cmd_user(cmd+4+(cmd[4]==' '));
+	else if(starts_with(cmd,"exec")) cmd_exec(cmd+4+(cmd[4]==' '));
+	else if(my_strcmp(cmd,"input")==0) cmd_input();
+	else if(starts_with(cmd,"prof")) cmd_prof(cmd+4+(cmd[4]==' '));
+	else if(my_strcmp(cmd,"membench")==0) cmd_membench();
+	else if(my_strcmp(cmd,"ipcbench")==0) cmd_ipcbench();
+	else if(starts_with(cmd,"wm")) cmd_wm(cmd+2+(cmd[2]==' '));
+	else if(starts_with(cmd,"bench")) cmd_bench(cmd+5+(cmd[5]==' '));
+	else if(starts_with(cmd,"trace")) cmd_trace(cmd+5+(cmd[5]==' '));
+	else if(my_strcmp(cmd,"shutdown")==0){
+		vga_puts("Shutting down.\n");
+		fs_sync();
+		while (serial_ok && (serial_tx_busy || !(inb(COM1 + 5) & 0x40))) __asm__ volatile("pause");
+		outb(0xF4, 0);                /* QEMU isa-debug-exit */
+		outw(0x604, 0x2000);          /* QEMU ACPI power off */
+		vga_puts("It is now safe to turn off your computer.\n");
+		for(;;) __asm__ volatile("cli; hlt");
+	}
 	else if(starts_with(cmd,"kill ")){
-		int id=cmd[5]-'0';
-		if(id>0&&id<num_tasks&&tasks[id].active){tasks[id].active=0;
-			vga_puts("Killed task ");vga_putint((unsigned)id);vga_putchar('\n');}
+		int id=0; const char *q=cmd+5;
+		while(*q>='0'&&*q<='9')id=id*10+(*q++-'0');
+		if(id>0&&id<num_tasks&&tasks[id].active&&!tasks[id].idle){task_kill(id);
+			vga_puts("Killed task ");
+			vga_putint((unsigned)id);vga_putchar('\n');}
 		else vga_puts("Invalid task ID.\n");
 	}
 	else { vga_puts("Unknown: "); vga_puts(cmd); vga_putchar('\n'); }
@@ -831,6 +3719,8 @@ static void shell_run(void)
 {
 	char buf[CMD_BUF_SIZE]; int pos, hist_nav, i; char c;
 	for(;;){
+		fs_commit();                    /* what the last command changed is on disk */
+		job_notify();
 		print_prompt(); pos=0; hist_nav=hist_count;
 		for(;;){
 			c=kbd_getchar();
@@ -839,7 +3729,7 @@ static void shell_run(void)
 				/* save non-empty command to history */
 				if(pos>0){
 					if(hist_count>=HIST_SIZE){
-						for(i=0;i<HIST_SIZE-1;i++) my_strcpy(history[i],history[i+1]);
+						memmove(history[0],history[1],(HIST_SIZE-1)*CMD_BUF_SIZE);
 						hist_count=HIST_SIZE-1;
 					}
 					my_strcpy(history[hist_count],buf);
@@ -879,22 +3769,52 @@ static void shell_run(void)
 
 /* ---- Kernel entry ---- */
 
+extern char _user_load[];
+
 void kernel_main(void)
 {
-	font = (const unsigned char *)(*(unsigned int *)0x4F8);
-
-	heap_init();
+	font = (const unsigned char *)(*(unsigned int *)0x4F8);   /* 8x14 BIOS font */
+	memcpy(_user_start, _user_load, (unsigned)(_user_end - _user_start));  /* see link.ld */
+
+	cpu_setup(&cpus[0]);
+	sysenter_setup();
+	fpu_setup();                    boot_mark("cpu_setup/fpu_setup");
+	heap_init((void *)HEAP_START, HEAP_SIZE);                    boot_mark("heap_init");
+	vm_init();                      boot_mark("vm_init");
 	task_init_main();
+	task_init_idle();               boot_mark("task_init");
+	softirq_init();
 	pic_init();
-	pit_init(TIMER_HZ);
-	mouse_init();
+	pit_init(TIMER_HZ);             boot_mark("pic_init/pit_init");
+	mouse_init();                   boot_mark("mouse_init");
+	serial_init();                  boot_mark("serial_init");
 
 	idt_set_gate(0x20, (unsigned)isr_timer);
 	idt_set_gate(0x21, (unsigned)isr_keyboard);
 	idt_set_gate(0x2C, (unsigned)isr_mouse);
+	idt_set_gate(0x2E, (unsigned)isr_ata);
+	idt_set_gate(0x24, (unsigned)isr_serial);
+	idt_set_gate(LAPIC_TIMER_VEC, (unsigned)isr_lapic_timer);
+	idt_set_gate(0x81, (unsigned)isr_yield);
+	idt_set_gate(0x07, (unsigned)isr_nm);
+	idt_set_gate(0x00, (unsigned)isr_fault0);
+	idt_set_gate(0x06, (unsigned)isr_fault6);
+	idt_set_gate(0x0D, (unsigned)isr_fault13);
+	idt_set_gate(0x0E, (unsigned)isr_fault14);
+	idt_set_user_gate(0x80, (unsigned)isr_syscall);
+	idt_set_gate(0x82, (unsigned)isr_bench_none);
+	idt_set_gate(0x83, (unsigned)isr_bench_pic);
+	idt_set_gate(0x84, (unsigned)isr_bench_apic);
+	idt_set_gate(0xFF, (unsigned)isr_spurious);
+	apic_init();                    boot_mark("apic_init");
+	vblk_init();                    boot_mark("vblk_init");
+	fs_mount();                     boot_mark("fs_mount");
 	__asm__ volatile("sti");
+	tsc_calibrate();                boot_mark("tsc_calibrate");
+	if (lapic_eoi) smp_init();
+	boot_mark("smp_init");
 
-	desktop_init();
+	desktop_init();                 boot_mark("desktop_init");
 
 	vga_puts("Chocola Ver0.1\n");
 	vga_puts("Type 'help' for commands.\n\n");
@@ -0,0 +1,124 @@
+/*
+ * chocola kernel — memcpy / memmove / memset / memzero_nt
+ *
+ * rep movsd / rep stosd for everything by default. With SSE2 (chosen
+ * once by string_init) large blocks go through 16-byte aligned stores,
+ * but only where may_use_fpu() says so: interrupt handlers and softirqs
+ * must not touch the XMM registers of the task they interrupted, and a
+ * task's first SSE use after a switch costs an #NM trap anyway.
+ * memzero_nt needs SSE2 but no XMM registers.
+ */
+#include "kernel/string.h"
+
+#define SSE_MIN 512             /* below this rep movsd wins */
+
+static int string_sse2;
+
+void string_init(int sse2) { string_sse2 = sse2; }
+
+void *memcpy_rep(void *dst, const void *src, unsigned n)
+{
+	void *d = dst;
+	unsigned n4 = n >> 2;
+	__asm__ volatile("cld\n\trep movsl\n\tmovl %3, %%ecx\n\trep movsb"
+	                 : "+D"(d), "+S"(src), "+c"(n4) : "r"(n & 3) : "memory");
+	return dst;
+}
+
+void *memset_rep(void *dst, int c, unsigned n)
+{
+	void *d = dst;
+	unsigned n4 = n >> 2, v = (unsigned char)c * 0x01010101u;
+	__asm__ volatile("cld\n\trep stosl\n\tmovl %3, %%ecx\n\trep stosb"
+	                 : "+D"(d), "+c"(n4) : "a"(v), "r"(n & 3) : "memory");
+	return dst;
+}
+
+/* The kernel is built without SSE code generation, so the compiler never
+ * holds values in XMM registers and they need no clobbers below. */
+
+void *memcpy_sse2(void *dst, const void *src, unsigned n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned head = -(unsigned)d & 15, blocks;
+
+	if (head > n) head = n;
+	memcpy_rep(d, s, head);
+	d += head; s += head; n -= head;
+	if ((blocks = n >> 6) != 0)
+		__asm__ volatile(
+			"1:\n\t"
+			"movdqu   (%1), %%xmm0\n\tmovdqu 16(%1), %%xmm1\n\t"
+			"movdqu 32(%1), %%xmm2\n\tmovdqu 48(%1), %%xmm3\n\t"
+			"movdqa %%xmm0,   (%0)\n\tmovdqa %%xmm1, 16(%0)\n\t"
+			"movdqa %%xmm2, 32(%0)\n\tmovdqa %%xmm3, 48(%0)\n\t"
+			"addl $64, %0\n\taddl $64, %1\n\tdecl %2\n\tjnz 1b"
+			: "+r"(d), "+r"(s), "+r"(blocks) :: "memory");
+	memcpy_rep(d, s, n & 63);
+	return dst;
+}
+
+void *memset_sse2(void *dst, int c, unsigned n)
+{
+	unsigned char *d = dst;
+	unsigned head = -(unsigned)d & 15, blocks, v = (unsigned char)c * 0x01010101u;
+
+	if (head > n) head = n;
+	memset_rep(d, c, head);
+	d += head; n -= head;
+	if ((blocks = n >> 6) != 0)
+		__asm__ volatile(
+			"movd %2, %%xmm0\n\tpshufd $0, %%xmm0, %%xmm0\n"
+			"1:\n\t"
+			"movdqa %%xmm0,   (%0)\n\tmovdqa %%xmm0, 16(%0)\n\t"
+			"movdqa %%xmm0, 32(%0)\n\tmovdqa %%xmm0, 48(%0)\n\t"
+			"addl $64, %0\n\tdecl %1\n\tjnz 1b"
+			: "+r"(d), "+r"(blocks) : "r"(v) : "memory");
+	memset_rep(d, c, n & 63);
+	return dst;
+}
+
+/* 16 bytes a round; anything not a whole number of rounds on a dword
+ * boundary takes the plain path */
+void memzero_nt(void *dst, unsigned n)
+{
+	unsigned *d = dst, rounds = n >> 4;
+	if (!string_sse2 || !rounds || (n & 15) || ((unsigned)d & 3)) { memset_rep(dst, 0, n); return; }
+	__asm__ volatile(
+		"1:\n\t"
+		"movnti %2,   (%0)\n\tmovnti %2,  4(%0)\n\t"
+		"movnti %2,  8(%0)\n\tmovnti %2, 12(%0)\n\t"
+		"addl $16, %0\n\tdecl %1\n\tjnz 1b\n\t"
+		"sfence"
+		: "+r"(d), "+r"(rounds) : "r"(0) : "memory");
+}
+
+void *memcpy(void *dst, const void *src, unsigned n)
+{
+	if (n >= SSE_MIN && string_sse2 && may_use_fpu()) return memcpy_sse2(dst, src, n);
+	return memcpy_rep(dst, src, n);
+}
+
+void *memset(void *dst, int c, unsigned n)
+{
+	if (n >= SSE_MIN && string_sse2 && may_use_fpu()) return memset_sse2(dst, c, n);
+	return memset_rep(dst, c, n);
+}
+
+/* Forward copies are safe whenever dst is below src; otherwise copy
+ * backwards: the odd bytes first, then whole dwords. */
+void *memmove(void *dst, const void *src, unsigned n)
+{
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned n4 = n >> 2, n1 = n & 3;
+
+	if (d <= s || d >= s + n) return memcpy(dst, src, n);
+	d += n - 1; s += n - 1;
+	__asm__ volatile("std\n\trep movsb\n\t"
+	                 "subl $3, %%esi\n\tsubl $3, %%edi\n\t"
+	                 "movl %3, %%ecx\n\trep movsl\n\tcld"
+	                 : "+D"(d), "+S"(s), "+c"(n1) : "r"(n4) : "memory");
+	return dst;
+}
@@ -0,0 +1,34 @@
+/*
+ * chocola kernel — memory primitives (kernel/string.c)
+ */
+#ifndef CHOCOLA_STRING_H
+#define CHOCOLA_STRING_H
+
+#ifdef HOST
+#include <string.h>     /* the host harness uses libc's */
+static inline void memzero_nt(void *dst, unsigned n) { memset(dst, 0, n); }
+#else
+
+void *memcpy(void *dst, const void *src, unsigned n);
+void *memmove(void *dst, const void *src, unsigned n);
+void *memset(void *dst, int c, unsigned n);
+
+/* Zero n bytes with MOVNTI, past the caches: general registers only, so
+ * it is safe in any context. rep stosl without SSE2. */
+void memzero_nt(void *dst, unsigned n);
+
+/* Pick the SSE2 paths if the CPU has them; call once after fpu_setup() */
+void string_init(int sse2);
+
+/* Individual implementations, for membench */
+void *memcpy_rep(void *dst, const void *src, unsigned n);
+void *memcpy_sse2(void *dst, const void *src, unsigned n);
+void *memset_rep(void *dst, int c, unsigned n);
+void *memset_sse2(void *dst, int c, unsigned n);
+
+/* Provided by the kernel: SSE registers may be used in the current
+ * context (task context with interrupts on, FXSR enabled) */
+int may_use_fpu(void);
+
+#endif
+#endif
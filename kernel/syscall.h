@@ -0,0 +1,70 @@
+/*
+ * chocola kernel — system call numbers and the ring-3 entry stubs
+ *
+ * EAX = number, EBX/ESI/EDI = arguments, result in EAX (negative on
+ * error). SYSENTER also uses ECX (user ESP) and EDX (return EIP);
+ * INT 0x80 works on every CPU and preserves them.
+ */
+#ifndef CHOCOLA_SYSCALL_H
+#define CHOCOLA_SYSCALL_H
+
+#define SYS_NULL      0
+#define SYS_EXIT      1
+#define SYS_WRITE     2   /* buf, len: console output */
+#define SYS_GETC      3   /* -> next key from keyboard or COM1 */
+#define SYS_SLEEP     4   /* ms */
+#define SYS_FREAD     5   /* name, buf, max -> bytes read or FS_E* */
+#define SYS_FWRITE    6   /* name, buf, len -> 0 or FS_E*; replaces the file */
+#define SYS_OPEN      7   /* name, &size (may be 0) -> fd */
+#define SYS_READ      8   /* fd, buf, len -> bytes read at the file position */
+#define SYS_CLOSE     9   /* fd */
+#define SYS_MMAP      10  /* fd, prot, &addr: map the whole file shared */
+#define SYS_MUNMAP    11  /* addr -> dirty pages written back */
+#define SYS_MSYNC     12  /* addr -> dirty pages written back */
+#define SYS_PORT      13  /* name -> port, created on first use */
+#define SYS_SEND      14  /* port, buf, len (at most 64KB); blocks while the port is full */
+#define SYS_RECV      15  /* port, buf, max -> length; blocks while it is empty */
+#define SYS_NR        16
+
+/* SYS_SEND moves the whole pages of a page-aligned buffer instead of
+ * copying them: afterwards they read as if never written. SYS_RECV maps
+ * them at a page-aligned buffer, replacing what was there. */
+
+#define PROT_WRITE    1   /* SYS_MMAP: stores go to the file on msync/munmap */
+
+#define SYS_EINTR     (-4)    /* SYS_SEND, SYS_RECV: the task was killed while it waited */
+#define SYS_EBADF     (-9)
+#define SYS_EAGAIN    (-11)
+#define SYS_ENOMEM    (-12)
+#define SYS_EINVAL    (-22)
+#define SYS_EMFILE    (-24)
+
+extern int sys_fast;      /* set by the kernel: SYSENTER is usable */
+
+static inline int sys_int80(int nr, unsigned a, unsigned b, unsigned c)
+{
+	int r;
+	__asm__ volatile("int $0x80" : "=a"(r) : "a"(nr), "b"(a), "S"(b), "D"(c) : "memory");
+	return r;
+}
+
+static inline int sys_sysenter(int nr, unsigned a, unsigned b, unsigned c)
+{
+	int r;
+	__asm__ volatile("movl %%esp, %%ecx\n\tleal 1f, %%edx\n\tsysenter\n1:"
+	                 : "=a"(r) : "a"(nr), "b"(a), "S"(b), "D"(c) : "ecx", "edx", "memory");
+	return r;
+}
+
+static inline int syscall3(int nr, unsigned a, unsigned b, unsigned c)
+{
+	return sys_fast ? sys_sysenter(nr, a, b, c) : sys_int80(nr, a, b, c);
+}
+
+/* Ring-3 programs linked into the kernel image (kernel/user.c) */
+struct user_prog { const char *name, *help; void (*fn)(void); };
+extern const struct user_prog user_progs[];
+extern const int user_nprogs;
+void user_exit(void);     /* where a program's main returns to */
+
+#endif
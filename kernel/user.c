@@ -0,0 +1,103 @@
+/*
+ * chocola kernel — ring-3 programs
+ *
+ * Linked into the kernel image but run by 'user <name>' at CPL 3 on
+ * their own stacks. link.ld gives this file its own pages (.user), and
+ * those are all of the kernel a program's address space lets ring 3
+ * read: they may only call each other and the syscall3 stubs.
+ */
+#include "kernel/syscall.h"
+
+int sys_fast;                           /* here so that ring 3 can read it */
+
+static unsigned u_strlen(const char *s) { unsigned n = 0; while (s[n]) n++; return n; }
+
+static void u_puts(const char *s) { syscall3(SYS_WRITE, (unsigned)s, u_strlen(s), 0); }
+
+static void u_putint(unsigned n)
+{
+	char buf[12]; int i = 11;
+	buf[i] = 0;
+	do buf[--i] = (char)('0' + n % 10); while (n /= 10);
+	u_puts(buf + i);
+}
+
+static inline unsigned long long u_rdtsc(void)
+{ unsigned lo, hi; __asm__ volatile("rdtsc":"=a"(lo),"=d"(hi)); return ((unsigned long long)hi << 32) | lo; }
+
+void user_exit(void)
+{
+	for (;;) syscall3(SYS_EXIT, 0, 0, 0);
+}
+
+static void prog_hello(void)
+{
+	static const char msg[] = "written from ring 3\n";
+	char buf[64];
+	unsigned cs;
+	int n;
+
+	__asm__ volatile("movw %%cs, %w0" : "=r"(cs));
+	u_puts("Hello from CPL ");u_putint(cs & 3);
+	u_puts(sys_fast ? " (SYSENTER)\n" : " (INT 0x80)\n");
+	n = syscall3(SYS_FWRITE, (unsigned)"user.txt", (unsigned)msg, sizeof(msg) - 1);
+	if (n < 0) { u_puts("write failed\n"); return; }
+	n = syscall3(SYS_FREAD, (unsigned)"user.txt", (unsigned)buf, sizeof(buf) - 1);
+	if (n < 0) { u_puts("read failed\n"); return; }
+	buf[n] = 0;
+	u_puts("user.txt: ");u_puts(buf);
+	u_puts("Sleeping 500 ms... ");
+	syscall3(SYS_SLEEP, 500, 0, 0);
+	u_puts("done.\n");
+}
+
+/* Privileged instructions fault at CPL 3: the kernel kills the task */
+static void prog_fault(void)
+{
+	u_puts("Executing CLI at CPL 3...\n");
+	__asm__ volatile("cli");
+	u_puts("not reached\n");
+}
+
+static void prog_echo(void)
+{
+	char c;
+	u_puts("Type a line:\n");
+	do {
+		c = (char)syscall3(SYS_GETC, 0, 0, 0);
+		syscall3(SYS_WRITE, (unsigned)&c, 1, 0);
+	} while (c != '\n');
+}
+
+/* Null system call round trip through each entry mechanism */
+#define SYSBENCH_N 20000
+
+static void sysbench_line(const char *name, unsigned long long t)
+{
+	unsigned sh;
+	for (sh = 0; t >> 32; sh++) t >>= 1;    /* no 64-bit divide here */
+	u_puts("BENCH name=");u_puts(name);
+	u_puts(" cycles=");u_putint(((unsigned)t / SYSBENCH_N) << sh);u_puts("\n");
+}
+
+static void prog_sysbench(void)
+{
+	unsigned long long t;
+	int i;
+
+	t = u_rdtsc();
+	for (i = 0; i < SYSBENCH_N; i++) sys_int80(SYS_NULL, 0, 0, 0);
+	sysbench_line("syscall_int80", u_rdtsc() - t);
+	if (!sys_fast) { u_puts("No SYSENTER on this CPU.\n"); return; }
+	t = u_rdtsc();
+	for (i = 0; i < SYSBENCH_N; i++) sys_sysenter(SYS_NULL, 0, 0, 0);
+	sysbench_line("syscall_sysenter", u_rdtsc() - t);
+}
+
+const struct user_prog user_progs[] = {
+	{ "hello",    "console, file and sleep calls", prog_hello },
+	{ "echo",     "read a line with SYS_GETC",     prog_echo },
+	{ "fault",    "CLI at CPL 3 (gets killed)",    prog_fault },
+	{ "sysbench", "null syscall: INT 0x80 vs SYSENTER", prog_sysbench },
+};
+const int user_nprogs = sizeof(user_progs) / sizeof(user_progs[0]);
@@ -0,0 +1,647 @@
+/*
+ * chocola kernel — paging and demand-paged ELF programs
+ *
+ * Free frames form a list threaded through the frames themselves, which
+ * the kernel half maps 1:1. vm_lock covers every user page table and the
+ * page cache, so a fault never races the exec or exit of a process that
+ * shares its pages. Faults are served with interrupts off, like the
+ * polled disk reads that fill them.
+ */
+#include "kernel/vm.h"
+#include "kernel/hal.h"
+#include "kernel/heap.h"
+#include "kernel/string.h"
+
+#define PG_P       0x001
+#define PG_W       0x002
+#define PG_U       0x004
+#define PG_PWT     0x008
+#define PG_PCD     0x010
+#define PG_D       0x040                /* dirty: set by the CPU on a write */
+#define PG_PS      0x080                /* 4MB page (PDE) */
+#define PG_CACHED  0x200                /* available bit: the frame belongs to the page cache */
+#define VMA_FIXED  8                    /* kernel/user.c's image: mapped 1:1, never paged or freed */
+#define PAGE_MASK  (PAGE_SIZE - 1)
+
+#define PCACHE_SIZE 256
+#define VM_MAXARGS  8
+#define VM_MMAP_BASE 0x80000000u        /* mmap places files from here up */
+
+/* The page cache: file pages by (file, page offset), as the file has them
+ * with zeros past its end. exec, mmap and SYS_READ all go through it;
+ * entries nobody maps any more stay until their frame is needed. */
+struct pcache_ent {
+	unsigned start, size, off;      /* file's first sector and size, page offset */
+	unsigned frame;                 /* 0: slot unused */
+	int refs;
+	int stale;                      /* file deleted or replaced: free when unmapped */
+};
+
+struct elf_ehdr {
+	unsigned char ident[16];
+	unsigned short type, machine;
+	unsigned version, entry, phoff, shoff, flags;
+	unsigned short ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct elf_phdr { unsigned type, offset, vaddr, paddr, filesz, memsz, flags, align; };
+
+#define PT_LOAD 1
+#define PF_W    2
+
+int vm_on;
+static unsigned *kernel_pd;
+static spinlock_t frame_lock, vm_lock;
+static unsigned frame_head, frames_free, frames_total;
+static struct pcache_ent *pcache;       /* PCACHE_SIZE entries from the heap, off the image's bss */
+static int pcache_n;                    /* 0 until vm_init has allocated them */
+
+static inline unsigned long long vm_rdtsc(void)
+{ unsigned lo, hi; __asm__ volatile("rdtsc":"=a"(lo),"=d"(hi)); return ((unsigned long long)hi << 32) | lo; }
+
+/* ---- Frames ---- */
+
+unsigned frame_alloc(void)
+{
+	unsigned f = spin_lock_irqsave(&frame_lock), pa = frame_head;
+	if (pa) { frame_head = *(unsigned *)pa; frames_free--; }
+	spin_unlock_irqrestore(&frame_lock, f);
+	return pa;
+}
+
+void frame_free(unsigned pa)
+{
+	unsigned f = spin_lock_irqsave(&frame_lock);
+	*(unsigned *)pa = frame_head; frame_head = pa; frames_free++;
+	spin_unlock_irqrestore(&frame_lock, f);
+}
+
+static void frames_add(unsigned lo, unsigned hi)
+{
+	lo = (lo + PAGE_MASK) & ~PAGE_MASK;
+	if (lo < VM_FRAMES_START) lo = VM_FRAMES_START;
+	if (hi > USER_BASE) hi = USER_BASE;
+	for (; lo < hi && hi - lo >= PAGE_SIZE; lo += PAGE_SIZE) { frame_free(lo); frames_total++; }
+}
+
+void vm_stats(unsigned *free, unsigned *total, unsigned *cached)
+{
+	int i;
+	*free = frames_free; *total = frames_total; *cached = 0;
+	for (i = 0; i < pcache_n; i++) if (pcache[i].frame) ++*cached;
+}
+
+/* ---- Page cache (vm_lock held unless noted) ---- */
+
+static void pcache_drop(struct pcache_ent *p) { frame_free(p->frame); p->frame = 0; }
+
+static int pcache_evict(void)
+{
+	int i;
+	for (i = 0; i < pcache_n; i++)
+		if (pcache[i].frame && !pcache[i].refs) { pcache_drop(&pcache[i]); return 1; }
+	return 0;
+}
+
+/* A frame, taking one back from the page cache if the free list is empty */
+static unsigned vm_frame(void)
+{
+	unsigned pa;
+	while (!(pa = frame_alloc()) && pcache_evict());
+	return pa;
+}
+
+/* Page off of the file with a reference taken, read from the disk on a
+ * miss (*disk set); 0 if neither a slot nor a frame is free */
+static struct pcache_ent *pcache_get(unsigned start, unsigned size, unsigned off, int *disk)
+{
+	struct pcache_ent *p, *slot = 0;
+	unsigned n;
+	int k;
+	for (k = 0; k < pcache_n; k++) {
+		p = &pcache[k];
+		if (p->frame && !p->stale && p->start == start && p->size == size && p->off == off) {
+			p->refs++;
+			return p;
+		}
+		if (!slot && !p->frame) slot = p;
+	}
+	if (!slot) return pcache_evict() ? pcache_get(start, size, off, disk) : 0;
+	if (!(slot->frame = vm_frame())) return 0;
+	n = size - off < PAGE_SIZE ? size - off : PAGE_SIZE;
+	hal_read_sectors(start + off / 512, (n + 511) / 512, (void *)slot->frame);
+	memset((unsigned char *)slot->frame + n, 0, PAGE_SIZE - n);
+	slot->start = start; slot->size = size; slot->off = off;
+	slot->refs = 1; slot->stale = 0;
+	*disk = 1;
+	return slot;
+}
+
+static void pcache_put(struct pcache_ent *p)
+{
+	if (--p->refs == 0 && p->stale) pcache_drop(p);
+}
+
+static struct pcache_ent *pcache_of(unsigned frame)
+{
+	int i;
+	for (i = 0; i < pcache_n; i++)
+		if (pcache[i].frame == frame) return &pcache[i];
+	return 0;
+}
+
+/* Write a dirty page back over the file's sectors; the file cannot grow */
+static void pcache_writeback(const struct pcache_ent *p)
+{
+	unsigned n = p->size - p->off < PAGE_SIZE ? p->size - p->off : PAGE_SIZE;
+	if (p->stale) return;
+	hal_write_sectors(p->start + p->off / 512, (n + 511) / 512, (const void *)p->frame);
+}
+
+void vm_forget(unsigned start)
+{
+	unsigned f = spin_lock_irqsave(&vm_lock);
+	int i;
+	for (i = 0; i < pcache_n; i++)
+		if (pcache[i].frame && pcache[i].start == start) {
+			if (pcache[i].refs) pcache[i].stale = 1;
+			else pcache_drop(&pcache[i]);
+		}
+	spin_unlock_irqrestore(&vm_lock, f);
+}
+
+/* Called without vm_lock: the kernel's own zero-copy view of a file page */
+unsigned vm_page_get(const struct fs_entry *e, unsigned off)
+{
+	struct pcache_ent *p;
+	unsigned f;
+	int disk = 0;
+	if (off >= e->size) return 0;
+	f = spin_lock_irqsave(&vm_lock);
+	p = pcache_get(e->start, e->size, off & ~PAGE_MASK, &disk);
+	spin_unlock_irqrestore(&vm_lock, f);
+	return p ? p->frame : 0;
+}
+
+void vm_page_put(unsigned frame)
+{
+	unsigned f = spin_lock_irqsave(&vm_lock);
+	struct pcache_ent *p = pcache_of(frame);
+	if (p) pcache_put(p);
+	spin_unlock_irqrestore(&vm_lock, f);
+}
+
+/* The copy happens outside vm_lock: buf may be user memory that faults */
+unsigned vm_file_read(const struct fs_entry *e, unsigned off, void *buf, unsigned n)
+{
+	unsigned char *d = buf;
+	unsigned done = 0, o, tp, pa;
+	if (off >= e->size) return 0;
+	if (n > e->size - off) n = e->size - off;
+	while (done < n) {
+		o = (off + done) & PAGE_MASK;
+		tp = PAGE_SIZE - o; if (tp > n - done) tp = n - done;
+		if ((pa = vm_page_get(e, off + done)) != 0) {
+			memcpy(d + done, (const unsigned char *)pa + o, tp);
+			vm_page_put(pa);
+		} else if (fs_read(e, off + done, d + done, tp) != tp)
+			break;
+		done += tp;
+	}
+	return done;
+}
+
+/* ---- Paging ---- */
+
+int vm_init(void)
+{
+	unsigned short n = *(volatile unsigned short *)0x500;
+	const struct e820_entry *e = (const struct e820_entry *)0x504;
+	unsigned a, b, c, d, i, va;
+
+	/* Frames back the page cache even without paging */
+	if (!(pcache = (struct pcache_ent *)kzalloc(PCACHE_SIZE * sizeof(*pcache)))) return 0;
+	pcache_n = PCACHE_SIZE;
+	for (i = 0; i < n && i < 20; i++)
+		if (e[i].type == 1 && !e[i].bhi)
+			frames_add(e[i].blo, e[i].lhi || e[i].blo + e[i].llo < e[i].blo ? 0xFFFFFFFFu : e[i].blo + e[i].llo);
+	__asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+	if (!(d & (1u << 3))) return 0;                         /* PSE */
+	if (!(kernel_pd = (unsigned *)frame_alloc())) return 0;
+	/* Supervisor only: ring 3 sees nothing here. Every address space
+	 * shares these PDEs apart from its own user range. */
+	for (i = 0; i < 1024; i++) {
+		va = i << 22;
+		if (va < USER_BASE) kernel_pd[i] = va | PG_PS | PG_W | PG_P;
+		else if (va >= USER_TOP) kernel_pd[i] = va | PG_PS | PG_PCD | PG_PWT | PG_W | PG_P;
+		else kernel_pd[i] = 0;
+	}
+	vm_on = 1;
+	vm_cpu_init();
+	return 1;
+}
+
+void vm_cpu_init(void)
+{
+	unsigned cr;
+	if (!vm_on) return;
+	__asm__ volatile("movl %%cr4,%0" : "=r"(cr));
+	__asm__ volatile("movl %0,%%cr4" :: "r"(cr | 0x10));   /* PSE */
+	__asm__ volatile("movl %0,%%cr3" :: "r"(kernel_pd));
+	__asm__ volatile("movl %%cr0,%0" : "=r"(cr));
+	/* PG, and WP so the kernel cannot write through to shared read-only pages */
+	__asm__ volatile("movl %0,%%cr0" :: "r"(cr | 0x80010000u) : "memory");
+}
+
+void vm_switch(struct mm *mm)
+{
+	unsigned pd, cr3;
+	if (!vm_on) return;
+	pd = (unsigned)(mm ? mm->pd : kernel_pd);
+	__asm__ volatile("movl %%cr3,%0" : "=r"(cr3));
+	if (cr3 != pd) __asm__ volatile("movl %0,%%cr3" :: "r"(pd) : "memory");
+}
+
+/* PTE for va, allocating its page table if needed */
+static unsigned *vm_pte(unsigned *pd, unsigned va)
+{
+	unsigned *pde = &pd[va >> 22], *pt;
+	if (!(*pde & PG_P)) {
+		if (!(pt = (unsigned *)vm_frame())) return 0;
+		memset(pt, 0, PAGE_SIZE);
+		*pde = (unsigned)pt | PG_U | PG_W | PG_P;
+	}
+	pt = (unsigned *)(*pde & ~PAGE_MASK);
+	return &pt[(va >> 12) & 1023];
+}
+
+static const struct vma *vm_find(const struct mm *mm, unsigned va)
+{
+	int i;
+	for (i = 0; i < mm->nvma; i++)
+		if (va >= mm->vma[i].start && va < mm->vma[i].end) return &mm->vma[i];
+	return 0;
+}
+
+/* Private page va of v: the file's bytes in [data, data_end), zeros
+ * elsewhere. Copied from the page cache, or read directly if it is full. */
+static void vm_fill(struct mm *mm, const struct vma *v, unsigned va, unsigned char *pg)
+{
+	unsigned fo = v->off + (va - v->start), lo, hi, s;
+	struct pcache_ent *p;
+	int disk = 0;
+	lo = v->data > va ? v->data - va : 0;
+	hi = v->data_end > va ? v->data_end - va : 0;
+	if (lo > PAGE_SIZE) lo = PAGE_SIZE;
+	if (hi > PAGE_SIZE) hi = PAGE_SIZE;
+	if (lo >= hi) { memset(pg, 0, PAGE_SIZE); mm->pf_zero++; return; }
+	if ((p = pcache_get(v->fstart, v->fsize, fo, &disk)) != 0) {
+		memcpy(pg + lo, (const unsigned char *)p->frame + lo, hi - lo);
+		pcache_put(p);
+	} else {
+		s = lo & ~511u;
+		hal_read_sectors(v->fstart + (fo + s) / 512, (hi - s + 511) / 512, pg + s);
+		disk = 1;
+	}
+	memset(pg, 0, lo);
+	memset(pg + hi, 0, PAGE_SIZE - hi);
+	if (disk) mm->pf_read++; else mm->pf_cached++;
+}
+
+/* Map page va of v (vm_lock held); returns the frame or 0 when out of memory.
+ * mmap'd pages and read-only program pages whose tail is the file's own
+ * are the cache's frames themselves, shared by everyone mapping them. */
+static unsigned vm_page_in(struct mm *mm, const struct vma *v, unsigned va)
+{
+	unsigned *pte = vm_pte(mm->pd, va), pa, flags = PG_U | PG_P, fo;
+	struct pcache_ent *p;
+	int disk = 0;
+	if (!pte) return 0;
+	if (*pte & PG_P) return *pte & ~PAGE_MASK;
+	fo = v->off + (va - v->start);
+	if ((v->flags & VMA_SHARED)
+	    || ((v->flags & (VMA_FILE | VMA_WRITE)) == VMA_FILE && va >= v->data && fo < v->fsize
+	        && (va + PAGE_SIZE <= v->data_end || v->data_end - v->start + v->off >= v->fsize))) {
+		if (!(p = pcache_get(v->fstart, v->fsize, fo, &disk))) return 0;
+		pa = p->frame;
+		flags |= PG_CACHED | (v->flags & VMA_WRITE ? PG_W : 0);
+		if (disk) mm->pf_read++; else mm->pf_shared++;
+	} else {
+		if (!(pa = vm_frame())) return 0;
+		vm_fill(mm, v, va, (unsigned char *)pa);
+		if (v->flags & VMA_WRITE) flags |= PG_W;
+	}
+	*pte = pa | flags;
+	return pa;
+}
+
+int vm_fault(struct mm *mm, unsigned addr, unsigned err)
+{
+	const struct vma *v = vm_find(mm, addr);
+	unsigned long long t0 = vm_rdtsc();
+	unsigned f, pa;
+	/* err bit 0: protection violation on a present page, bit 1: write */
+	if (!v || (v->flags & VMA_FIXED) || (err & 1) || ((err & 2) && !(v->flags & VMA_WRITE))) return 0;
+	f = spin_lock_irqsave(&vm_lock);
+	pa = vm_page_in(mm, v, addr & ~PAGE_MASK);
+	spin_unlock_irqrestore(&vm_lock, f);
+	mm->pf_cycles += vm_rdtsc() - t0;
+	return pa != 0;
+}
+
+int vm_user_ok(struct mm *mm, unsigned p, unsigned n, int write)
+{
+	const struct vma *v = vm_find(mm, p);
+	return v && p + n >= p && p + n <= v->end && (!write || (v->flags & VMA_WRITE));
+}
+
+static struct vma *vm_add(struct mm *mm, unsigned start, unsigned end, unsigned flags,
+                          unsigned off, unsigned data, unsigned data_end)
+{
+	struct vma *v;
+	int i;
+	if (mm->nvma == VM_VMAS) return 0;
+	for (i = 0; i < mm->nvma; i++)
+		if (start < mm->vma[i].end && end > mm->vma[i].start) return 0;
+	v = &mm->vma[mm->nvma++];
+	v->start = start; v->end = end; v->flags = flags;
+	v->off = off; v->data = data; v->data_end = data_end;
+	v->fstart = mm->file.start; v->fsize = mm->file.size;
+	return v;
+}
+
+/* Drop the mapping of every page in v (vm_lock held), writing dirty
+ * shared pages back first; returns how many were written */
+static unsigned vm_unmap(struct mm *mm, const struct vma *v, int flush)
+{
+	unsigned va, *pde, *pte, wb = 0;
+	struct pcache_ent *p;
+	if (v->flags & VMA_FIXED) return 0;
+	for (va = v->start; va < v->end; va += PAGE_SIZE) {
+		pde = &mm->pd[va >> 22];
+		if (!(*pde & PG_P)) { va |= (1u << 22) - PAGE_SIZE; continue; }   /* skip the whole table */
+		pte = &((unsigned *)(*pde & ~PAGE_MASK))[(va >> 12) & 1023];
+		if (!(*pte & PG_P)) continue;
+		if (!(*pte & PG_CACHED) || !(p = pcache_of(*pte & ~PAGE_MASK))) frame_free(*pte & ~PAGE_MASK);
+		else {
+			if (*pte & PG_D) { pcache_writeback(p); wb++; }
+			pcache_put(p);
+		}
+		*pte = 0;
+		if (flush) __asm__ volatile("invlpg (%0)" :: "r"(va) : "memory");
+	}
+	return wb;
+}
+
+/* ---- mmap ---- */
+
+/* Map all of file e shared at the lowest free address from VM_MMAP_BASE */
+int vm_mmap(struct mm *mm, const struct fs_entry *e, int write, unsigned *addr)
+{
+	unsigned len = (e->size + PAGE_MASK) & ~PAGE_MASK, a = VM_MMAP_BASE, f;
+	struct vma *v = 0;
+	int i;
+	if (!len) return VM_EINVAL;
+	f = spin_lock_irqsave(&vm_lock);
+	for (i = 0; i < mm->nvma; i++)
+		if (a < mm->vma[i].end && a + len > mm->vma[i].start) { a = mm->vma[i].end; i = -1; }
+	if (a <= USER_TOP - VM_STACK_SIZE && len <= USER_TOP - VM_STACK_SIZE - a
+	    && (v = vm_add(mm, a, a + len, VMA_FILE | VMA_SHARED | (write ? VMA_WRITE : 0), 0, a, a + e->size)) != 0) {
+		v->fstart = e->start; v->fsize = e->size;
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	if (!v) return VM_ENOMEM;
+	*addr = a;
+	return 0;
+}
+
+static struct vma *vm_mapping(struct mm *mm, unsigned addr)
+{
+	struct vma *v = (struct vma *)vm_find(mm, addr);
+	return v && (v->flags & VMA_SHARED) && v->start == addr ? v : 0;
+}
+
+/* mm is the running address space: the TLB entries go with the PTEs */
+int vm_msync(struct mm *mm, unsigned addr)
+{
+	struct vma *v;
+	struct pcache_ent *p;
+	unsigned f = spin_lock_irqsave(&vm_lock), va, *pde, *pte;
+	int wb = VM_EINVAL;
+	if ((v = vm_mapping(mm, addr)) != 0)
+		for (va = v->start, wb = 0; va < v->end; va += PAGE_SIZE) {
+			pde = &mm->pd[va >> 22];
+			if (!(*pde & PG_P)) continue;
+			pte = &((unsigned *)(*pde & ~PAGE_MASK))[(va >> 12) & 1023];
+			if ((*pte & (PG_P | PG_D | PG_CACHED)) != (PG_P | PG_D | PG_CACHED)) continue;
+			if ((p = pcache_of(*pte & ~PAGE_MASK)) != 0) { pcache_writeback(p); wb++; }
+			*pte &= ~PG_D;
+			__asm__ volatile("invlpg (%0)" :: "r"(va) : "memory");
+		}
+	spin_unlock_irqrestore(&vm_lock, f);
+	if (wb > 0) hal_flush();
+	mm->wb_pages += wb > 0 ? (unsigned)wb : 0;
+	return wb;
+}
+
+int vm_munmap(struct mm *mm, unsigned addr)
+{
+	struct vma *v;
+	unsigned f = spin_lock_irqsave(&vm_lock);
+	int wb = VM_EINVAL;
+	if ((v = vm_mapping(mm, addr)) != 0) {
+		wb = (int)vm_unmap(mm, v, 1);
+		*v = mm->vma[--mm->nvma];
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	mm->wb_pages += wb > 0 ? (unsigned)wb : 0;
+	return wb;
+}
+
+/* ---- Page transfer ---- */
+
+/* The n pages at va of a private writable mapping (vm_lock held) */
+static const struct vma *vm_private(struct mm *mm, unsigned va, unsigned n)
+{
+	const struct vma *v = vm_find(mm, va);
+	return v && !(va & PAGE_MASK) && n <= (v->end - va) / PAGE_SIZE
+	       && (v->flags & (VMA_WRITE | VMA_SHARED)) == VMA_WRITE ? v : 0;
+}
+
+/* Unmap the n pages at va into frames[], paging in any not yet touched.
+ * mm is the running address space. */
+int vm_take(struct mm *mm, unsigned va, unsigned n, unsigned *frames)
+{
+	const struct vma *v;
+	unsigned f = spin_lock_irqsave(&vm_lock), i, *pte;
+	int r = VM_EINVAL;
+	if ((v = vm_private(mm, va, n)) != 0) {
+		for (i = 0, r = 0; i < n && r == 0; i++)
+			if (!vm_page_in(mm, v, va + i * PAGE_SIZE)) r = VM_ENOMEM;
+		for (i = 0; i < n && r == 0; i++) {
+			pte = vm_pte(mm->pd, va + i * PAGE_SIZE);
+			frames[i] = *pte & ~PAGE_MASK;
+			*pte = 0;
+			__asm__ volatile("invlpg (%0)" :: "r"(va + i * PAGE_SIZE) : "memory");
+		}
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	return r;
+}
+
+/* Map frames[] at va in place of whatever was there */
+int vm_give(struct mm *mm, unsigned va, unsigned n, const unsigned *frames)
+{
+	unsigned f = spin_lock_irqsave(&vm_lock), i, *pte;
+	int r = VM_EINVAL;
+	if (vm_private(mm, va, n)) {
+		for (i = 0, r = 0; i < n && r == 0; i++)
+			if (!vm_pte(mm->pd, va + i * PAGE_SIZE)) r = VM_ENOMEM;
+		for (i = 0; i < n && r == 0; i++) {
+			pte = vm_pte(mm->pd, va + i * PAGE_SIZE);
+			if (*pte & PG_P) frame_free(*pte & ~PAGE_MASK);
+			*pte = frames[i] | PG_U | PG_W | PG_P;
+			__asm__ volatile("invlpg (%0)" :: "r"(va + i * PAGE_SIZE) : "memory");
+		}
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	return r;
+}
+
+/* ---- exec ---- */
+
+static unsigned vm_push(unsigned char *pg, unsigned *top, const char *s, unsigned n)
+{
+	*top -= n + 1;
+	memcpy(pg + *top, s, n);
+	pg[*top + n] = 0;
+	return USER_TOP - PAGE_SIZE + *top;
+}
+
+/* argc, argv[] and the strings at the top of the first stack page, laid
+ * out as the i386 System V ABI has them at _start */
+static unsigned vm_args(unsigned pa, const char *file, const char *args)
+{
+	unsigned char *pg = (unsigned char *)pa;
+	unsigned top = PAGE_SIZE, argv[VM_MAXARGS], *w, n;
+	int argc = 0;
+
+	for (n = 0; file[n]; n++);
+	argv[argc++] = vm_push(pg, &top, file, n);
+	for (; argc < VM_MAXARGS; args += n) {
+		while (*args == ' ') args++;
+		if (!*args) break;
+		for (n = 0; args[n] && args[n] != ' '; n++);
+		argv[argc++] = vm_push(pg, &top, args, n);
+	}
+	w = (unsigned *)(pg + (top & ~15u));
+	*--w = 0;
+	for (n = (unsigned)argc; n > 0; n--) *--w = argv[n - 1];
+	*--w = (unsigned)argc;
+	return USER_TOP - PAGE_SIZE + (unsigned)((unsigned char *)w - pg);
+}
+
+int vm_exec(const char *file, const char *args, struct mm **out, unsigned *entry, unsigned *sp)
+{
+	struct elf_ehdr eh;
+	struct elf_phdr ph[VM_VMAS - 1], *p;
+	const struct vma *v;
+	struct mm *mm;
+	unsigned f, i, pa = 0, sz;
+	int r;
+
+	if (!(mm = (struct mm *)kzalloc(sizeof(*mm)))) return VM_ENOMEM;
+	if ((r = fs_find(file, &mm->file)) < 0) goto fail;
+
+	r = VM_ENOEXEC;
+	if (!vm_on || vm_file_read(&mm->file, 0, &eh, sizeof(eh)) != sizeof(eh)) goto fail;
+	if (eh.ident[0] != 0x7F || eh.ident[1] != 'E' || eh.ident[2] != 'L' || eh.ident[3] != 'F'
+	    || eh.ident[4] != 1 || eh.ident[5] != 1 || eh.type != 2 || eh.machine != 3
+	    || eh.phentsize != sizeof(ph[0]) || !eh.phnum || eh.phnum > VM_VMAS - 1) goto fail;
+	sz = eh.phnum * sizeof(ph[0]);
+	if (vm_file_read(&mm->file, eh.phoff, ph, sz) != sz) goto fail;
+	for (i = 0; i < eh.phnum; i++) {
+		p = &ph[i];
+		if (p->type != PT_LOAD || !p->memsz) continue;
+		if (p->filesz > p->memsz || p->vaddr < USER_BASE || p->vaddr >= USER_TOP - VM_STACK_SIZE
+		    || p->memsz > USER_TOP - VM_STACK_SIZE - p->vaddr || ((p->offset ^ p->vaddr) & PAGE_MASK) || p->filesz > mm->file.size
+		    || p->offset > mm->file.size - p->filesz) goto fail;
+		if (!vm_add(mm, p->vaddr & ~PAGE_MASK, (p->vaddr + p->memsz + PAGE_MASK) & ~PAGE_MASK,
+		            VMA_FILE | (p->flags & PF_W ? VMA_WRITE : 0), p->offset & ~PAGE_MASK,
+		            p->vaddr, p->vaddr + p->filesz)) goto fail;
+	}
+	if (!vm_find(mm, eh.entry) || !(v = vm_add(mm, USER_TOP - VM_STACK_SIZE, USER_TOP, VMA_WRITE, 0, 0, 0)))
+		goto fail;
+
+	/* Nothing of the file is read yet; only the stack page for argv */
+	r = VM_ENOMEM;
+	f = spin_lock_irqsave(&vm_lock);
+	if ((mm->pd = (unsigned *)vm_frame()) != 0) {
+		for (i = 0; i < 1024; i++)
+			mm->pd[i] = i < USER_BASE >> 22 || i >= USER_TOP >> 22 ? kernel_pd[i] : 0;
+		pa = vm_page_in(mm, v, USER_TOP - PAGE_SIZE);
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	if (!pa) goto fail;
+	*sp = vm_args(pa, mm->file.name, args);
+	*entry = eh.entry;
+	*out = mm;
+	return 0;
+fail:
+	vm_release(mm);
+	return r;
+}
+
+/* A kernel/user.c program: its own directory where the low 4MB is split
+ * into pages so that only [_user_start, _user_end) is open to ring 3
+ * (read-only), plus a demand-zero stack below USER_TOP that starts
+ * with the return address ret. */
+int vm_builtin(unsigned ret, struct mm **out, unsigned *sp)
+{
+	unsigned f, i, pa = 0, *pt;
+	struct mm *mm;
+	const struct vma *img, *stk;
+	if (!(mm = (struct mm *)kzalloc(sizeof(*mm)))) return VM_ENOMEM;
+	if (!(img = vm_add(mm, (unsigned)_user_start & ~PAGE_MASK, ((unsigned)_user_end + PAGE_MASK) & ~PAGE_MASK,
+	                   VMA_FIXED, 0, 0, 0))
+	    || !(stk = vm_add(mm, USER_TOP - VM_STACK_SIZE, USER_TOP, VMA_WRITE, 0, 0, 0))) {
+		vm_release(mm);
+		return VM_ENOMEM;
+	}
+	f = spin_lock_irqsave(&vm_lock);
+	if ((mm->pd = (unsigned *)vm_frame()) != 0) {
+		for (i = 0; i < 1024; i++) mm->pd[i] = i < USER_TOP >> 22 ? 0 : kernel_pd[i];
+		if ((pt = (unsigned *)vm_frame()) != 0) {
+			for (i = 1; i < USER_BASE >> 22; i++) mm->pd[i] = kernel_pd[i];
+			for (i = 0; i < 1024; i++) pt[i] = i << 12 | PG_W | PG_P;
+			for (i = img->start; i < img->end; i += PAGE_SIZE) pt[i >> 12] = i | PG_U | PG_P;
+			mm->pd[0] = (unsigned)pt | PG_U | PG_W | PG_P;
+			pa = vm_page_in(mm, stk, USER_TOP - PAGE_SIZE);
+		}
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	if (!pa) { vm_release(mm); return VM_ENOMEM; }
+	*(unsigned *)(pa + PAGE_SIZE - 4) = ret;
+	*sp = USER_TOP - 4;
+	*out = mm;
+	return 0;
+}
+
+/* mm is no longer loaded anywhere, so no TLB to flush */
+unsigned vm_release(struct mm *mm)
+{
+	unsigned f, i, wb;
+	if (!mm) return 0;
+	f = spin_lock_irqsave(&vm_lock);
+	if (mm->pd) {
+		for (i = 0; i < (unsigned)mm->nvma; i++) mm->wb_pages += vm_unmap(mm, &mm->vma[i], 0);
+		for (i = USER_BASE >> 22; i < USER_TOP >> 22; i++)
+			if (mm->pd[i] & PG_P) frame_free(mm->pd[i] & ~PAGE_MASK);
+		if ((mm->pd[0] & PG_P) && !(mm->pd[0] & PG_PS)) frame_free(mm->pd[0] & ~PAGE_MASK);   /* vm_builtin */
+		frame_free((unsigned)mm->pd);
+	}
+	spin_unlock_irqrestore(&vm_lock, f);
+	wb = mm->wb_pages;
+	kfree(mm);
+	return wb;
+}
@@ -0,0 +1,104 @@
+/*
+ * chocola kernel — paging, physical frames and exec'd address spaces (kernel/vm.c)
+ *
+ * The kernel half (everything below USER_BASE and the MMIO hole from
+ * USER_TOP up) is identity mapped with 4MB pages in every page
+ * directory. Programs started by 'exec' get USER_BASE..USER_TOP: their
+ * ELF segments are only described at exec time and paged in from the
+ * file by vm_fault(). All file data goes through one page cache: exec'd
+ * read-only pages and mmap'd files map its frames directly, SYS_READ and
+ * the shell copy out of it, and dirty mmap'd pages are written back to
+ * the file on msync or unmap.
+ */
+#ifndef CHOCOLA_VM_H
+#define CHOCOLA_VM_H
+
+#include "kernel/fs.h"
+
+#define PAGE_SIZE       4096
+#define USER_BASE       0x40000000u
+#define USER_TOP        0xC0000000u
+#define VM_STACK_SIZE   0x10000         /* below USER_TOP, zero-filled on demand */
+#define VM_FRAMES_START 0x400000        /* frames come from RAM above the kernel heap */
+#define VM_VMAS         16
+
+#define VM_ENOEXEC      (-8)            /* not an ELF32 i386 executable we can map */
+#define VM_ENOMEM       (-12)
+#define VM_EINVAL       (-22)
+
+#define VMA_WRITE       1
+#define VMA_FILE        2
+#define VMA_SHARED      4               /* mmap: the page cache's frames, written back when dirty */
+
+struct e820_entry { unsigned int blo,bhi,llo,lhi,type,acpi; } __attribute__((packed));
+
+struct vma {
+	unsigned start, end;            /* page-aligned */
+	unsigned flags;
+	unsigned off;                   /* file offset of 'start', page-aligned */
+	unsigned data, data_end;        /* bytes backed by the file; the rest reads as zero */
+	unsigned fstart, fsize;         /* the file: first sector and size */
+};
+
+struct mm {
+	unsigned *pd;                   /* page directory (physical = virtual) */
+	struct fs_entry file;           /* the program */
+	struct vma vma[VM_VMAS];
+	int nvma;
+	/* Page faults by how they were satisfied: read from the disk, mapped
+	 * or copied from the page cache, zero-filled */
+	unsigned pf_read, pf_shared, pf_cached, pf_zero;
+	unsigned long long pf_cycles;
+	unsigned wb_pages;              /* dirty mmap'd pages written back */
+};
+
+extern int vm_on;                       /* paging enabled (needs PSE) */
+
+int  vm_init(void);                     /* BSP, before the APs: 0 if the CPU has no PSE */
+void vm_cpu_init(void);                 /* each AP */
+void vm_switch(struct mm *mm);          /* load mm's page directory, or the kernel's for 0 */
+
+unsigned frame_alloc(void);             /* a free 4KB frame, 0 if none */
+void frame_free(unsigned pa);
+void vm_stats(unsigned *free, unsigned *total, unsigned *cached);
+
+/* Map FILE for execution with argv = FILE plus the words of args.
+ * Returns 0 or FS_ENOENT / VM_ENOEXEC / VM_ENOMEM. */
+int  vm_exec(const char *file, const char *args, struct mm **out, unsigned *entry, unsigned *sp);
+
+/* An address space for a program linked into the kernel (kernel/user.c,
+ * copied to _user_start at boot): 0 or VM_ENOMEM */
+extern char _user_start[], _user_end[];
+int  vm_builtin(unsigned ret, struct mm **out, unsigned *sp);
+unsigned vm_release(struct mm *mm);     /* -> pages written back over its lifetime */
+
+/* #PF at addr in mm: 1 if a page was mapped and the access can be retried */
+int  vm_fault(struct mm *mm, unsigned addr, unsigned err);
+
+/* [p, p+n) lies in mm's mappings (and is writable if write) */
+int  vm_user_ok(struct mm *mm, unsigned p, unsigned n, int write);
+
+/* The file at this start sector was deleted or replaced */
+void vm_forget(unsigned start);
+
+/* Map file e shared (and writable if write) into mm; *addr gets the
+ * address. msync/munmap take that address and return the number of
+ * pages written back, or VM_EINVAL. */
+int  vm_mmap(struct mm *mm, const struct fs_entry *e, int write, unsigned *addr);
+int  vm_msync(struct mm *mm, unsigned addr);
+int  vm_munmap(struct mm *mm, unsigned addr);
+
+/* Move whole pages between address spaces (IPC). Both need page-aligned
+ * va in a private writable mapping of the running mm. vm_take leaves the
+ * range reading as if never written; vm_give frees what it replaces.
+ * 0 or VM_EINVAL / VM_ENOMEM, with nothing changed on error. */
+int  vm_take(struct mm *mm, unsigned va, unsigned n, unsigned *frames);
+int  vm_give(struct mm *mm, unsigned va, unsigned n, const unsigned *frames);
+
+/* File reads through the page cache. vm_page_get pins the page holding
+ * byte off and returns its frame (0 past the end or out of memory). */
+unsigned vm_file_read(const struct fs_entry *e, unsigned off, void *buf, unsigned n);
+unsigned vm_page_get(const struct fs_entry *e, unsigned off);
+void vm_page_put(unsigned frame);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * chocola kernel — window compositor
+ *
+ * Damage is a short list of screen rectangles. A new one that overlaps
+ * a listed rectangle merges into it when their bounding box is no
+ * bigger than the two apart; when the list is full it joins whichever
+ * grows least. wm_composite() rebuilds each damaged rectangle a row at a
+ * time: background, then every window from the bottom of the stack up,
+ * into a line buffer that goes to the framebuffer in one span.
+ */
+#include "kernel/wm.h"
+#include "kernel/heap.h"
+#include "kernel/string.h"
+
+struct window {
+	int x, y, w, h;
+	unsigned char *pix;             /* w x h, decorations included; 0: slot free */
+	char title[24];
+};
+
+struct wm_stats wm_stats;
+
+static struct window wins[WM_MAX];
+static int zorder[WM_MAX], nz;          /* ids, bottom first */
+static struct wm_rect damage[WM_DAMAGE];
+static int ndamage;
+static const unsigned char *wm_bg;
+
+/* ---- Rectangles ---- */
+
+static int rect_clip(struct wm_rect *r)
+{
+	if (r->x < 0) { r->w += r->x; r->x = 0; }
+	if (r->y < 0) { r->h += r->y; r->y = 0; }
+	if (r->x + r->w > GFX_WIDTH) r->w = GFX_WIDTH - r->x;
+	if (r->y + r->h > WM_HEIGHT) r->h = WM_HEIGHT - r->y;
+	return r->w > 0 && r->h > 0;
+}
+
+static unsigned rect_area(const struct wm_rect *r) { return (unsigned)r->w * (unsigned)r->h; }
+
+static struct wm_rect rect_union(const struct wm_rect *a, const struct wm_rect *b)
+{
+	struct wm_rect u;
+	u.x = a->x < b->x ? a->x : b->x;
+	u.y = a->y < b->y ? a->y : b->y;
+	u.w = (a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w) - u.x;
+	u.h = (a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h) - u.y;
+	return u;
+}
+
+static int rect_overlap(const struct wm_rect *a, const struct wm_rect *b)
+{
+	return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+void wm_damage(int x, int y, int w, int h)
+{
+	struct wm_rect r, u;
+	unsigned grow, least = ~0u;
+	int i, best = 0;
+	r.x = x; r.y = y; r.w = w; r.h = h;
+	if (!rect_clip(&r)) return;
+	for (i = 0; i < ndamage; i++) {
+		u = rect_union(&damage[i], &r);
+		if (rect_overlap(&damage[i], &r) && rect_area(&u) <= rect_area(&damage[i]) + rect_area(&r)) {
+			damage[i] = u;
+			return;
+		}
+		if ((grow = rect_area(&u) - rect_area(&damage[i])) < least) { least = grow; best = i; }
+	}
+	if (ndamage < WM_DAMAGE) damage[ndamage++] = r;
+	else damage[best] = rect_union(&damage[best], &r);
+}
+
+/* ---- Windows ---- */
+
+static struct window *wm_win(int id) { return id >= 0 && id < WM_MAX && wins[id].pix ? &wins[id] : 0; }
+
+static void wm_title_bar(int id)
+{
+	struct window *w = &wins[id];
+	unsigned char c = nz && zorder[nz - 1] == id ? WM_COL_TITLE : WM_COL_IDLE;
+	const char *s;
+	int x, y, gx;
+	for (y = 0; y < WM_TITLE_H; y++) memset(w->pix + y * w->w, c, (unsigned)w->w);
+	for (s = w->title, gx = 6; *s && gx + CHAR_W <= w->w - 4; s++, gx += CHAR_W)
+		for (y = 0; y < CHAR_H; y++)
+			for (x = 0; x < CHAR_W; x++)
+				if (font[(unsigned char)*s * CHAR_H + y] & (0x80 >> x)) w->pix[(1 + y) * w->w + gx + x] = COL_FG;
+	wm_damage(w->x, w->y, w->w, WM_TITLE_H);
+}
+
+int wm_create(int x, int y, int w, int h, const char *title)
+{
+	struct window *win;
+	int id, i, top = nz ? zorder[nz - 1] : -1;
+	if (w < 48) w = 48;
+	if (h < WM_TITLE_H + 8) h = WM_TITLE_H + 8;
+	for (id = 0; id < WM_MAX && wins[id].pix; id++);
+	if (id == WM_MAX) return -1;
+	win = &wins[id];
+	if (!(win->pix = (unsigned char *)kmalloc((unsigned)(w * h)))) return -1;
+	win->x = x; win->y = y; win->w = w; win->h = h;
+	for (i = 0; i < (int)sizeof(win->title) - 1 && title[i]; i++) win->title[i] = title[i];
+	win->title[i] = 0;
+	memset(win->pix, WM_COL_FRAME, (unsigned)(w * h));
+	zorder[nz++] = id;
+	wm_title_bar(id);
+	if (top >= 0) wm_title_bar(top);
+	wm_fill(id, 0, 0, w, h, WM_COL_CLIENT);
+	wm_damage(x, y, w, h);
+	return id;
+}
+
+void wm_destroy(int id)
+{
+	struct window *w = wm_win(id);
+	int i, k;
+	if (!w) return;
+	for (i = k = 0; i < nz; i++) if (zorder[i] != id) zorder[k++] = zorder[i];
+	nz = k;
+	wm_damage(w->x, w->y, w->w, w->h);
+	kfree(w->pix);
+	w->pix = 0;
+	if (nz) wm_title_bar(zorder[nz - 1]);
+}
+
+/* The new position and whatever the old one exposes: up to four bands
+ * of the old rectangle outside the new one */
+void wm_move(int id, int x, int y)
+{
+	struct window *w = wm_win(id);
+	struct wm_rect o, n;
+	int top, bot;
+	if (!w || (x == w->x && y == w->y)) return;
+	o.x = w->x; o.y = w->y; o.w = w->w; o.h = w->h;
+	w->x = x; w->y = y;
+	n.x = x; n.y = y; n.w = w->w; n.h = w->h;
+	wm_damage(n.x, n.y, n.w, n.h);
+	if (!rect_overlap(&o, &n)) { wm_damage(o.x, o.y, o.w, o.h); return; }
+	top = n.y > o.y ? n.y : o.y;
+	bot = n.y + n.h < o.y + o.h ? n.y + n.h : o.y + o.h;
+	if (n.y > o.y) wm_damage(o.x, o.y, o.w, n.y - o.y);
+	if (bot < o.y + o.h) wm_damage(o.x, bot, o.w, o.y + o.h - bot);
+	if (n.x > o.x) wm_damage(o.x, top, n.x - o.x, bot - top);
+	if (n.x + n.w < o.x + o.w) wm_damage(n.x + n.w, top, o.x + o.w - n.x - n.w, bot - top);
+}
+
+void wm_raise(int id)
+{
+	struct window *w = wm_win(id);
+	int i, old;
+	if (!w || zorder[nz - 1] == id) return;
+	old = zorder[nz - 1];
+	for (i = 0; zorder[i] != id; i++);
+	for (; i < nz - 1; i++) zorder[i] = zorder[i + 1];
+	zorder[nz - 1] = id;
+	wm_title_bar(old);
+	wm_title_bar(id);
+	wm_damage(w->x, w->y, w->w, w->h);
+}
+
+void wm_rect(int id, struct wm_rect *r)
+{
+	struct window *w = wm_win(id);
+	if (w) { r->x = w->x; r->y = w->y; r->w = w->w; r->h = w->h; }
+}
+
+int wm_at(int x, int y)
+{
+	const struct window *w;
+	int i;
+	for (i = nz - 1; i >= 0; i--) {
+		w = &wins[zorder[i]];
+		if (x >= w->x && x < w->x + w->w && y >= w->y && y < w->y + w->h) return zorder[i];
+	}
+	return -1;
+}
+
+int wm_in_title(int id, int x, int y)
+{
+	const struct window *w = wm_win(id);
+	return w && x >= w->x && x < w->x + w->w && y >= w->y && y < w->y + WM_TITLE_H;
+}
+
+/* ---- Drawing into the client area ---- */
+
+void wm_fill(int id, int x, int y, int w, int h, unsigned char c)
+{
+	struct window *win = wm_win(id);
+	struct wm_rect r;
+	int j;
+	if (!win) return;
+	r.x = x + 1; r.y = y + WM_TITLE_H; r.w = w; r.h = h;
+	if (r.x + r.w > win->w - 1) r.w = win->w - 1 - r.x;
+	if (r.y + r.h > win->h - 1) r.h = win->h - 1 - r.y;
+	if (r.w <= 0 || r.h <= 0 || x < 0 || y < 0) return;
+	for (j = 0; j < r.h; j++) memset(win->pix + (r.y + j) * win->w + r.x, c, (unsigned)r.w);
+	wm_damage(win->x + r.x, win->y + r.y, r.w, r.h);
+}
+
+void wm_text(int id, int x, int y, const char *s, unsigned char fg, unsigned char bg)
+{
+	struct window *win = wm_win(id);
+	unsigned char *p;
+	int n, gx, j, i, px = x + 1, py = y + WM_TITLE_H;
+	if (!win || x < 0 || y < 0 || py + CHAR_H > win->h - 1) return;
+	for (n = 0; s[n] && px + (n + 1) * CHAR_W <= win->w - 1; n++)
+		for (j = 0, gx = px + n * CHAR_W; j < CHAR_H; j++) {
+			p = win->pix + (py + j) * win->w + gx;
+			for (i = 0; i < CHAR_W; i++)
+				p[i] = font[(unsigned char)s[n] * CHAR_H + j] & (0x80 >> i) ? fg : bg;
+		}
+	if (n) wm_damage(win->x + px, win->y + py, n * CHAR_W, CHAR_H);
+}
+
+/* ---- Compositing ---- */
+
+void wm_init(const unsigned char *bg)
+{
+	wm_bg = bg;
+	ndamage = 0;
+	wm_damage(0, 0, GFX_WIDTH, WM_HEIGHT);
+}
+
+void wm_exit(void)
+{
+	while (nz) wm_destroy(zorder[nz - 1]);
+}
+
+unsigned wm_composite(void)
+{
+	static unsigned char line[GFX_WIDTH];
+	const struct window *w;
+	const struct wm_rect *r;
+	unsigned px = 0;
+	int i, k, y, x0, x1;
+
+	if (!ndamage) return 0;
+	hal_scroll_enter();
+	for (i = 0; i < ndamage; i++) {
+		r = &damage[i];
+		for (y = r->y; y < r->y + r->h; y++) {
+			if (wm_bg) memcpy(line + r->x, wm_bg + y * GFX_WIDTH + r->x, (unsigned)r->w);
+			else memset(line + r->x, COL_BG, (unsigned)r->w);
+			for (k = 0; k < nz; k++) {
+				w = &wins[zorder[k]];
+				if (y < w->y || y >= w->y + w->h) continue;
+				x0 = r->x > w->x ? r->x : w->x;
+				x1 = r->x + r->w < w->x + w->w ? r->x + r->w : w->x + w->w;
+				if (x0 < x1) memcpy(line + x0, w->pix + (y - w->y) * w->w + (x0 - w->x), (unsigned)(x1 - x0));
+			}
+			fb_write_span((unsigned)(y * GFX_WIDTH + r->x), line + r->x, (unsigned)r->w);
+		}
+		px += rect_area(r);
+	}
+	hal_scroll_leave();
+	wm_stats.frames++; wm_stats.rects += (unsigned)ndamage; wm_stats.pixels += px;
+	ndamage = 0;
+	return px;
+}
@@ -0,0 +1,54 @@
+/*
+ * chocola kernel — window compositor (kernel/wm.c)
+ *
+ * Windows live above the taskbar, each in its own heap surface that
+ * includes the title bar and border. Drawing into a window, moving and
+ * raising it only record damage; wm_composite() then rebuilds the
+ * damaged parts of the screen. One task drives the WM at a time.
+ */
+#ifndef CHOCOLA_WM_H
+#define CHOCOLA_WM_H
+
+#include "kernel/console.h"
+
+#define WM_MAX          8
+#define WM_DAMAGE       16              /* rectangles kept apart before they merge */
+#define WM_TITLE_H      16
+#define WM_HEIGHT       TASKBAR_Y       /* the composited area: 0..GFX_WIDTH x 0..WM_HEIGHT */
+
+#define WM_COL_FRAME    7               /* light gray */
+#define WM_COL_TITLE    9               /* light blue: the top window */
+#define WM_COL_IDLE     8               /* dark gray: the others */
+#define WM_COL_CLIENT   0
+
+struct wm_rect { int x, y, w, h; };
+
+struct wm_stats {
+	unsigned frames, rects;         /* composites that pushed anything, damage rectangles */
+	unsigned long long pixels;      /* pixels written to the framebuffer */
+};
+
+extern struct wm_stats wm_stats;
+
+/* bg: GFX_WIDTH x WM_HEIGHT bytes shown behind the windows (0: COL_BG).
+ * The whole area starts damaged. */
+void wm_init(const unsigned char *bg);
+void wm_exit(void);                     /* destroy every window */
+
+int  wm_create(int x, int y, int w, int h, const char *title);    /* -> id on top, or -1 */
+void wm_destroy(int id);
+void wm_move(int id, int x, int y);
+void wm_raise(int id);
+void wm_rect(int id, struct wm_rect *r);
+
+int  wm_at(int x, int y);               /* topmost window under the point, or -1 */
+int  wm_in_title(int id, int x, int y);
+
+/* Draw into the client area (below the title bar, inside the border) */
+void wm_fill(int id, int x, int y, int w, int h, unsigned char c);
+void wm_text(int id, int x, int y, const char *s, unsigned char fg, unsigned char bg);
+
+void wm_damage(int x, int y, int w, int h);
+unsigned wm_composite(void);            /* -> pixels pushed, 0 if nothing was damaged */
+
+#endif
@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+"""
+ksyms.py - Generate the kernel symbol table used by the 'prof' command.
+
+Reads `nm -n kernel.elf` on stdin, writes C source to stdout:
+  const struct ksym ksyms[]    (address, name) of every 32-bit text symbol,
+                               sorted by address, followed by a {0, 0} entry
+  const unsigned ksyms_count
+
+The kernel is linked twice: first against an empty table (stdin empty),
+then against the real one. ksyms.o is the last object on the link line,
+so its data lands after all kernel code and the second link moves nothing.
+"""
+import sys
+
+TEXT_BASE = 0x80000     # 32-bit .text VMA; lower addresses are 16-bit boot code
+
+def main():
+    lines = [l.split() for l in sys.stdin]
+    # .rodata/.data share the .text output section: stop at the linker's _etext
+    etext = max([int(p[0], 16) for p in lines if len(p) == 3 and p[2] == "_etext"] or [1 << 32])
+    syms = {}
+    for parts in lines:
+        if len(parts) != 3 or parts[1] not in ("t", "T"):
+            continue
+        addr = int(parts[0], 16)
+        if addr < TEXT_BASE or addr >= etext or addr in syms or parts[2] == "_text_start":
+            continue
+        syms[addr] = parts[2]
+
+    out = sys.stdout
+    out.write("/* Generated by ksyms.py - do not edit */\n\n")
+    out.write("struct ksym { unsigned addr; const char *name; };\n\n")
+    out.write("const struct ksym ksyms[] = {\n")
+    for addr in sorted(syms):
+        out.write('\t{ 0x%08x, "%s" },\n' % (addr, syms[addr]))
+    out.write("\t{ 0, 0 }\n};\n\n")
+    out.write("const unsigned ksyms_count = %d;\n" % len(syms))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""
+lz4pack.py - Compress the 32-bit payload of kernel.bin with LZ4.
+
+Usage: lz4pack.py IN OUT [--store]
+
+IN is the objcopy output: the 16-bit loader (.text.boot) followed by the
+32-bit kernel (.text). The loader header (see loader.nas) gives the
+payload offset. OUT keeps the loader as is, replaces the payload with
+one LZ4 block, and patches the header so the IPL loads only the packed
+sectors and unpack_32 knows what to decompress:
+
+  offset  2  "MKOS"
+  offset  6  sectors to load from LBA 1
+  offset 10  payload offset (= LOADADDR(.text), set by the linker)
+  offset 14  packed payload size, 0 = stored uncompressed
+  offset 18  unpacked payload size
+
+--store writes the image uncompressed (header size 0) for comparison.
+"""
+import struct
+import sys
+
+MIN_MATCH = 4
+LAST_LITERALS = 5       # the block must end with at least 5 literals
+MF_LIMIT = 12           # no match may start in the last 12 bytes
+MAX_OFFSET = 65535
+MAX_SECTORS = 254       # ipl.nas MAX_SECTORS
+
+
+def _length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def _sequence(out, lit, offset=0, mlen=0):
+    ml = mlen - MIN_MATCH if mlen else 0
+    out.append((min(len(lit), 15) << 4) | min(ml, 15))
+    if len(lit) >= 15:
+        _length(out, len(lit) - 15)
+    out += lit
+    if mlen:
+        out += struct.pack("<H", offset)
+        if ml >= 15:
+            _length(out, ml - 15)
+
+
+def compress(src, depth=32):
+    """Greedy LZ4 block compressor: longest of the last `depth` positions
+    that share the next 4 bytes."""
+    n, out, chains = len(src), bytearray(), {}
+    anchor = i = 0
+    while i + MF_LIMIT <= n:
+        key = src[i:i + 4]
+        chain = chains.setdefault(key, [])
+        best = bestoff = 0
+        limit = n - LAST_LITERALS - i
+        for cand in reversed(chain[-depth:]):
+            if i - cand > MAX_OFFSET:
+                break
+            m = MIN_MATCH
+            while m < limit and src[cand + m] == src[i + m]:
+                m += 1
+            if m > best:
+                best, bestoff = m, i - cand
+        chain.append(i)
+        if not best:
+            i += 1
+            continue
+        _sequence(out, src[anchor:i], bestoff, best)
+        for j in range(i + 1, min(i + best, n - 3)):
+            chains.setdefault(src[j:j + 4], []).append(j)
+        i += best
+        anchor = i
+    _sequence(out, src[anchor:])
+    return bytes(out)
+
+
+def decompress(src, size):
+    out, i = bytearray(), 0
+    while i < len(src):
+        token = src[i]; i += 1
+        n = token >> 4
+        if n == 15:
+            while True:
+                b = src[i]; i += 1; n += b
+                if b != 255:
+                    break
+        out += src[i:i + n]; i += n
+        if i >= len(src):
+            break
+        off = src[i] | src[i + 1] << 8; i += 2
+        m = token & 15
+        if m == 15:
+            while True:
+                b = src[i]; i += 1; m += b
+                if b != 255:
+                    break
+        for _ in range(m + MIN_MATCH):
+            out.append(out[-off])
+    assert len(out) == size
+    return bytes(out)
+
+
+def main():
+    args = [a for a in sys.argv[1:] if not a.startswith("--")]
+    store = "--store" in sys.argv
+    if len(args) != 2:
+        sys.exit(__doc__)
+    raw = open(args[0], "rb").read()
+    if raw[2:6] != b"MKOS":
+        sys.exit("lz4pack: %s has no MKOS header" % args[0])
+    off = struct.unpack_from("<I", raw, 10)[0]
+    boot, payload = bytearray(raw[:off]), raw[off:]
+
+    packed = b"" if store else compress(payload)
+    if not store:
+        assert decompress(packed, len(payload)) == payload
+    image = boot + (packed if packed else payload)
+    sectors = (len(image) + 511) // 512
+    if sectors > MAX_SECTORS:
+        sys.exit("lz4pack: %d sectors, the IPL loads at most %d" % (sectors, MAX_SECTORS))
+    struct.pack_into("<III", image, 6, sectors, off, len(packed))
+    struct.pack_into("<I", image, 18, len(payload))
+    open(args[1], "wb").write(image)
+
+    raw_sectors = (len(raw) + 511) // 512
+    sys.stderr.write("%s: %d bytes (%d sectors) -> %d bytes (%d sectors)%s\n" % (
+        args[1], len(raw), raw_sectors, len(image), sectors, " [stored]" if store else ""))
+
+
+if __name__ == "__main__":
+    main()
@@ -2,9 +2,15 @@
 """
 mkfs.py - Write test files into the Chocola simple filesystem on the disk image.
 
+Usage: mkfs.py IMAGE [FILE...]
+
+Each FILE (the ELF programs under user/) is stored under its base name
+after the built-in text files.
+
 Filesystem layout:
-  Sector 100      : directory (up to 16 entries, 32 bytes each)
-  Sector 110+     : file data
+  Sector 256      : directory (up to 16 entries, 32 bytes each)
+  Sector 257-264  : journal, 4 records of 2 sectors (written empty here)
+  Sector 266+     : file data
 
 Each directory entry (32 bytes):
   name   [20 bytes]  null-padded filename
@@ -12,10 +18,12 @@ Each directory entry (32 bytes):
   size   [4 bytes]   little-endian file size in bytes
   flags  [4 bytes]   reserved (0)
 """
-import struct, sys
+import os, struct, sys
 
-DIR_SECTOR  = 100
-DATA_START  = 110
+DIR_SECTOR  = 256   # after the kernel image (IPL loads at most 254 sectors from LBA 1)
+JOURNAL     = DIR_SECTOR + 1   # the kernel replays the newest record over the directory
+JOURNAL_LEN = 8
+DATA_START  = DIR_SECTOR + 10
 SECTOR_SIZE = 512
 
 # Files to include in the image
@@ -41,19 +49,25 @@ FILES = [
 ]
 
 def main():
-    if len(sys.argv) != 2:
-        print(f"Usage: {sys.argv[0]} <image>")
+    if len(sys.argv) < 2:
+        print(f"Usage: {sys.argv[0]} <image> [file...]")
         sys.exit(1)
 
     image_path = sys.argv[1]
+    files = [(name, content.encode("ascii")) for name, content in FILES]
+    for path in sys.argv[2:]:
+        name = os.path.basename(path)
+        if len(name) > 19:
+            sys.exit(f"mkfs: {name}: names are at most 19 characters")
+        files.append((name, open(path, "rb").read()))
+    if len(files) > 16:
+        sys.exit("mkfs: the directory holds at most 16 files")
 
     with open(image_path, "r+b") as f:
         cur_sector = DATA_START
         entries = []
 
-        for name, content in FILES:
-            data = content.encode("ascii")
-
+        for name, data in files:
             # Write file data
             f.seek(cur_sector * SECTOR_SIZE)
             f.write(data)
@@ -62,7 +76,9 @@ def main():
             entries.append((name, cur_sector, len(data)))
             cur_sector += sectors_needed
 
-        # Write directory at sector 100
+        # Write directory at DIR_SECTOR, with no journal records over it
+        f.seek(JOURNAL * SECTOR_SIZE)
+        f.write(bytes(JOURNAL_LEN * SECTOR_SIZE))
         f.seek(DIR_SECTOR * SECTOR_SIZE)
         for name, start, size in entries:
             entry = struct.pack("<20sIII",
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""
+trace2json.py - Convert a 'trace dump' from the serial console into
+Chrome trace JSON (load it in chrome://tracing or https://ui.perfetto.dev).
+
+Usage:
+  python3 trace2json.py < serial.log > trace.json
+
+Input lines (anything outside TRACE begin/end is ignored):
+  TRACE begin tsc_khz=<n> cpus=<n>
+  TASK <id> <name>
+  T <cpu> <tsc hex> <event> <arg hex>
+  TRACE end
+
+Each CPU becomes two rows: interrupts, softirqs, ATA commands and
+scrolls as nested slices on "cpuN", and the running task on "cpuN tasks".
+"""
+import json
+import sys
+
+# begin event -> (end event, slice name)
+SLICES = {
+    "irq":     ("irq_exit",     lambda a: "IRQ%d" % a),
+    "softirq": ("softirq_exit", lambda a: "softirq %#x" % a),
+    "ata_cmd": ("ata_done",     lambda a: "ATA %s %d" % ("write" if a >> 31 else "read", a & 0x7FFFFFFF)),
+    "scroll":  ("scroll_end",   lambda a: "vga_scroll"),
+}
+ENDS = {end for end, _ in SLICES.values()}
+
+
+def main():
+    khz, tasks, events = 0, {}, []
+    inside = False
+    for line in sys.stdin:
+        f = line.split()
+        if not f:
+            continue
+        if f[:2] == ["TRACE", "begin"]:
+            inside, tasks, events = True, {}, []
+            khz = int(dict(kv.split("=") for kv in f[2:]).get("tsc_khz", "0"))
+        elif f[:2] == ["TRACE", "end"]:
+            inside = False
+        elif inside and f[0] == "TASK" and len(f) >= 3:
+            tasks[int(f[1])] = f[2]
+        elif inside and f[0] == "T" and len(f) == 5:
+            events.append((int(f[2], 16), int(f[1]), f[3], int(f[4], 16)))
+    if not events or not khz:
+        sys.exit("trace2json: no trace found (need 'trace dump' output with tsc_khz)")
+
+    events.sort()
+    t0 = events[0][0]
+    us = lambda tsc: (tsc - t0) * 1000.0 / khz
+    name = lambda t: "%s (%d)" % (tasks.get(t, "?"), t)
+
+    out, running = [], {}
+    for cpu in sorted({e[1] for e in events}):
+        out.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": cpu * 2,
+                    "args": {"name": "cpu%d" % cpu}})
+        out.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": cpu * 2 + 1,
+                    "args": {"name": "cpu%d tasks" % cpu}})
+    for tsc, cpu, ev, arg in events:
+        ts = us(tsc)
+        if ev in SLICES:
+            out.append({"ph": "B", "name": SLICES[ev][1](arg), "pid": 0, "tid": cpu * 2, "ts": ts})
+        elif ev in ENDS:
+            out.append({"ph": "E", "pid": 0, "tid": cpu * 2, "ts": ts})
+        elif ev == "switch":
+            prev, nxt = arg >> 16, arg & 0xFFFF
+            if cpu in running:
+                out.append({"ph": "E", "pid": 0, "tid": cpu * 2 + 1, "ts": ts})
+            out.append({"ph": "B", "name": name(nxt), "pid": 0, "tid": cpu * 2 + 1, "ts": ts,
+                        "args": {"from": name(prev)}})
+            running[cpu] = nxt
+        else:
+            out.append({"ph": "i", "s": "t", "name": "%s %#x" % (ev, arg), "pid": 0,
+                        "tid": cpu * 2, "ts": ts})
+    json.dump({"traceEvents": out, "displayTimeUnit": "ns"}, sys.stdout)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+/*
+ * chocola user programs — entry point and console helpers
+ *
+ * The kernel starts a program at _start with argc, argv[] and a null
+ * pointer on the stack (System V i386 layout) and sys_fast in EAX.
+ * main's return value becomes the SYS_EXIT argument.
+ */
+#include "user/ulib.h"
+
+int sys_fast;
+
+__asm__(
+	".globl _start\n"
+	"_start:\n\t"
+	"movl %eax, sys_fast\n\t"
+	"movl (%esp), %edx\n\t"
+	"leal 4(%esp), %ecx\n\t"
+	"pushl %ecx\n\t"
+	"pushl %edx\n\t"
+	"call main\n\t"
+	"movl %eax, %ebx\n\t"
+	"1: movl $1, %eax\n\t"                 /* SYS_EXIT */
+	"int $0x80\n\t"
+	"jmp 1b");
+
+unsigned u_strlen(const char *s) { unsigned n = 0; while (s[n]) n++; return n; }
+
+void u_puts(const char *s) { syscall3(SYS_WRITE, (unsigned)s, u_strlen(s), 0); }
+
+void u_putint(unsigned n)
+{
+	char buf[12]; int i = 11;
+	buf[i] = 0;
+	do buf[--i] = (char)('0' + n % 10); while (n /= 10);
+	u_puts(buf + i);
+}
+
+void u_puthex(unsigned n)
+{
+	char buf[11]; int i;
+	buf[0] = '0'; buf[1] = 'x'; buf[10] = 0;
+	for (i = 9; i >= 2; i--, n >>= 4) buf[i] = "0123456789ABCDEF"[n & 15];
+	u_puts(buf);
+}
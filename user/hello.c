@@ -0,0 +1,32 @@
+/*
+ * hello.elf — arguments, the CPL and the edges of the address space
+ *
+ *   exec hello.elf [words...]   print them
+ *   exec hello.elf kernel       read kernel memory: the task is killed
+ */
+#include "user/ulib.h"
+
+static char greeting[] = "Hello from an ELF program";
+static unsigned counter;                /* .bss: a zero-filled page */
+
+int main(int argc, char **argv)
+{
+	unsigned cs;
+	int i;
+
+	__asm__ volatile("movw %%cs, %w0" : "=r"(cs));
+	u_puts(greeting);u_puts(" at CPL ");u_putint(cs & 3);
+	u_puts(sys_fast ? " (SYSENTER)\n" : " (INT 0x80)\n");
+	for (i = 0; i < argc; i++) {
+		u_puts("  argv[");u_putint((unsigned)i);u_puts("] = ");u_puts(argv[i]);u_puts("\n");
+		counter++;
+	}
+	u_puts("  main at ");u_puthex((unsigned)main);
+	u_puts(", stack at ");u_puthex((unsigned)&cs);u_puts("\n");
+	if (argc > 1 && argv[1][0] == 'k') {
+		u_puts("Reading kernel memory at 0x80000...\n");
+		u_putint(*(volatile unsigned *)0x80000);
+		u_puts("not reached\n");
+	}
+	return (int)counter;
+}
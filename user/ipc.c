@@ -0,0 +1,59 @@
+/*
+ * ipc.elf — ping-pong over ports, for 'ipcbench'
+ *
+ *   exec ipc.elf pong   echo every message on port "ping" back on "pong"
+ *   exec ipc.elf ping   time round trips of 64B and 64KB messages and
+ *                       send the totals to port "ipcbench"
+ *
+ * The buffer is page-aligned, so a 64KB message moves its pages from one
+ * address space to the other instead of being copied.
+ */
+#include "user/ulib.h"
+
+#define SMALL       64
+#define LARGE       65536
+#define SMALL_ITERS 20000
+#define LARGE_ITERS 2000
+
+static const unsigned sizes[2] = { SMALL, LARGE }, iters[2] = { SMALL_ITERS, LARGE_ITERS };
+static unsigned char buf[LARGE] __attribute__((aligned(4096)));
+
+static unsigned long long rdtsc(void)
+{
+	unsigned lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (unsigned long long)hi << 32 | lo;
+}
+
+int main(int argc, char **argv)
+{
+	int ping = syscall3(SYS_PORT, (unsigned)"ping", 0, 0), pong = syscall3(SYS_PORT, (unsigned)"pong", 0, 0);
+	int result = syscall3(SYS_PORT, (unsigned)"ipcbench", 0, 0), n;
+	unsigned res[4], k, i, bad = 0;
+	unsigned long long t;
+
+	if (argc < 2 || (argv[1][1] != 'i' && argv[1][1] != 'o')) { u_puts("Usage: exec ipc.elf ping|pong\n"); return 1; }
+	if (ping < 0 || pong < 0 || result < 0) { u_puts("No free port\n"); return 1; }
+	if (argv[1][1] == 'o') {
+		for (k = 0; k < 2; k++)
+			for (i = 0; i < iters[k]; i++) {
+				n = syscall3(SYS_RECV, (unsigned)ping, (unsigned)buf, LARGE);
+				syscall3(SYS_SEND, (unsigned)pong, (unsigned)buf, (unsigned)n);
+			}
+		return 0;
+	}
+	for (k = 0; k < 2; k++) {
+		t = rdtsc();
+		for (i = 0; i < iters[k]; i++) {
+			*(unsigned *)buf = i; buf[sizes[k] - 1] = (unsigned char)i;
+			syscall3(SYS_SEND, (unsigned)ping, (unsigned)buf, sizes[k]);
+			n = syscall3(SYS_RECV, (unsigned)pong, (unsigned)buf, LARGE);
+			bad += n != (int)sizes[k] || *(unsigned *)buf != i || buf[sizes[k] - 1] != (unsigned char)i;
+		}
+		t = rdtsc() - t;
+		res[0] = sizes[k]; res[1] = iters[k]; res[2] = (unsigned)t; res[3] = (unsigned)(t >> 32);
+		syscall3(SYS_SEND, (unsigned)result, (unsigned)res, sizeof(res));
+	}
+	if (bad) { u_putint(bad); u_puts(" replies came back wrong\n"); }
+	return (int)bad;
+}
@@ -0,0 +1,38 @@
+/*
+ * pages.elf — a 512KB program that touches only what it is asked to
+ *
+ *   exec pages.elf [N]   sum N pages of its table (default 4)
+ *
+ * The table is read-only data, so it is paged in from the file on first
+ * touch and shared with every other running pages.elf.
+ */
+#include "user/ulib.h"
+
+#define TABLE_PAGES 128
+
+#define R4(x)   x, x + 1, x + 2, x + 3
+#define R16(x)  R4(x), R4(x + 4), R4(x + 8), R4(x + 12)
+#define R64(x)  R16(x), R16(x + 16), R16(x + 32), R16(x + 48)
+#define R256(x) R64(x), R64(x + 64), R64(x + 128), R64(x + 192)
+#define R1K(x)  R256(x), R256(x + 256), R256(x + 512), R256(x + 768)
+
+/* Page p holds p*1024 .. p*1024+1023: non-zero, so it is in the file */
+static const unsigned table[TABLE_PAGES][1024] = {
+#define P4(p) { R1K((p) * 1024u) }, { R1K((p) * 1024u + 1024) }, { R1K((p) * 1024u + 2048) }, { R1K((p) * 1024u + 3072) }
+#define P16(p) P4(p), P4((p) + 4), P4((p) + 8), P4((p) + 12)
+	P16(0), P16(16), P16(32), P16(48), P16(64), P16(80), P16(96), P16(112)
+};
+
+int main(int argc, char **argv)
+{
+	unsigned n = 4, i, sum = 0;
+	const char *s;
+
+	if (argc > 1)
+		for (n = 0, s = argv[1]; *s >= '0' && *s <= '9'; s++) n = n * 10 + (unsigned)(*s - '0');
+	if (n > TABLE_PAGES) n = TABLE_PAGES;
+	for (i = 0; i < n; i++) sum += table[i * TABLE_PAGES / (n ? n : 1)][i];
+	u_puts("Touched ");u_putint(n);u_puts(" of ");u_putint(TABLE_PAGES);
+	u_puts(" table pages, sum ");u_putint(sum);u_puts("\n");
+	return 0;
+}
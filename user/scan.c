@@ -0,0 +1,77 @@
+/*
+ * scan.elf — read() against mmap over the same file
+ *
+ *   exec scan.elf FILE [N]   scan FILE N times each way (default 4)
+ *
+ * Both passes count newlines and sum the bytes. read() copies every page
+ * out of the page cache into a buffer; mmap maps the cache's frames and
+ * reads them in place, so after the first pass neither touches the disk
+ * and the difference is the copy.
+ */
+#include "user/ulib.h"
+
+#define BUF_SIZE 4096
+
+static unsigned char buf[BUF_SIZE];
+
+static unsigned rdtsc32(void)
+{
+	unsigned lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return lo;
+}
+
+static void scan(const unsigned char *p, unsigned n, unsigned *lines, unsigned *sum)
+{
+	unsigned i;
+	for (i = 0; i < n; i++) { *sum += p[i]; *lines += p[i] == '\n'; }
+}
+
+static void report(const char *name, unsigned cycles, unsigned bytes, unsigned lines, unsigned sum)
+{
+	u_puts("BENCH name=");u_puts(name);u_puts(" cycles=");u_putint(cycles);
+	u_puts(" bytes=");u_putint(bytes);u_puts(" lines=");u_putint(lines);
+	u_puts(" sum=");u_puthex(sum);u_puts("\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned size, n = 4, i, t0, cycles, lines, sum, addr;
+	const char *s;
+	int fd, r;
+
+	if (argc < 2) { u_puts("Usage: exec scan.elf FILE [N]\n"); return 1; }
+	if (argc > 2)
+		for (n = 0, s = argv[2]; *s >= '0' && *s <= '9'; s++) n = n * 10 + (unsigned)(*s - '0');
+	if (!n) n = 1;
+	for (cycles = 0, i = 0; i < n; i++) {
+		lines = sum = 0;
+		if ((fd = syscall3(SYS_OPEN, (unsigned)argv[1], (unsigned)&size, 0)) < 0) {
+			u_puts("Cannot open ");u_puts(argv[1]);u_puts("\n");
+			return 1;
+		}
+		t0 = rdtsc32();
+		while ((r = syscall3(SYS_READ, (unsigned)fd, (unsigned)buf, BUF_SIZE)) > 0)
+			scan(buf, (unsigned)r, &lines, &sum);
+		cycles += rdtsc32() - t0;
+		syscall3(SYS_CLOSE, (unsigned)fd, 0, 0);
+	}
+	report("scan_read", cycles / n, size, lines, sum);
+
+	fd = syscall3(SYS_OPEN, (unsigned)argv[1], 0, 0);
+
+	for (cycles = 0, i = 0; i < n; i++) {
+		lines = sum = 0;
+		t0 = rdtsc32();
+		if ((r = syscall3(SYS_MMAP, (unsigned)fd, 0, (unsigned)&addr)) < 0) {
+			u_puts("mmap failed: ");u_putint((unsigned)-r);u_puts("\n");
+			return 1;
+		}
+		scan((const unsigned char *)addr, size, &lines, &sum);
+		syscall3(SYS_MUNMAP, addr, 0, 0);
+		cycles += rdtsc32() - t0;
+	}
+	report("scan_mmap", cycles / n, size, lines, sum);
+	syscall3(SYS_CLOSE, (unsigned)fd, 0, 0);
+	return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * chocola user programs — what crt0.c provides
+ *
+ * No libc: programs talk to the kernel through kernel/syscall.h.
+ */
+#ifndef CHOCOLA_ULIB_H
+#define CHOCOLA_ULIB_H
+
+#include "kernel/syscall.h"
+
+unsigned u_strlen(const char *s);
+void u_puts(const char *s);
+void u_putint(unsigned n);
+void u_puthex(unsigned n);
+
+int main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * upcase.elf — edit a file in place through a writable mapping
+ *
+ *   exec upcase.elf FILE   upper-case FILE's ASCII letters
+ *
+ * Stores go to the page cache's frames; msync writes the dirty pages
+ * back to the file, only those and only once.
+ */
+#include "user/ulib.h"
+
+int main(int argc, char **argv)
+{
+	unsigned size, addr, i, changed = 0;
+	unsigned char *p;
+	int fd, r;
+
+	if (argc < 2) { u_puts("Usage: exec upcase.elf FILE\n"); return 1; }
+	if ((fd = syscall3(SYS_OPEN, (unsigned)argv[1], (unsigned)&size, 0)) < 0) {
+		u_puts("Cannot open ");u_puts(argv[1]);u_puts("\n");
+		return 1;
+	}
+	if ((r = syscall3(SYS_MMAP, (unsigned)fd, PROT_WRITE, (unsigned)&addr)) < 0) {
+		u_puts("mmap failed: ");u_putint((unsigned)-r);u_puts("\n");
+		return 1;
+	}
+	for (p = (unsigned char *)addr, i = 0; i < size; i++)
+		if (p[i] >= 'a' && p[i] <= 'z') { p[i] -= 'a' - 'A'; changed++; }
+	r = syscall3(SYS_MSYNC, addr, 0, 0);
+	u_puts(argv[1]);u_puts(": ");u_putint(changed);u_puts(" letters, ");
+	u_putint((unsigned)r);u_puts(" pages written back\n");
+	syscall3(SYS_MUNMAP, addr, 0, 0);
+	syscall3(SYS_CLOSE, (unsigned)fd, 0, 0);
+	return 0;
+}